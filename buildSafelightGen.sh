@@ -37,13 +37,14 @@ build_nacl_halide() {
   echo ">>>>>>>>> Buidling $1!"
 
   # Produces filter and corresponding stmt, assembly, and html files.
-  ${SAFELIGHT_DIR}/server/bin/filterFactory $1 $2 target=x86-64-nacl-register_metadata -e stmt,assembly,html
+  ${SAFELIGHT_DIR}/server/bin/filterFactory $1 $2 target=x86-64-nacl-${SAFELIGHT_TARGET_FEATURES} -e stmt,assembly,html
+  build_layout_variants $1 $2 x86-64-nacl-${SAFELIGHT_TARGET_FEATURES}
 
   # Build the safelight .nexe
   compile="${NACL_TOOLCHAIN_BIN}x86_64-nacl-clang++"
   compileFlags="${COMPILE_FLAGS}"
   includes="-I${NACL_PEPPER_INCLUDE} -I${SAFELIGHT_TMP}/filters"
-  deps="${SAFELIGHT_TMP}/nexe_shell.o ${SAFELIGHT_TMP}/packaged_call_runtime.o ${SAFELIGHT_TMP}/filters/$1.o ${SAFELIGHT_TMP}/nexe_verb_handler.o"
+  deps="${SAFELIGHT_TMP}/nexe_shell.o ${SAFELIGHT_TMP}/packaged_call_runtime.o ${SAFELIGHT_TMP}/filters/$1.o ${LAYOUT_VARIANT_OBJECTS} ${SAFELIGHT_TMP}/nexe_verb_handler.o"
   linkFlags="-L${SAFELIGHT_TMP} -lcopy_image -L${NEXE_RELEASE_DIR}_x86_64/Release ${NEXE_LINKING_FLAGS}"
   compileNexe="${compile} ${compileFlags} ${includes} ${deps} ${linkFlags} -o $1.nexe"
   echo "${compileNexe}"
@@ -52,6 +53,7 @@ build_nacl_halide() {
   mkdir -p $SAFELIGHT_OUTPUT
   mv $1.* $SAFELIGHT_OUTPUT
   mv $SAFELIGHT_TMP/filters/$1.* $SAFELIGHT_OUTPUT
+  rm -f $SAFELIGHT_TMP/filters/$1__*
  
   # We list the output files so that our server can store the file names into a FilterInfo object (see appbuilder_nexe.go).
   echo "Output:"
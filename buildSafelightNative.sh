@@ -0,0 +1,89 @@
+#!/bin/bash
+# Copyright 2015 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS-IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+# Script for building a Halide Safelight filter as a native (non-NaCl)
+# executable, so that it can be run and timed outside the NaCl sandbox.
+# Outputs the native shell executable and its corresponding .stmt, .s, and .html files.
+
+set -e
+
+source ${SAFELIGHT_DIR}/exportEnv.sh
+
+usage() {
+ echo ./`basename $0` [GENERATOR_NAME] [GENERATOR_SOURCE] [HALIDE_TARGET]
+ echo "  HALIDE_TARGET defaults to host; e.g. x86-64-avx2 or x86-64-avx2-avx512"
+ exit 85
+}
+
+# Builds the host-side dependencies of the native shell, once.
+# Targets: libcopy_image.a, jsoncpp.o, packaged_call_runtime.o
+build_native_deps() {
+  if [ -f ${SAFELIGHT_TMP}/native/packaged_call_runtime.o ]; then
+    return
+  fi
+  mkdir -p ${SAFELIGHT_TMP}/native
+  build_copy_image_filters "" "native"
+
+  pushd ${JSONCPP_DIR}
+  python amalgamate.py
+  popd
+  includes="-I${JSONCPP_DIR}/dist"
+  build_and_move_object_file "g++ -c -O2 ${includes} ${JSONCPP_DIR}/dist/jsoncpp.cpp" "jsoncpp.o" "native"
+
+  compileFlags="-c -O2 ${COMPILE_FLAGS} -std=c++11"
+  includes="-I${SAFELIGHT_DIR} -I${SAFELIGHT_TMP}/filters -I${HALIDE_DIR}/include"
+  build_and_move_object_file "g++ ${compileFlags} ${includes} ${SAFELIGHT_DIR}/visualizers/packaged_call_runtime.cc" "packaged_call_runtime.o" "native"
+}
+
+# Build native_halide first builds the Safelight filter with the Go filterFactory module,
+# then links it with native_shell.cc into a host executable.
+# All output files are moved to the $SAFELIGHT_OUTPUT directory and printed to
+# the console.
+# $1 Generator name
+# $2 Generator source
+# $3 Halide target (optional)
+build_native_halide() {
+  echo ">>>>>>>>> Building native $1!"
+  target=${3:-host}
+
+  # Produces filter and corresponding stmt, assembly, and html files.
+  ${SAFELIGHT_DIR}/server/bin/filterFactory $1 $2 target=${target}-${SAFELIGHT_TARGET_FEATURES} -e stmt,assembly,html
+  build_layout_variants $1 $2 ${target}-${SAFELIGHT_TARGET_FEATURES}
+
+  build_native_deps
+
+  compileFlags="-O2 ${COMPILE_FLAGS} -std=c++11"
+  includes="-I${SAFELIGHT_DIR} -I${SAFELIGHT_TMP}/filters -I${HALIDE_DIR}/include -I${JSONCPP_DIR}/dist"
+  deps="${SAFELIGHT_TMP}/native/packaged_call_runtime.o ${SAFELIGHT_TMP}/native/jsoncpp.o ${SAFELIGHT_TMP}/filters/$1.o ${LAYOUT_VARIANT_OBJECTS}"
+  linkFlags="-L${SAFELIGHT_TMP}/native -lcopy_image -ldl -lpthread"
+  compileNative="g++ ${compileFlags} ${includes} ${SAFELIGHT_DIR}/visualizers/native_shell.cc ${deps} ${linkFlags} -o $1"
+  echo "${compileNative}"
+  ${compileNative}
+
+  mkdir -p $SAFELIGHT_OUTPUT
+  mv $1 $SAFELIGHT_OUTPUT
+  mv $SAFELIGHT_TMP/filters/$1.* $SAFELIGHT_OUTPUT
+  rm -f $SAFELIGHT_TMP/filters/$1__*
+
+  echo "Output:"
+  ls -d ${SAFELIGHT_TMP}/output/* | grep "$1\(\.\|$\)"
+}
+
+if [ $# -lt 2 ]; then
+  usage
+fi
+
+build_native_halide $1 $2 $3
@@ -43,10 +43,24 @@ export SAFELIGHT_TMP="${SAFELIGHT_DIR}/bin/"
 export COMPILE_FLAGS="-Wall -Werror -Wno-unused-function -Wcast-qual -fno-rtti"
 export SAFELIGHT_PREBUILTDIR="${SAFELIGHT_TMP}/safelightPrebuiltNexeDir"
 export NEXE_RELEASE_DIR="${NACL_PEPPER_DIR}/lib/clang-newlib"
-export NEXE_LINKING_FLAGS="-Lhalide/bin -lppapi -lppapi_cpp"
+export NEXE_LINKING_FLAGS="-Lhalide/bin -lppapi -lppapi_cpp -lpthread"
 export SAFELIGHT_OUTPUT="${SAFELIGHT_TMP}/output/"
 export GOPATH="${SAFELIGHT_DIR}/server/"
 
+# Halide target features every Safelight filter is built with: user_context lets
+# the shells route halide_error() and halide_print() back to the request that made
+# the call. If SAFELIGHT_PROFILE is set, filters are also built with the Halide
+# profiler, and each call returns a per-Func breakdown of its time as "profile".
+# If SAFELIGHT_TRACE is set, filters report each Func realization to halide_trace(),
+# so that traced calls show them on their timeline.
+SAFELIGHT_TARGET_FEATURES="register_metadata-user_context"
+if [ -n "${SAFELIGHT_PROFILE}" ]; then
+  SAFELIGHT_TARGET_FEATURES="${SAFELIGHT_TARGET_FEATURES}-profile"
+fi
+if [ -n "${SAFELIGHT_TRACE}" ]; then
+  SAFELIGHT_TARGET_FEATURES="${SAFELIGHT_TARGET_FEATURES}-trace_realizations"
+fi
+
 COPY_TYPES=(uint8 uint16 float32)
 INPUT_TYPES=(float32 float64 int8 int16 int32 uint8 uint16 uint32)
 LAYOUTS=(chunky planar)
@@ -63,7 +77,32 @@ build_and_move_object_file() {
   mv $2 $SAFELIGHT_TMP/$3
 }
 
-# Builds copy_image_%s_filters, for each type (uint8, uint16, float32)
+# Optionally builds a variant of a filter for each of ${LAYOUTS}, so that packaged
+# calls can dispatch to whichever variant matches the layout of their inputs, rather
+# than copying the inputs into the layout the filter requires. Only done if
+# SAFELIGHT_LAYOUT_VARIANTS is set, and only for generators with a "layout"
+# GeneratorParam (see visualizers/set_image_param_layout.h).
+# Variants are named [filter name]__[layout] (see packaged_call_runtime.h).
+# Sets LAYOUT_VARIANT_OBJECTS to the object files of the variants that were built.
+# $1 Filter name
+# $2 Generator source
+# $3 Halide target
+build_layout_variants() {
+  LAYOUT_VARIANT_OBJECTS=""
+  if [ -z "${SAFELIGHT_LAYOUT_VARIANTS}" ]; then
+    return
+  fi
+  for layout in ${LAYOUTS[@]}; do
+    if ${SAFELIGHT_DIR}/server/bin/filterFactory $1__${layout} $2 layout=${layout} target=$3; then
+      LAYOUT_VARIANT_OBJECTS="${LAYOUT_VARIANT_OBJECTS} ${SAFELIGHT_TMP}/filters/$1__${layout}.o"
+    else
+      echo "Skipping the ${layout} variant of $1 (does its generator have a layout param?)"
+    fi
+  done
+}
+
+# Builds copy_image_%s_filters and downsample_image_%s_filters, for each type
+# (uint8, uint16, float32)
 # Target: libcopy_image.a
 # $1 "nacl" if we are building for nacl
 # $2 "tests/deps" if we are testing in order to separate testing dependencies from server dependencies
@@ -83,6 +122,10 @@ build_copy_image_filters() {
       input_elem_type=${i} target=${target}
     ${archiveCommand} rs $SAFELIGHT_TMP/$2/libcopy_image.a $SAFELIGHT_TMP/filters/copy_image_${i}_filter.o
     rm -rf $SAFELIGHT_TMP/filters/copy_image_${i}_filter.o
+    ${SAFELIGHT_DIR}/server/bin/filterFactory downsample_image_${i}_filter ${SAFELIGHT_DIR}/visualizers/downsample_image_generator.cc \
+      input_elem_type=${i} target=${target}
+    ${archiveCommand} rs $SAFELIGHT_TMP/$2/libcopy_image.a $SAFELIGHT_TMP/filters/downsample_image_${i}_filter.o
+    rm -rf $SAFELIGHT_TMP/filters/downsample_image_${i}_filter.o
   done
 }
 
@@ -19,15 +19,18 @@ package main
 import (
 	"crypto/sha256"
 	"encoding/hex"
+	"encoding/json"
 	"flag"
 	"fmt"
 	"io"
+	"io/ioutil"
 	"net/http"
 	"os"
 	"path/filepath"
 	"regexp"
 	"safelight"
 	"strings"
+	"sync"
 	"time"
 )
 
@@ -39,6 +42,7 @@ var (
 	cacheSize       = flag.Int("cacheSize", 32, "Size for LRU cache")
 	timeout         = flag.Duration("timeout", 5*60*time.Second, "timeout for building + running generator")
 	prebuiltNexeDir = flag.String("prebuiltNexeDir", os.Getenv("SAFELIGHT_PREBUILTDIR"), "prebuilt nexe dir")
+	maxTraceBytes   = flag.Int64("maxTraceBytes", 256<<20, "largest trace accepted by /trace, in bytes")
 )
 
 // Misc globals
@@ -47,9 +51,12 @@ var (
 	filterCache    safelight.FilterCache
 	logChan        chan string
 	logText        string
+	// The latest trace posted for each filter, keyed by signature and target.
+	traces     = map[string][]byte{}
+	tracesLock sync.Mutex
 )
 
-var filterCachePath = regexp.MustCompile("^/safelight_([0-9a-f]+)_(arm-32[^.]*|x86-32[^.]*|x86-64[^.]*).(nexe|s|stmt|html|nmf)$")
+var filterCachePath = regexp.MustCompile("^/safelight_([0-9a-f]+)_(arm-32[^.]*|x86-32[^.]*|x86-64[^.]*).(nexe|s|stmt|html|nmf|trace)$")
 var runfilesContentPath = regexp.MustCompile("^/([0-9a-zA-Z_/.-]+).(css|js|html|nexe)$")
 var extToContentType = map[string]string{
 	".css":  "text/css",
@@ -222,6 +229,18 @@ func handler(w http.ResponseWriter, r *http.Request) {
 				signature := m[1]
 				target := m[2]
 				ext := m[3]
+				if ext == "trace" {
+					trace := getTrace(signature, target)
+					if trace == nil {
+						http.NotFound(w, r)
+						return
+					}
+					w.Header().Set("Content-Type", "application/json")
+					if _, err := w.Write(trace); err != nil {
+						http.Error(w, err.Error(), http.StatusInternalServerError)
+					}
+					return
+				}
 				filterInfo := filterCache.Get(signature, target)
 				if filterInfo != nil {
 					if info := filterInfo.Info[ext]; info != nil {
@@ -247,12 +266,12 @@ func handler(w http.ResponseWriter, r *http.Request) {
 			http.NotFound(w, r)
 		}
 	} else if r.Method == "POST" {
-		logText = ""
 		values := r.URL.Query()
 
 		switch r.URL.Path {
 		case "/build":
 			{
+				logText = ""
 				target := oneString(values["target"])
 				pathToGen := oneString(values["pathToGen"])
 				functionName := oneString(values["functionName"])
@@ -278,6 +297,28 @@ func handler(w http.ResponseWriter, r *http.Request) {
 				w.Header().Set("Content-Type", "text/plain")
 				return
 			}
+		case "/trace":
+			{
+				signature := oneString(values["signature"])
+				target := oneString(values["target"])
+				filterInfo := filterCache.Get(signature, target)
+				if filterInfo == nil {
+					http.Error(w, "Unknown filter", http.StatusNotFound)
+					return
+				}
+				trace, err := ioutil.ReadAll(http.MaxBytesReader(w, r.Body, *maxTraceBytes))
+				if err != nil {
+					http.Error(w, err.Error(), http.StatusRequestEntityTooLarge)
+					return
+				}
+				err = saveTrace(filterInfo, trace)
+				if err != nil {
+					fmt.Printf("Error saving trace: %s\n", err)
+					http.Error(w, err.Error(), http.StatusInternalServerError)
+					return
+				}
+				return
+			}
 		default:
 			http.NotFound(w, r)
 			return
@@ -285,6 +326,33 @@ func handler(w http.ResponseWriter, r *http.Request) {
 	}
 }
 
+// saveTrace keeps a Chrome trace-event timeline of a call to the given filter, so that it can
+// be fetched as /safelight_<signature>_<target>.trace, and writes it next to the filter's build
+// artifacts. Only the latest trace of each filter is kept.
+func saveTrace(filterInfo *safelight.FilterInfo, trace []byte) error {
+	var parsed interface{}
+	if err := json.Unmarshal(trace, &parsed); err != nil {
+		return fmt.Errorf("Malformed trace: %v", err)
+	}
+	tracesLock.Lock()
+	traces[filterInfo.Signature+"_"+filterInfo.Target] = trace
+	tracesLock.Unlock()
+
+	outputDir := os.Getenv("SAFELIGHT_OUTPUT")
+	if outputDir == "" {
+		return nil
+	}
+	filename := filepath.Join(outputDir, fmt.Sprintf("safelight_%s_%s.trace.json", filterInfo.Signature, filterInfo.Target))
+	return ioutil.WriteFile(filename, trace, 0644)
+}
+
+// getTrace returns the latest trace saved by saveTrace for a filter, or nil if there is none.
+func getTrace(signature, target string) []byte {
+	tracesLock.Lock()
+	defer tracesLock.Unlock()
+	return traces[signature+"_"+target]
+}
+
 // addHandler registers handler h at the specified path.
 func addHandler(path string, h http.Handler) {
 	// wrap in handler to set (and later clear) basic request-scoped data
@@ -60,6 +60,12 @@ safelight.FilterManager = function($q,
   /** @private {string} */
   this.activeDevice_ = '';
 
+  /** @private {string} */
+  this.activeSignature_ = '';
+
+  /** @private {string} */
+  this.activeTarget_ = '';
+
   /** @private {number} */
   this.defaultBufferSideLength_ = 64;
 
@@ -118,6 +124,8 @@ safelight.FilterManager.prototype.loadFilter = function(buildInfo) {
   }
   this.activeNexeFilter_ = null;
   this.activeDevice_ = '';
+  this.activeSignature_ = signature;
+  this.activeTarget_ = target;
 
   var promise;
   if (device == 'chrome') {
@@ -178,6 +186,8 @@ safelight.FilterManager.prototype.unload = function() {
   }
   this.activeNexeFilter_ = null;
   this.activeDevice_ = '';
+  this.activeSignature_ = '';
+  this.activeTarget_ = '';
   this.arguments_ = [];
   this.values_ = {};
   this.onActiveFilterChanged_();
@@ -245,7 +255,15 @@ safelight.FilterManager.prototype.onActiveFilterChanged_ = function() {
  * The stdout/stderr log (if any) of the filter will be present in the Values
  * under the key '$log' (since Generator arguments cannot legally begin with
  * the '$' character, this will never overlap an argument name). Similarly,
- * the filter execution time (microseconds) will be in '$time_usec'.
+ * the filter execution time (microseconds) will be in '$time_usec', and
+ * a breakdown of the whole call by phase (microseconds) in '$phase_usec'.
+ * For filters built with the Halide profiler, '$profile' holds one entry per
+ * Func ({name, time_usec, percent, threads, allocs, alloc_bytes}); otherwise
+ * it's empty. '$memory' holds the filter's own allocations during the call
+ * ({current_bytes, peak_bytes, allocs, largest_alloc_bytes}).
+ * '$cache_hit' is true if the outputs were returned from the filter's cache,
+ * without running it (in which case '$time_usec' is that of the run that
+ * computed them).
  *
  * @param {!function(
  *         !Object<string, ?Object|boolean|number|string>)} listener The
@@ -337,6 +355,10 @@ safelight.FilterManager.prototype.processDescription_ = function(description) {
   var newValues = {};
   newValues['$log'] = '';
   newValues['$time_usec'] = 0;
+  newValues['$phase_usec'] = {};
+  newValues['$profile'] = [];
+  newValues['$memory'] = {};
+  newValues['$cache_hit'] = false;
   newValues['$pixels_processed'] = 0;
   for (var i = 0; i < newArguments.length; ++i) {
     /** @type {!safelight.Argument} */
@@ -411,12 +433,25 @@ safelight.FilterManager.prototype.buildInputsMap_ = function(useBase64) {
  * have Argument.isInput() == false will be replaced).
  *
  * If there is no active filter, or if the Values have been mutated into
- * invalid values, the Promise will fail.
+ * invalid values, the Promise will fail. NaCl runs that are still queued when
+ * run() is called again are dropped in favor of the newer one; their Promises
+ * fail with 'superseded', and the Values are left alone.
+ *
+ * If opt_trace is true, a NaCl run also records a timeline of its threads,
+ * which is posted to the server (see saveTrace_()).
+ *
+ * If opt_progressive is true, a NaCl run on large inputs first runs the
+ * filter on shrunken copies of them, and the outputs in the Values are
+ * replaced by that (smaller) preview as soon as it's ready, ahead of the
+ * final outputs.
  *
  * @param {number} numThreads number of threads to use when running the filter.
+ * @param {boolean=} opt_trace if true, record a trace of the run.
+ * @param {boolean=} opt_progressive if true, show a preview of the outputs.
  * @return {!angular.$q.Promise} promise Angular promise object.
  */
-safelight.FilterManager.prototype.run = function(numThreads) {
+safelight.FilterManager.prototype.run = function(numThreads, opt_trace,
+                                                 opt_progressive) {
   var $q = this.$q_;
 
   if (this.arguments_.length == 0) {
@@ -435,6 +470,9 @@ safelight.FilterManager.prototype.run = function(numThreads) {
     bufferFromDict = safelight.Buffer.fromDict;
     promise = this.activeNexeFilter_.request('call', {
       'num_threads': numThreads,
+      'coalesce': true,
+      'trace': !!opt_trace,
+      'progressive': !!opt_progressive,
       'inputs': this.buildInputsMap_(false)
     });
   } else if (this.activeDevice_) {
@@ -477,15 +515,31 @@ safelight.FilterManager.prototype.run = function(numThreads) {
       }
       changedValues['$log'] = success['log'] || '';
       changedValues['$time_usec'] = success['success']['time_usec'] || 0;
+      changedValues['$phase_usec'] = success['success']['phase_usec'] || {};
+      changedValues['$profile'] = success['success']['profile'] || [];
+      changedValues['$memory'] = success['success']['memory'] || {};
+      changedValues['$cache_hit'] = !!success['success']['cache_hit'];
       changedValues['$pixels_processed'] = pixelsProcessed;
+      if (success['success']['trace']) {
+        this.saveTrace_(success['success']['trace']);
+      }
       this.onValuesChanged(changedValues);
       deferred.resolve(this.values_);
     }.bind(this),
     function(failure) {
+      if (failure['failure'] == 'superseded') {
+        // A newer run will update the Values.
+        deferred.reject(failure['failure']);
+        return;
+      }
       var changedValues = {};
       // Use the failure message as the 'log' output
       changedValues['$log'] = failure['failure'] || '';
       changedValues['$time_usec'] = 0;
+      changedValues['$phase_usec'] = {};
+      changedValues['$profile'] = [];
+      changedValues['$memory'] = {};
+      changedValues['$cache_hit'] = false;
       changedValues['$pixels_processed'] = 0;
       for (var i = 0; i < this.arguments_.length; ++i) {
         var a = this.arguments_[i];
@@ -495,6 +549,19 @@ safelight.FilterManager.prototype.run = function(numThreads) {
       }
       this.onValuesChanged(changedValues);
       deferred.reject(failure['failure']);
+    }.bind(this),
+    function(partial) {
+      var preview = partial['outputs'];
+      if (!partial['preview'] || !preview) {
+        return;
+      }
+      var changedValues = {};
+      for (var name in preview) {
+        if (this.values_.hasOwnProperty(name)) {
+          changedValues[name] = bufferFromDict(preview[name]);
+        }
+      }
+      this.onValuesChanged(changedValues);
     }.bind(this)
   );
 
@@ -502,6 +569,26 @@ safelight.FilterManager.prototype.run = function(numThreads) {
 };
 
 
+/**
+ * saveTrace_() posts the Chrome trace-event JSON recorded by a run to the
+ * server, which saves it alongside the active filter's build artifacts.
+ * Failure to save it doesn't fail the run.
+ *
+ * @param {string} trace
+ * @private
+ */
+safelight.FilterManager.prototype.saveTrace_ = function(trace) {
+  /** @const */ var config = {
+    'params': {
+      'signature': this.activeSignature_,
+      'target': this.activeTarget_
+    },
+    'headers': {'Content-Type': 'application/json'}
+  };
+  this.$http_.post('/trace', trace, config);
+};
+
+
 /**
  * setDefaultBufferSideLength() will side length used to construct default
  * values for buffer arguments. Most clients will never need to call this,
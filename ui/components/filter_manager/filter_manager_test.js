@@ -171,6 +171,10 @@ describe('safelight.FilterManager', function() {
     $result_0: null,
     $log: '',
     $time_usec: 0,
+    $phase_usec: {},
+    $profile: [],
+    $memory: {},
+    $cache_hit: false,
     $pixels_processed: 0
   };
 
@@ -186,6 +190,10 @@ describe('safelight.FilterManager', function() {
     }),
     $log: EXPECTED_LOG,
     $time_usec: EXPECTED_TIME_USEC,
+    $phase_usec: {},
+    $profile: [],
+    $memory: {},
+    $cache_hit: false,
     $pixels_processed: EXPECTED_PIXELS_PROCESSED
   };
 
@@ -201,6 +209,10 @@ describe('safelight.FilterManager', function() {
     }),
     $log: EXPECTED_LOG,
     $time_usec: EXPECTED_TIME_USEC,
+    $phase_usec: {},
+    $profile: [],
+    $memory: {},
+    $cache_hit: false,
     $pixels_processed: EXPECTED_PIXELS_PROCESSED
   };
 
@@ -226,6 +238,10 @@ describe('safelight.FilterManager', function() {
     }),
     $log: EXPECTED_LOG,
     $time_usec: EXPECTED_TIME_USEC,
+    $phase_usec: {},
+    $profile: [],
+    $memory: {},
+    $cache_hit: false,
     $pixels_processed: EXPECTED_PIXELS_PROCESSED
   };
 
@@ -251,6 +267,10 @@ describe('safelight.FilterManager', function() {
     }),
     $log: EXPECTED_LOG,
     $time_usec: EXPECTED_TIME_USEC,
+    $phase_usec: {},
+    $profile: [],
+    $memory: {},
+    $cache_hit: false,
     $pixels_processed: EXPECTED_PIXELS_PROCESSED
   };
 
@@ -76,6 +76,7 @@ class NaclSnifferInstance : public NexeVerbHandlerInstance {
  public:
   explicit NaclSnifferInstance(PP_Instance instance)
       : NexeVerbHandlerInstance(instance) {}
+  virtual ~NaclSnifferInstance() { StopWorkers(); }
 
  protected:
   virtual void HandleVerb(const std::string& verb,
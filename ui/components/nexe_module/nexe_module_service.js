@@ -36,6 +36,11 @@ goog.provide('safelight.nexeModuleLoader.module');
  *
  *   { verb: "$response", id: "unique-string", failure: "error message" }
  *
+ * possibly preceded by any number of partial results (e.g. the tiles of a
+ * tiled call), which are delivered via the promise's notify callback:
+ *
+ *   { verb: "$partial", id: "unique-string", partial: { ... } }
+ *
  * Note that the the id field of the response is an arbitrary string and
  * always matches the id field of the request; NexeModule will ensure
  * that the response will only be delivered to the promise for the corresponding
@@ -193,9 +198,33 @@ safelight.NexeModule.prototype.request = function(verb, data) {
     'data': data
   };
   this.processRequest_(request, deferred);
+  deferred.promise['requestId'] = requestId;
   return deferred.promise;
 };
 
+/**
+ * Cancel a request made by request(). Its promise will be rejected with the
+ * failure 'canceled' (unless its response has already arrived). The promise
+ * returned will be resolved with {canceled: false} if the request had
+ * already completed.
+ *
+ * @param {!angular.$q.Promise} promise The promise returned by request()
+ * @return {!angular.$q.Promise} promise Angular promise object.
+ */
+safelight.NexeModule.prototype.cancel = function(promise) {
+  var requestId = promise['requestId'];
+  // If the module isn't loaded yet, the request hasn't been sent.
+  for (var i = 0; i < this.pendingRequests_.length; ++i) {
+    if (this.pendingRequests_[i]['request']['id'] == requestId) {
+      var deferred = this.pendingRequests_[i]['deferred'];
+      this.pendingRequests_.splice(i, 1);
+      deferred.reject({failure: 'canceled', log: ''});
+      return this.$q_.when({'success': {'canceled': true}, 'log': ''});
+    }
+  }
+  return this.request('cancel', {'id': requestId});
+};
+
 /**
  * Unload the .nexe module. Any pending requests will be rejected, as will
  * all future calls to request(). Call this only when you are completely
@@ -273,7 +302,12 @@ safelight.NexeModule.prototype.removeModule_ = function() {
  * @private
  */
 safelight.NexeModule.prototype.handleMessage_ = function(message) {
-  if (message.data['verb'] == '$response') {
+  if (message.data['verb'] == '$partial') {
+    var deferred = this.pendingResponses_[message.data['id']];
+    if (deferred) {
+      deferred.notify(message.data['partial']);
+    }
+  } else if (message.data['verb'] == '$response') {
     var requestId = message.data['id'];
     var deferred = this.pendingResponses_[requestId];
     if (deferred) {
@@ -52,5 +52,18 @@ describe('safelight.NexeModuleLoader', function() {
     expect(successVal).toBeUndefined();
     expect(failureVal).toEqual({failure: 'Load failed', log: ''});
   });
+
+  it('should cancel a request that has not been sent', function() {
+    var nexeModule = nexeModuleLoader.load('/foo.nmf');
+
+    var failureVal, cancelVal;
+    var promise = nexeModule.request('call', {});
+    promise.then(undefined, function(m) { failureVal = m; });
+    nexeModule.cancel(promise).then(function(m) { cancelVal = m; });
+    $timeout.flush();
+
+    expect(failureVal).toEqual({failure: 'canceled', log: ''});
+    expect(cancelVal).toEqual({success: {canceled: true}, log: ''});
+  });
 });
 
@@ -52,6 +52,12 @@ safelight.RunnerPanelController = function($scope,
   /** @export {boolean} */
   this.autoRun = true;
 
+  /** @export {boolean} */
+  this.trace = false;
+
+  /** @export {boolean} */
+  this.progressive = false;
+
   /** @private {!Object<string, boolean>} */
   this.inputNames_ = {};
 
@@ -69,6 +75,12 @@ safelight.RunnerPanelController = function($scope,
     // Ensure the cookie value is a bool, not a string
     this.autoRun = $cookies.autoRun == 'true';
   }
+  if ($cookies.trace !== undefined) {
+    this.trace = $cookies.trace == 'true';
+  }
+  if ($cookies.progressive !== undefined) {
+    this.progressive = $cookies.progressive == 'true';
+  }
   if ($cookies.numThreads !== undefined) {
     // Ensure the cookie value is a number, not a string
     this.numThreads = parseInt($cookies.numThreads, 10);
@@ -128,12 +140,17 @@ safelight.RunnerPanelController.prototype.run = function() {
   var $cookies = this.$cookies_;
   $cookies.autoRun = this.autoRun;
   $cookies.numThreads = this.numThreads;
-  this.filterManager_.run(this.numThreads).then(
+  $cookies.trace = this.trace;
+  $cookies.progressive = this.progressive;
+  this.filterManager_.run(this.numThreads, this.trace, this.progressive).then(
       function(success) {
         // nothing
       }.bind(this),
       function(failure) {
-        this.alerter_.error(failure);
+        // A superseded run isn't an error; a newer one is on its way.
+        if (failure != 'superseded') {
+          this.alerter_.error(failure);
+        }
       }.bind(this));
 };
 
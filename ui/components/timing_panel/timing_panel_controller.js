@@ -35,6 +35,31 @@ safelight.TimingPanelController = function($scope, filterManager) {
   /** @export @type {number} */
   this.mpixPerSec = 0;
 
+  /**
+   * Time spent in each phase of the call (unpacking, bounds query, etc).
+   * @export @type {!Array<{name: string, usec: number}>}
+   */
+  this.phases = [];
+
+  /**
+   * Per-Func profile of the call (if the filter was built with the Halide
+   * profiler), slowest Func first.
+   * @export @type {!Array<!Object>}
+   */
+  this.profile = [];
+
+  /**
+   * The filter's own allocations during the call, if reported.
+   * @export @type {!Object<string, number>}
+   */
+  this.memory = {};
+
+  /**
+   * True if the outputs came from the filter's cache, rather than a run.
+   * @export @type {boolean}
+   */
+  this.cacheHit = false;
+
   var listenerRemover =
       filterManager.addValuesChangedListener(function(values) {
         if (values.hasOwnProperty('$time_usec') &&
@@ -45,6 +70,25 @@ safelight.TimingPanelController = function($scope, filterManager) {
           var timeSec = this.timeUsec / 1e6;
           this.mpixPerSec = (timeSec > 0) ? (mpix / timeSec) : 0;
         }
+        if (values.hasOwnProperty('$phase_usec')) {
+          var phaseUsec = values['$phase_usec'] || {};
+          this.phases = [];
+          for (var name in phaseUsec) {
+            this.phases.push({name: name, usec: phaseUsec[name]});
+          }
+        }
+        if (values.hasOwnProperty('$cache_hit')) {
+          this.cacheHit = !!values['$cache_hit'];
+        }
+        if (values.hasOwnProperty('$memory')) {
+          this.memory = values['$memory'] || {};
+        }
+        if (values.hasOwnProperty('$profile')) {
+          this.profile = (values['$profile'] || []).slice();
+          this.profile.sort(function(a, b) {
+            return b['time_usec'] - a['time_usec'];
+          });
+        }
       }.bind(this));
   $scope.$on('$destroy', listenerRemover);
 };
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Halide.h"
+
+namespace {
+
+namespace BoundaryConditions = Halide::BoundaryConditions;
+
+// A simple filter to shrink an image by an integer factor in x and y, by
+// averaging each factor x factor block of pixels (a box filter). Output
+// pixel (x, y) covers input pixels [x * factor, (x + 1) * factor), so the
+// output need only be 1/factor the size of the input (rounded up); blocks
+// that overhang the edge of the input repeat its edge pixels. Channels (and
+// dimension 3) are left alone.
+class DownsampleImage : public Halide::Generator<DownsampleImage> {
+ public:
+  GeneratorParam<Halide::Type> input_elem_type_{"input_elem_type", UInt(8)};
+
+  // UInt(8) is a placeholder: we replace it with input_type
+  ImageParam input_{UInt(8), 4, "downsample_input"};
+  Param<int32_t> factor_{"factor", 2, 1, 64};
+
+  Func build() {
+    input_ = ImageParam{input_elem_type_, 4, "downsample_input"};
+    const Halide::Type type = input_elem_type_;
+
+    Var x("x"), y("y"), c("c"), w("w");
+
+    // Integer pixels are summed in 32 bits of the same signedness, which
+    // holds up to 64 x 64 blocks of 16-bit values. (Halide's integer
+    // division rounds down, so the rounding below is the same either way.)
+    const Halide::Type sum_type =
+        type.is_float() ? Float(32) : type.is_int() ? Int(32) : UInt(32);
+    Func clamped = BoundaryConditions::repeat_edge(input_);
+    RDom r(0, factor_, 0, factor_, "r");
+    Func sum("downsample_sum");
+    sum(x, y, c, w) = cast(sum_type, 0);
+    sum(x, y, c, w) += cast(sum_type, clamped(x * factor_ + r.x,
+                                              y * factor_ + r.y, c, w));
+
+    Expr count = cast(sum_type, factor_ * factor_);
+    Expr average = type.is_float() ? sum(x, y, c, w) / count
+                                   : (sum(x, y, c, w) + count / 2) / count;
+    Func output("downsample_output");
+    output(x, y, c, w) = cast(type, average);
+
+    const int kVectorSize = natural_vector_size(sum_type);
+    Expr vectorize = output.output_buffer().width() >= kVectorSize;
+
+    // As with copy_image; rows are independent, so parallelize over
+    // strips of them.
+    const int kSplitSize = 4;
+    Expr parallelize = output.output_buffer().height() > kSplitSize;
+
+    Var yi("yi");
+    output
+        .specialize(vectorize && parallelize)
+        .vectorize(x, kVectorSize)
+        .split(y, y, yi, kSplitSize)
+        .parallel(y);
+    sum.compute_at(output, x).vectorize(x, kVectorSize);
+    sum.update().vectorize(x, kVectorSize);
+
+    input_.set_stride(0, Expr());
+    output.output_buffer().set_stride(0, Expr());
+
+    return output;
+  }
+};
+
+Halide::RegisterGenerator<DownsampleImage> register_downsample_image{
+    "downsample_image"};
+
+}  // namespace
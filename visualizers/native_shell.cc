@@ -0,0 +1,634 @@
+/*
+ * Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// native_shell is the native (non-NaCl) counterpart to nexe_shell: it links
+// against filters built for an ordinary x86-64 target (e.g. x86-64-avx2)
+// and speaks the same verb protocol, so filters can be run and timed with
+// the same code we ship.
+//
+// Messages are newline-delimited JSON, read from stdin (or from each
+// connection to a Unix-domain socket, if --socket=<path> is given), with
+// responses written back the same way:
+//
+//   { "verb": "call", "id": "unique-string", "data": { ... } }
+//   { "verb": "$response", "id": "unique-string", "success": { ... } }
+//
+// Tiled calls also write a partial result line for each tile, and
+// progressive calls one for their preview, ahead of the response:
+//
+//   { "verb": "$partial", "id": "unique-string", "partial": { ... } }
+//
+// Buffer contents ("host") are base64-encoded strings, as with the
+// device path in FilterManager; arrays of numbers are also accepted
+// on input.
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "visualizers/packaged_call_runtime.h"
+#include "json/json.h"
+#include "HalideRuntime.h"
+
+namespace {
+
+using packaged_call_runtime::ArgumentPackagerJson;
+using packaged_call_runtime::BuildHalideFilterInfoMap;
+using packaged_call_runtime::HalideFilterInfo;
+using packaged_call_runtime::HalideFilterInfoMap;
+using packaged_call_runtime::MakePackagedCall;
+using packaged_call_runtime::MakePackagedCallBatch;
+using packaged_call_runtime::MetadataToJSON;
+using packaged_call_runtime::PackagedCallState;
+using packaged_call_runtime::ReleaseInputs;
+using packaged_call_runtime::ScalingSweepThreadCounts;
+using packaged_call_runtime::SetNumThreads;
+using packaged_call_runtime::UploadInputs;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+string Base64Encode(const uint8_t* data, size_t len) {
+  string out;
+  out.reserve(((len + 2) / 3) * 4);
+  size_t i = 0;
+  for (; i + 2 < len; i += 3) {
+    const uint32_t v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+    out += kBase64Chars[(v >> 18) & 63];
+    out += kBase64Chars[(v >> 12) & 63];
+    out += kBase64Chars[(v >> 6) & 63];
+    out += kBase64Chars[v & 63];
+  }
+  if (i < len) {
+    uint32_t v = data[i] << 16;
+    if (i + 1 < len) v |= data[i + 1] << 8;
+    out += kBase64Chars[(v >> 18) & 63];
+    out += kBase64Chars[(v >> 12) & 63];
+    out += (i + 1 < len) ? kBase64Chars[(v >> 6) & 63] : '=';
+    out += '=';
+  }
+  return out;
+}
+
+bool Base64Decode(const string& s, vector<uint8_t>* out) {
+  int8_t table[256];
+  memset(table, -1, sizeof(table));
+  for (int i = 0; i < 64; ++i) {
+    table[static_cast<uint8_t>(kBase64Chars[i])] = static_cast<int8_t>(i);
+  }
+  out->clear();
+  out->reserve((s.size() / 4) * 3);
+  uint32_t acc = 0;
+  int bits = 0;
+  for (char ch : s) {
+    if (ch == '=') break;
+    const int8_t v = table[static_cast<uint8_t>(ch)];
+    if (v < 0) return false;
+    acc = (acc << 6) | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out->push_back(static_cast<uint8_t>((acc >> bits) & 0xff));
+    }
+  }
+  return true;
+}
+
+// Package* == Json::Value* (jsoncpp)
+class ArgumentPackagerNative : public ArgumentPackagerJson {
+ public:
+  ArgumentPackagerNative(const Json::Value& message, Json::Value* results)
+      : input_message_(new JsonValueNative(message)),
+        output_message_(new JsonValueNative(results)) {}
+
+  // Tiles of a tiled call, and the preview of a progressive one, are
+  // passed to handler as they're packed, rather than being accumulated in
+  // the results.
+  void set_partial_handler(std::function<void(const Json::Value&)> handler) {
+    partial_handler_ = handler;
+  }
+
+ protected:
+  class JsonValueNative : public JsonValue {
+   public:
+    // Wrap a value by copy (used for the input message and for
+    // newly-created values).
+    explicit JsonValueNative(const Json::Value& var)
+        : owned_(var), var_(&owned_) {}
+    // Wrap a value by reference (used for the output message, so that
+    // results land in the caller's Json::Value).
+    explicit JsonValueNative(Json::Value* var) : var_(var) {}
+
+    bool IsUndefined() const override { return var_->isNull(); }
+    bool IsMap() const override { return var_->isObject(); }
+    bool AsBool(bool* value) const override {
+      if (var_->isBool()) {
+        *value = var_->asBool();
+        return true;
+      }
+      return false;
+    }
+    bool AsInt32(int32_t* value) const override {
+      if (var_->isNumeric()) {
+        *value = static_cast<int32_t>(var_->asInt());
+        return true;
+      }
+      return false;
+    }
+    bool AsDouble(double* value) const override {
+      if (var_->isNumeric()) {
+        *value = var_->asDouble();
+        return true;
+      }
+      return false;
+    }
+    bool AsByteArray(vector<uint8_t>* v) const override {
+      if (var_->isString()) {
+        return Base64Decode(var_->asString(), v);
+      }
+      if (var_->isArray()) {
+        const int len = var_->size();
+        v->resize(len);
+        for (int i = 0; i < len; ++i) {
+          (*v)[i] = static_cast<uint8_t>((*var_)[i].asInt());
+        }
+        return true;
+      }
+      return false;
+    }
+    bool AsInt32Array(vector<int32_t>* v) const override {
+      if (var_->isArray()) {
+        const int len = var_->size();
+        v->resize(len);
+        for (int i = 0; i < len; ++i) {
+          (*v)[i] = static_cast<int32_t>((*var_)[i].asInt());
+        }
+        return true;
+      }
+      return false;
+    }
+    unique_ptr<JsonValue> GetMember(const string& key) const override {
+      Json::Value var;
+      if (var_->isObject()) {
+        var = (*var_)[key];
+      }
+      return unique_ptr<JsonValue>(new JsonValueNative(var));
+    }
+    bool SetMember(const string& key,
+                   const unique_ptr<JsonValue>& value) override {
+      if (var_->isObject()) {
+        (*var_)[key] = *static_cast<const JsonValueNative*>(value.get())->var_;
+        return true;
+      }
+      return false;
+    }
+    size_t ArrayLength() const override {
+      return var_->isArray() ? var_->size() : 0;
+    }
+    unique_ptr<JsonValue> GetElement(size_t i) const override {
+      Json::Value var;
+      if (var_->isArray() && i < var_->size()) {
+        var = (*var_)[static_cast<Json::ArrayIndex>(i)];
+      }
+      return unique_ptr<JsonValue>(new JsonValueNative(var));
+    }
+    bool AppendElement(const unique_ptr<JsonValue>& value) override {
+      if (var_->isArray()) {
+        var_->append(*static_cast<const JsonValueNative*>(value.get())->var_);
+        return true;
+      }
+      return false;
+    }
+
+    const Json::Value& GetVar() const { return *var_; }
+
+   private:
+    Json::Value owned_;
+    Json::Value* var_;
+  };
+
+  unique_ptr<JsonValue> NewMap() const override {
+    return unique_ptr<JsonValue>(
+        new JsonValueNative(Json::Value(Json::objectValue)));
+  }
+
+  unique_ptr<JsonValue> NewArray() const override {
+    return unique_ptr<JsonValue>(
+        new JsonValueNative(Json::Value(Json::arrayValue)));
+  }
+
+  unique_ptr<JsonValue> NewInt32Array(const int32_t* data,
+                                      size_t len) const override {
+    Json::Value array_buf(Json::arrayValue);
+    array_buf.resize(len);
+    for (Json::ArrayIndex i = 0; i < len; ++i) {
+      array_buf[i] = data[i];
+    }
+    return unique_ptr<JsonValue>(new JsonValueNative(array_buf));
+  }
+
+  unique_ptr<JsonValue> NewByteArray(const uint8_t* data,
+                                     size_t len) const override {
+    return unique_ptr<JsonValue>(
+        new JsonValueNative(Json::Value(Base64Encode(data, len))));
+  }
+
+  unique_ptr<JsonValue> NewInt32(int32_t i) const override {
+    return unique_ptr<JsonValue>(new JsonValueNative(Json::Value(i)));
+  }
+
+  unique_ptr<JsonValue> NewDouble(double d) const override {
+    return unique_ptr<JsonValue>(new JsonValueNative(Json::Value(d)));
+  }
+
+  unique_ptr<JsonValue> NewBool(bool b) const override {
+    return unique_ptr<JsonValue>(new JsonValueNative(Json::Value(b)));
+  }
+
+  unique_ptr<JsonValue> NewString(const string& s) const override {
+    return unique_ptr<JsonValue>(new JsonValueNative(Json::Value(s)));
+  }
+
+  const JsonValue* GetInputMessage() const override {
+    return input_message_.get();
+  }
+
+  JsonValue* GetOutputMessage() const override { return output_message_.get(); }
+
+  bool EmitResultTile(const unique_ptr<JsonValue>& tile) override {
+    if (!partial_handler_) return ArgumentPackagerJson::EmitResultTile(tile);
+    partial_handler_(static_cast<const JsonValueNative*>(tile.get())->GetVar());
+    return true;
+  }
+
+  bool EmitResultPreview(const unique_ptr<JsonValue>& preview) override {
+    if (!partial_handler_) {
+      return ArgumentPackagerJson::EmitResultPreview(preview);
+    }
+    partial_handler_(
+        static_cast<const JsonValueNative*>(preview.get())->GetVar());
+    return true;
+  }
+
+ private:
+  unique_ptr<JsonValue> input_message_;
+  unique_ptr<JsonValue> output_message_;
+  std::function<void(const Json::Value&)> partial_handler_;
+};
+
+class NativeShell;
+
+// As with NexeVerbHandlerInstance, halide_error() and halide_print() may be
+// called from arbitrary Halide threadpool workers, so we route them through
+// an ordinary global rather than thread-local storage. NativeShell handles
+// one message at a time, so there is at most one active shell.
+NativeShell* gActiveShell = nullptr;
+std::mutex gActiveShellMutex;
+
+class NativeShell {
+ public:
+  NativeShell() {
+    // ignore result, since failure results in empty map, which is fine
+    (void)BuildHalideFilterInfoMap(&filter_info_);
+  }
+
+  // Handle a single message, returning the response to be written; any
+  // partial results are written to out as they become available.
+  string HandleMessage(const string& line, FILE* out) {
+    std::lock_guard<std::mutex> active_lock(gActiveShellMutex);
+    gActiveShell = this;
+    ClearLog();
+    response_ = Json::Value(Json::objectValue);
+    out_ = out;
+
+    Json::Value message;
+    Json::Reader reader;
+    if (!reader.parse(line, message) || !message.isObject()) {
+      active_id_ = "$unknown";
+      Failure("badly formed message");
+    } else {
+      active_id_ = message["id"].asString();
+      // An empty id would suppress the response entirely, which isn't
+      // useful for a line-oriented protocol.
+      if (active_id_.empty()) active_id_ = "$unknown";
+      HandleVerb(message["verb"].asString(), message["data"]);
+    }
+    // Ensure that exactly one response is sent for each message.
+    Failure("no response");
+
+    gActiveShell = nullptr;
+    out_ = nullptr;
+    Json::FastWriter writer;
+    return writer.write(response_);
+  }
+
+  void Log(const string& msg) {
+    std::lock_guard<std::mutex> lock(log_mutex_);
+    log_ << msg;
+  }
+
+  void Failure(const string& error) {
+    // Ensure that only one response per id is allowed.
+    if (!active_id_.empty()) {
+      std::lock_guard<std::mutex> lock(log_mutex_);
+      response_["verb"] = "$response";
+      response_["id"] = active_id_;
+      response_["failure"] = error;
+      if (!log_.str().empty()) {
+        response_["log"] = log_.str();
+      }
+      active_id_.clear();
+    }
+  }
+
+ private:
+  HalideFilterInfoMap filter_info_;
+  // Persists across calls, so that repeated calls with the same inputs
+  // can reuse the same call plan, and so that uploaded inputs stay
+  // resident.
+  PackagedCallState call_state_;
+  string active_id_;
+  Json::Value response_;
+  FILE* out_ = nullptr;
+
+  // Access to log_ is controlled by log_mutex_.
+  std::ostringstream log_;
+  std::mutex log_mutex_;
+
+  void HandleVerb(const string& verb, const Json::Value& message) {
+    if (verb == "describe") {
+      string name = message["packaged_call_name"].asString();
+      const HalideFilterInfo* info = FindFilterInfo(name);
+      if (!info) {
+        // We've already called Failure() in FindFilterInfo().
+        return;
+      }
+      string json_raw;
+      if (!MetadataToJSON(info->metadata, &json_raw)) {
+        Failure("Unable to construct description");
+        return;
+      }
+      Json::Value results(Json::objectValue);
+      results["description"] = json_raw;
+      Success(results);
+    } else if (verb == "call" || verb == "call_batch" ||
+               verb == "scaling_sweep") {
+      const int max_threads =
+          std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+      // For scaling_sweep, num_threads is the largest thread count to try,
+      // defaulting to all of them.
+      int threads = message["num_threads"].asInt();
+      if (threads < 1) threads = verb == "scaling_sweep" ? max_threads : 1;
+      if (threads > max_threads) threads = max_threads;
+      SetNumThreads(threads);
+      string name = message["packaged_call_name"].asString();
+      const HalideFilterInfo* info = FindFilterInfo(name);
+      if (!info) {
+        // We've already called Failure() in FindFilterInfo().
+        return;
+      }
+      Json::Value results(Json::objectValue);
+      ArgumentPackagerNative packager(message, &results);
+      if (verb == "scaling_sweep") {
+        packager.set_thread_counts(ScalingSweepThreadCounts(threads));
+      }
+      packager.set_partial_handler(
+          [this](const Json::Value& partial) { Partial(partial); });
+      int result =
+          verb == "call_batch"
+              ? MakePackagedCallBatch(this, *info, &packager, &call_state_)
+              : MakePackagedCall(this, *info, &packager, &call_state_);
+      if (result != 0) {
+        // We've already called Failure() via the halide_error overload.
+        return;
+      }
+      Success(results);
+    } else if (verb == "upload_input") {
+      string name = message["packaged_call_name"].asString();
+      const HalideFilterInfo* info = FindFilterInfo(name);
+      if (!info) {
+        // We've already called Failure() in FindFilterInfo().
+        return;
+      }
+      Json::Value results(Json::objectValue);
+      ArgumentPackagerNative packager(message, &results);
+      if (UploadInputs(this, *info, &packager, &call_state_) != 0) {
+        // We've already called Failure() via the halide_error overload.
+        return;
+      }
+      Success(results);
+    } else if (verb == "release") {
+      Json::Value results(Json::objectValue);
+      ArgumentPackagerNative packager(message, &results);
+      if (ReleaseInputs(this, &packager, &call_state_) != 0) {
+        // We've already called Failure() via the halide_error overload.
+        return;
+      }
+      Success(results);
+    } else {
+      Failure("unknown verb");
+    }
+  }
+
+  void Success(const Json::Value& success) {
+    // Ensure that only one response per id is allowed.
+    if (!active_id_.empty()) {
+      std::lock_guard<std::mutex> lock(log_mutex_);
+      response_["verb"] = "$response";
+      response_["id"] = active_id_;
+      response_["success"] = success;
+      if (!log_.str().empty()) {
+        response_["log"] = log_.str();
+      }
+      active_id_.clear();
+    }
+  }
+
+  void Partial(const Json::Value& partial) {
+    // Partial results are only meaningful before the response.
+    if (active_id_.empty() || !out_) return;
+    Json::Value message(Json::objectValue);
+    message["verb"] = "$partial";
+    message["id"] = active_id_;
+    message["partial"] = partial;
+    Json::FastWriter writer;
+    fputs(writer.write(message).c_str(), out_);
+    fflush(out_);
+  }
+
+  void ClearLog() {
+    std::lock_guard<std::mutex> lock(log_mutex_);
+    log_.str("");
+  }
+
+  const HalideFilterInfo* FindFilterInfo(const string& packaged_call_name) {
+    if (packaged_call_name.empty()) {
+      if (filter_info_.size() == 1) {
+        return &filter_info_.begin()->second;
+      }
+      string msg("Expected exactly one name, found: (");
+      for (auto info : filter_info_) {
+        msg += info.first + " ";
+      }
+      msg += ")";
+      Failure(msg);
+      return nullptr;
+    } else {
+      auto it = filter_info_.find(packaged_call_name);
+      if (it != filter_info_.end()) {
+        return &it->second;
+      }
+      Failure("Could not find name: (" + packaged_call_name + ")");
+      return nullptr;
+    }
+  }
+};
+
+// Read newline-delimited messages from in until EOF, writing one response
+// line to out for each.
+void ServeStream(NativeShell* shell, FILE* in, FILE* out) {
+  char* line = nullptr;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, in)) != -1) {
+    if (len <= 1) continue;  // skip blank lines
+    string response = shell->HandleMessage(string(line, len), out);
+    fputs(response.c_str(), out);
+    fflush(out);
+  }
+  free(line);
+}
+
+int ServeSocket(NativeShell* shell, const string& path) {
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return 1;
+  }
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path.c_str());
+    close(listener);
+    return 1;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  // Calls run unsandboxed, so only our own user may connect; the socket is
+  // created without group or other permissions in the first place, rather
+  // than restricted after the fact.
+  const mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+  const int bind_status =
+      bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  umask(old_umask);
+  if (bind_status != 0 || listen(listener, 1) != 0) {
+    perror("bind/listen");
+    close(listener);
+    return 1;
+  }
+  // Connections are served one at a time; each may carry any number
+  // of messages.
+  for (;;) {
+    int conn = accept(listener, nullptr, nullptr);
+    if (conn < 0) {
+      perror("accept");
+      break;
+    }
+    FILE* in = fdopen(conn, "r");
+    FILE* out = fdopen(dup(conn), "w");
+    if (in && out) {
+      ServeStream(shell, in, out);
+    }
+    if (in) fclose(in);
+    if (out) fclose(out);
+  }
+  close(listener);
+  unlink(path.c_str());
+  return 1;
+}
+
+}  // namespace
+
+extern "C" {
+
+void halide_print(void* /* user_context */, const char* msg) {
+  if (gActiveShell) {
+    gActiveShell->Log(msg);
+  } else {
+    fputs(msg, stderr);
+  }
+}
+
+void halide_error(void* /* user_context */, const char* msg) {
+  if (gActiveShell) {
+    gActiveShell->Failure(msg);
+  } else {
+    fputs(msg, stderr);
+  }
+}
+
+// Account for each call's intermediate allocations (see MemoryStats).
+void* halide_malloc(void* user_context, size_t x) {
+  return packaged_call_runtime::TrackedMalloc(user_context, x);
+}
+
+void halide_free(void* user_context, void* ptr) {
+  packaged_call_runtime::TrackedFree(user_context, ptr);
+}
+
+}  // extern "C"
+
+int main(int argc, char** argv) {
+  static const char kSocketFlag[] = "--socket=";
+  string socket_path;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], kSocketFlag, strlen(kSocketFlag)) == 0) {
+      socket_path = argv[i] + strlen(kSocketFlag);
+    } else {
+      fprintf(stderr, "Usage: %s [--socket=<path>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Calls run on Halide's thread pool unless they ask for work_stealing.
+  halide_set_custom_do_par_for(&packaged_call_runtime::WorkStealingDoParFor);
+  // Calls record a timeline only if they ask for a trace.
+  halide_set_custom_do_task(&packaged_call_runtime::TracingDoTask);
+  halide_set_custom_trace(&packaged_call_runtime::TracingTrace);
+
+  NativeShell shell;
+  if (!socket_path.empty()) {
+    return ServeSocket(&shell, socket_path);
+  }
+  ServeStream(&shell, stdin, stdout);
+  return 0;
+}
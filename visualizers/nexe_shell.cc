@@ -19,8 +19,10 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <functional>
 #include <sstream>
 
+#include "visualizers/buffer_utils_pepper.h"
 #include "visualizers/packaged_call_runtime.h"
 #include "visualizers/nexe_verb_handler.h"
 #include "ppapi/cpp/instance.h"
@@ -32,14 +34,22 @@
 
 namespace {
 
+using packaged_call_runtime::ArgumentPackagerBinary;
 using packaged_call_runtime::ArgumentPackagerJson;
 using packaged_call_runtime::ArgvFunc;
 using packaged_call_runtime::BuildHalideFilterInfoMap;
 using packaged_call_runtime::HalideFilterInfo;
 using packaged_call_runtime::HalideFilterInfoMap;
 using packaged_call_runtime::MakePackagedCall;
+using packaged_call_runtime::MakePackagedCallBatch;
 using packaged_call_runtime::MetadataToJSON;
 using packaged_call_runtime::NexeVerbHandlerInstance;
+using packaged_call_runtime::PackagedCallState;
+using packaged_call_runtime::ReleaseInputs;
+using packaged_call_runtime::ScalingSweepThreadCounts;
+using packaged_call_runtime::SetNumThreads;
+using packaged_call_runtime::UploadInputs;
+using packaged_call_runtime::pepper::VarArrayBufferLocker;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -78,6 +88,13 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
       : input_message_(new JsonValuePepper(message)),
         output_message_(new JsonValuePepper(results)) {}
 
+  // Tiles of a tiled call, and the preview of a progressive one, are
+  // passed to handler as they're packed, rather than being accumulated in
+  // the results.
+  void set_partial_handler(std::function<void(const pp::Var&)> handler) {
+    partial_handler_ = handler;
+  }
+
  protected:
   class JsonValuePepper : public JsonValue {
    public:
@@ -127,6 +144,7 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
       }
       return false;
     }
+    const pp::Var& GetVar() const { return var_; }
     unique_ptr<JsonValue> GetMember(const string& key) const override {
       pp::Var member;
       if (var_.is_dictionary()) {
@@ -143,6 +161,25 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
       }
       return false;
     }
+    size_t ArrayLength() const override {
+      return var_.is_array() ? pp::VarArray(var_).GetLength() : 0;
+    }
+    unique_ptr<JsonValue> GetElement(size_t i) const override {
+      pp::Var element;
+      if (var_.is_array()) {
+        element = pp::VarArray(var_).Get(i);
+      }
+      return unique_ptr<JsonValue>(new JsonValuePepper(element));
+    }
+    bool AppendElement(const unique_ptr<JsonValue>& value) override {
+      if (var_.is_array()) {
+        pp::VarArray array(var_);
+        const pp::Var& element =
+            static_cast<const JsonValuePepper*>(value.get())->var_;
+        return array.Set(array.GetLength(), element);
+      }
+      return false;
+    }
 
    private:
     pp::Var var_;
@@ -152,6 +189,10 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
     return unique_ptr<JsonValue>(new JsonValuePepper(pp::VarDictionary()));
   }
 
+  unique_ptr<JsonValue> NewArray() const override {
+    return unique_ptr<JsonValue>(new JsonValuePepper(pp::VarArray()));
+  }
+
   unique_ptr<JsonValue> NewInt32Array(const int32_t* data,
                                       size_t len) const override {
     pp::VarArray array_buf;
@@ -170,6 +211,15 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
     return unique_ptr<JsonValue>(new JsonValuePepper(data_buf));
   }
 
+  // The ArrayBuffer stays mapped until the packager is destroyed.
+  unique_ptr<JsonValue> NewMappedByteArray(size_t len,
+                                           uint8_t** data) override {
+    pp::VarArrayBuffer data_buf(len);
+    locked_buffers_.emplace_back(new VarArrayBufferLocker(data_buf));
+    *data = static_cast<uint8_t*>(locked_buffers_.back()->GetPtr());
+    return unique_ptr<JsonValue>(new JsonValuePepper(data_buf));
+  }
+
   unique_ptr<JsonValue> NewInt32(int32_t i) const override {
     return unique_ptr<JsonValue>(new JsonValuePepper(pp::Var(i)));
   }
@@ -178,6 +228,10 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
     return unique_ptr<JsonValue>(new JsonValuePepper(pp::Var(d)));
   }
 
+  unique_ptr<JsonValue> NewBool(bool b) const override {
+    return unique_ptr<JsonValue>(new JsonValuePepper(pp::Var(b)));
+  }
+
   unique_ptr<JsonValue> NewString(const string& s) const override {
     return unique_ptr<JsonValue>(new JsonValuePepper(pp::Var(s)));
   }
@@ -188,20 +242,70 @@ class ArgumentPackagerPepper : public ArgumentPackagerJson {
 
   JsonValue* GetOutputMessage() const override { return output_message_.get(); }
 
+  // Input ArrayBuffers are mapped in place, and stay mapped until the
+  // packager is destroyed (i.e., until the call is complete).
+  bool BorrowByteArray(const JsonValue& value, const uint8_t** data,
+                       size_t* len) override {
+    const pp::Var& var = static_cast<const JsonValuePepper&>(value).GetVar();
+    if (!var.is_array_buffer()) return false;
+    pp::VarArrayBuffer array_buffer(var);
+    locked_buffers_.emplace_back(new VarArrayBufferLocker(array_buffer));
+    *data = static_cast<const uint8_t*>(locked_buffers_.back()->GetPtr());
+    *len = array_buffer.ByteLength();
+    return *data != nullptr;
+  }
+
+  bool EmitResultTile(const unique_ptr<JsonValue>& tile) override {
+    if (!partial_handler_) return ArgumentPackagerJson::EmitResultTile(tile);
+    partial_handler_(static_cast<const JsonValuePepper*>(tile.get())->GetVar());
+    return true;
+  }
+
+  bool EmitResultPreview(const unique_ptr<JsonValue>& preview) override {
+    if (!partial_handler_) {
+      return ArgumentPackagerJson::EmitResultPreview(preview);
+    }
+    partial_handler_(
+        static_cast<const JsonValuePepper*>(preview.get())->GetVar());
+    return true;
+  }
+
  private:
   unique_ptr<JsonValue> input_message_;
   unique_ptr<JsonValue> output_message_;
+  vector<unique_ptr<VarArrayBufferLocker>> locked_buffers_;
+  std::function<void(const pp::Var&)> partial_handler_;
 };
 
+// Number of verbs that may be handled at once (e.g. a describe, or a
+// second call, while a slow call runs). All calls share the Halide thread
+// pool, so running more than a few at once wouldn't help.
+const int kNumWorkers = 4;
+
 class NaclShellInstance : public NexeVerbHandlerInstance {
  public:
   explicit NaclShellInstance(PP_Instance instance)
-      : NexeVerbHandlerInstance(instance) {
+      : NexeVerbHandlerInstance(instance, kNumWorkers) {
     // ignore result, since failure results in empty map, which is fine
     (void)BuildHalideFilterInfoMap(&filter_info_);
   }
+  // HandleVerb() uses our members, so the worker must stop before they're
+  // destroyed.
+  ~NaclShellInstance() override { StopWorkers(); }
 
  protected:
+  // A call with "coalesce" set supersedes any earlier calls to the same
+  // filter, queued or running (e.g. as a parameter is scrubbed, only the
+  // latest value runs to completion).
+  string CoalescingKey(const string& verb,
+                       const pp::VarDictionary& message) override {
+    pp::Var coalesce = message.Get("coalesce");
+    if (verb != "call" || !coalesce.is_bool() || !coalesce.AsBool()) {
+      return string();
+    }
+    return verb + ":" + message.Get("packaged_call_name").AsString();
+  }
+
   virtual void HandleVerb(const string& verb,
                           const pp::VarDictionary& message) {
     if (verb == "describe") {
@@ -219,26 +323,78 @@ class NaclShellInstance : public NexeVerbHandlerInstance {
       pp::VarDictionary results;
       results.Set("description", json_raw);
       Success(results);
-    } else if (verb == "call") {
+    } else if (verb == "call" || verb == "call_batch" ||
+               verb == "scaling_sweep") {
+      // For scaling_sweep, num_threads is the largest thread count to try
+      // (there's no portable way to ask for the core count from inside
+      // the sandbox, so the page supplies it).
       int threads = message.Get("num_threads").AsInt();
       if (threads < 1) threads = 1;
       if (threads > 32) threads = 32;
-      halide_set_num_threads(threads);
+      // Note that the thread count is global to the Halide runtime, so
+      // concurrent calls with different counts may interfere.
+      SetNumThreads(threads);
       string name = message.Get("packaged_call_name").AsString();
       const HalideFilterInfo* info = FindFilterInfo(name);
       if (!info) {
         // We've already called Failure() in FindFilterInfo().
         return;
       }
+      pp::Var binary = message.Get("binary");
+      if (verb == "call" && binary.is_array_buffer()) {
+        HandleBinaryCall(*info, pp::VarArrayBuffer(binary));
+        return;
+      }
       pp::VarDictionary results;
-      ArgumentPackagerPepper packager(message, results);
-      int result =
-          MakePackagedCall(this, info->metadata, info->argv_func, &packager);
+      int result;
+      {
+        // The packager must be destroyed (unmapping any ArrayBuffers it
+        // holds) before the results are posted.
+        ArgumentPackagerPepper packager(message, results);
+        if (verb == "scaling_sweep") {
+          packager.set_thread_counts(ScalingSweepThreadCounts(threads));
+        }
+        packager.set_partial_handler([this](const pp::Var& partial) {
+          Partial(pp::VarDictionary(partial));
+        });
+        // The user_context routes halide_error() and halide_print() back
+        // to this request, whichever thread they're called from.
+        void* uc = user_context();
+        result = verb == "call_batch"
+                     ? MakePackagedCallBatch(uc, *info, &packager, &call_state_)
+                     : MakePackagedCall(uc, *info, &packager, &call_state_);
+      }
       if (result != 0) {
         // We've already called Failure() via the halide_error overload.
         return;
       }
       Success(results);
+    } else if (verb == "upload_input") {
+      string name = message.Get("packaged_call_name").AsString();
+      const HalideFilterInfo* info = FindFilterInfo(name);
+      if (!info) {
+        // We've already called Failure() in FindFilterInfo().
+        return;
+      }
+      pp::VarDictionary results;
+      int result;
+      {
+        ArgumentPackagerPepper packager(message, results);
+        result = UploadInputs(user_context(), *info, &packager, &call_state_);
+      }
+      if (result != 0) {
+        // We've already called Failure() via the halide_error overload.
+        return;
+      }
+      Success(results);
+    } else if (verb == "release") {
+      pp::VarDictionary results;
+      ArgumentPackagerPepper packager(message, results);
+      if (ReleaseInputs(user_context(), &packager, &call_state_) != 0) {
+        // We've already called Failure() via the halide_error overload.
+        return;
+      }
+      Success(results);
     } else {
       Failure("unknown verb");
     }
@@ -246,6 +402,35 @@ class NaclShellInstance : public NexeVerbHandlerInstance {
 
  private:
   HalideFilterInfoMap filter_info_;
+  // Persists across calls, so that repeated calls with the same inputs
+  // can reuse the same call plan, and so that uploaded inputs stay
+  // resident. (It's shared by all the workers.)
+  PackagedCallState call_state_;
+
+  // A call whose arguments are all in the "binary" ArrayBuffer (see
+  // ArgumentPackagerBinary); the results are returned the same way.
+  void HandleBinaryCall(const HalideFilterInfo& info,
+                        const pp::VarArrayBuffer& binary) {
+    pp::VarDictionary results;
+    {
+      // Keep the message mapped until the call is complete, since the
+      // inputs are used in place.
+      VarArrayBufferLocker message(binary);
+      ArgumentPackagerBinary packager(
+          info.metadata, static_cast<const uint8_t*>(message.GetPtr()),
+          binary.ByteLength());
+      if (MakePackagedCall(user_context(), info, &packager, &call_state_) !=
+          0) {
+        // We've already called Failure() via the halide_error overload.
+        return;
+      }
+      pp::VarArrayBuffer encoded(packager.ResultsSize());
+      VarArrayBufferLocker locked(encoded);
+      packager.EncodeResults(static_cast<uint8_t*>(locked.GetPtr()));
+      results.Set("binary", encoded);
+    }
+    Success(results);
+  }
 
   const HalideFilterInfo* FindFilterInfo(const string& packaged_call_name) {
     if (packaged_call_name.empty()) {
@@ -270,9 +455,31 @@ class NaclShellInstance : public NexeVerbHandlerInstance {
   }
 };
 
+// Returned from the tasks of a canceled call; it's never reported, since
+// the request has already been answered.
+const int kCanceledError = -6510;
+
+// Check for cancellation at each parallel task boundary, so that a
+// canceled call stops using the Halide thread pool as soon as possible.
+// (Serial stages run to completion; the result is then discarded.)
+int CancelableDoTask(void* user_context, halide_task_t f, int idx,
+                     uint8_t* closure) {
+  if (NexeVerbHandlerInstance::IsCanceled(user_context)) {
+    return kCanceledError;
+  }
+  return packaged_call_runtime::TracingDoTask(user_context, f, idx, closure);
+}
+
 class NaclShellModule : public pp::Module {
  public:
-  NaclShellModule() : pp::Module() {}
+  NaclShellModule() : pp::Module() {
+    halide_set_custom_do_task(&CancelableDoTask);
+    // Calls record a timeline only if they ask for a trace.
+    halide_set_custom_trace(&packaged_call_runtime::TracingTrace);
+    // Calls run on Halide's thread pool unless they ask for work_stealing.
+    halide_set_custom_do_par_for(
+        &packaged_call_runtime::WorkStealingDoParFor);
+  }
 
   virtual pp::Instance* CreateInstance(PP_Instance instance) {
     return new NaclShellInstance(instance);
@@ -288,12 +495,21 @@ Module* CreateModule() { return new NaclShellModule(); }
 
 extern "C" {
 
-void halide_print(void* /* user_context */, const char* msg) {
-  NexeVerbHandlerInstance::AttemptLog(msg);
+void halide_print(void* user_context, const char* msg) {
+  NexeVerbHandlerInstance::AttemptLog(user_context, msg);
+}
+
+void halide_error(void* user_context, const char* msg) {
+  NexeVerbHandlerInstance::AttemptFailure(user_context, msg);
+}
+
+// Account for each request's intermediate allocations (see MemoryStats).
+void* halide_malloc(void* user_context, size_t x) {
+  return packaged_call_runtime::TrackedMalloc(user_context, x);
 }
 
-void halide_error(void* /* user_context */, const char* msg) {
-  NexeVerbHandlerInstance::AttemptFailure(msg);
+void halide_free(void* user_context, void* ptr) {
+  packaged_call_runtime::TrackedFree(user_context, ptr);
 }
 
 }  // extern "C"
@@ -19,7 +19,12 @@
 #include <pthread.h>
 #include <sys/types.h>
 
+#include <set>
+
 #include "visualizers/nexe_verb_handler.h"
+#include "ppapi/cpp/completion_callback.h"
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/module.h"
 
 namespace packaged_call_runtime {
 namespace {
@@ -37,114 +42,441 @@ class Locker {
   Locker& operator=(const Locker&);  // unimplemented
 };
 
-// Note that we explicitly do *not* want thread-local storage here;
-// we need to rely on this value being valid when called from arbitrary
-// Halide threadpool workers. Instead, we use an ordinary global, and
-// control write access to it via a mutex; in practice, this limits
-// us to a single NexeVerbHandler active at any given time
-// (which is a totally reasonable limitation for our purposes).
-NexeVerbHandlerInstance* gActiveInstance = NULL;
-pthread_mutex_t gActiveInstanceMutex = PTHREAD_MUTEX_INITIALIZER;
-
-// ActiveInstanceSetter is a simple RAII wrapper to set gActiveInstance,
-// as controlled by gActiveInstanceMutex.
-class ActiveInstanceSetter {
+// Every request being handled, across all instances, so that
+// halide_error() and halide_print() can check that a user_context is
+// really one of ours. Access is controlled by gActiveRequestsMutex.
+std::set<VerbRequest*> gActiveRequests;
+pthread_mutex_t gActiveRequestsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The request being handled by each worker thread.
+pthread_key_t gThreadRequestKey;
+pthread_once_t gThreadRequestKeyOnce = PTHREAD_ONCE_INIT;
+
+void CreateThreadRequestKey() { pthread_key_create(&gThreadRequestKey, NULL); }
+
+VerbRequest* GetThreadRequest() {
+  pthread_once(&gThreadRequestKeyOnce, &CreateThreadRequestKey);
+  return static_cast<VerbRequest*>(pthread_getspecific(gThreadRequestKey));
+}
+
+// ActiveRequestSetter is a simple RAII wrapper to register a request as
+// active, and as the request of the calling thread, for its lifetime.
+class ActiveRequestSetter {
  public:
-  explicit ActiveInstanceSetter(NexeVerbHandlerInstance* instance)
-      : locker_(&gActiveInstanceMutex) {
-    gActiveInstance = instance;
+  explicit ActiveRequestSetter(VerbRequest* request) : request_(request) {
+    pthread_once(&gThreadRequestKeyOnce, &CreateThreadRequestKey);
+    pthread_setspecific(gThreadRequestKey, request_);
+    Locker lock(&gActiveRequestsMutex);
+    gActiveRequests.insert(request_);
+  }
+  ~ActiveRequestSetter() {
+    Locker lock(&gActiveRequestsMutex);
+    gActiveRequests.erase(request_);
+    pthread_setspecific(gThreadRequestKey, NULL);
   }
-  ~ActiveInstanceSetter() { gActiveInstance = NULL; }
 
  private:
-  Locker locker_;
+  VerbRequest* request_;
+  explicit ActiveRequestSetter(const ActiveRequestSetter&);    // unimplemented
+  ActiveRequestSetter& operator=(const ActiveRequestSetter&);  // unimplemented
 };
 
+// The worker threads run filters (and so the Halide runtime), which can
+// need rather more stack than the default.
+const size_t kWorkerStackSize = 4 << 20;
+
+// A message to be posted on the main thread on behalf of an instance,
+// which may have been destroyed by the time it's posted.
+struct PendingPost {
+  PP_Instance instance;
+  pp::Var message;
+};
+
+pp::VarDictionary MakeResponse(const std::string& id, const char* key,
+                               const pp::Var& value) {
+  pp::VarDictionary response;
+  response.Set("verb", "$response");
+  response.Set("id", id);
+  response.Set(key, value);
+  return response;
+}
+
 }  // namespace
 
-NexeVerbHandlerInstance::NexeVerbHandlerInstance(PP_Instance instance)
-    : pp::Instance(instance) {
+VerbRequest::VerbRequest(NexeVerbHandlerInstance* instance,
+                         const std::string& verb, const std::string& id,
+                         const std::string& coalescing_key, uint64_t sequence)
+    : instance_(instance),
+      verb_(verb),
+      id_(id),
+      coalescing_key_(coalescing_key),
+      sequence_(sequence),
+      responded_(false),
+      canceled_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+VerbRequest::~VerbRequest() { pthread_mutex_destroy(&mutex_); }
+
+void VerbRequest::Success(const pp::VarDictionary& success) {
+  Respond("success", success);
+}
+
+void VerbRequest::Failure(const std::string& error) {
+  Respond("failure", error);
+}
+
+void VerbRequest::Respond(const char* key, const pp::Var& value) {
+  Locker lock(&mutex_);
+  // Ensure that only one response per id is allowed.
+  if (responded_ || id_.empty()) return;
+  pp::VarDictionary response = MakeResponse(id_, key, value);
+  if (!log_.str().empty()) {
+    response.Set("log", log_.str());
+  }
+  NexeVerbHandlerInstance* instance = instance_;
+  const auto post = [instance, &response] {
+    instance->PostFromAnyThread(response);
+  };
+  if (coalescing_key_.empty()) {
+    post();
+  } else if (!instance_->coalescing_.RespondUnlessSuperseded(
+                 coalescing_key_, sequence_, post)) {
+    // A later request with the same key has been received, so this one's
+    // result is stale.
+    canceled_.store(true, std::memory_order_release);
+    response = MakeResponse(id_, "failure",
+                            NexeVerbHandlerInstance::kSupersededFailure);
+    if (!log_.str().empty()) {
+      response.Set("log", log_.str());
+    }
+    post();
+  }
+  responded_ = true;
+}
+
+void VerbRequest::Partial(const pp::VarDictionary& partial) {
+  Locker lock(&mutex_);
+  // Partial results are only meaningful before the response.
+  if (responded_ || id_.empty()) return;
+  pp::VarDictionary message;
+  message.Set("verb", "$partial");
+  message.Set("id", id_);
+  message.Set("partial", partial);
+  NexeVerbHandlerInstance* instance = instance_;
+  const auto post = [instance, &message] {
+    instance->PostFromAnyThread(message);
+  };
+  if (coalescing_key_.empty()) {
+    post();
+  } else {
+    // Stale partial results are simply dropped.
+    instance_->coalescing_.RespondUnlessSuperseded(coalescing_key_, sequence_,
+                                                   post);
+  }
+}
+
+void VerbRequest::Log(const std::string& msg) {
+  Locker lock(&mutex_);
+  log_ << msg;
+}
+
+void VerbRequest::Cancel() {
+  canceled_.store(true, std::memory_order_release);
+  Failure(NexeVerbHandlerInstance::kCanceledFailure);
+}
+
+void VerbRequest::Supersede() {
+  canceled_.store(true, std::memory_order_release);
+  Failure(NexeVerbHandlerInstance::kSupersededFailure);
+}
+
+const char NexeVerbHandlerInstance::kCanceledFailure[] = "canceled";
+const char NexeVerbHandlerInstance::kSupersededFailure[] = "superseded";
+
+NexeVerbHandlerInstance::NexeVerbHandlerInstance(PP_Instance instance,
+                                                 int num_workers)
+    : pp::Instance(instance), stopping_(false) {
   // Can't use PTHREAD_MUTEX_INITIALIZER for a member variable without C++11;
   // just use pthread_mutex_init() instead. Sigh.
-  pthread_mutex_init(&log_mutex_, NULL);
+  pthread_mutex_init(&queue_mutex_, NULL);
+  pthread_cond_init(&queue_cond_, NULL);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, kWorkerStackSize);
+  for (int i = 0; i < num_workers; ++i) {
+    pthread_t worker;
+    if (pthread_create(&worker, &attr, &WorkerMain, this) == 0) {
+      workers_.push_back(worker);
+    }
+  }
+  pthread_attr_destroy(&attr);
 }
 
 NexeVerbHandlerInstance::~NexeVerbHandlerInstance() {
-  pthread_mutex_destroy(&log_mutex_);
+  StopWorkers();
+  pthread_cond_destroy(&queue_cond_);
+  pthread_mutex_destroy(&queue_mutex_);
 }
 
 void NexeVerbHandlerInstance::HandleMessage(const pp::Var& var_message) {
-  ActiveInstanceSetter setter(this);
-  ClearLog();
-
-  if (!var_message.is_dictionary()) {
-    Failure("badly formed message");
+  // Without an id, there's no way to respond, so just drop it.
+  if (!var_message.is_dictionary()) return;
+  pp::VarDictionary message(var_message);
+  const std::string id = message.Get("id").AsString();
+  const std::string verb = message.Get("verb").AsString();
+  pp::VarDictionary data(message.Get("data"));
+  if (verb == "cancel") {
+    // Handle it here, rather than queueing it behind the request it's
+    // meant to cancel.
+    HandleCancel(id, data.Get("id").AsString());
     return;
   }
-  pp::VarDictionary d(var_message);
-  active_verb_ = d.Get("verb").AsString();
-  active_id_ = d.Get("id").AsString();
-  HandleVerb(active_verb_, pp::VarDictionary(d.Get("data")));
+  QueuedRequest queued;
+  queued.message = var_message;
+  queued.coalescing_key = CoalescingKey(verb, data);
+  queued.sequence = 0;
+  if (!queued.coalescing_key.empty()) {
+    // From here on, no earlier request with the key can respond.
+    queued.sequence = coalescing_.Receive(queued.coalescing_key);
+    SupersedeActiveRequests(queued.coalescing_key);
+  }
+  std::vector<std::string> superseded;
+  bool queued_ok = false;
+  {
+    Locker lock(&queue_mutex_);
+    if (!queued.coalescing_key.empty()) {
+      for (std::deque<QueuedRequest>::iterator it = queue_.begin();
+           it != queue_.end();) {
+        if (it->coalescing_key == queued.coalescing_key) {
+          superseded.push_back(
+              pp::VarDictionary(it->message).Get("id").AsString());
+          it = queue_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    if (!workers_.empty() && queue_.size() < kMaxQueuedRequests) {
+      queue_.push_back(queued);
+      pthread_cond_signal(&queue_cond_);
+      queued_ok = true;
+    }
+  }
+  // We're on the main thread, and no worker has seen these requests, so
+  // respond directly.
+  for (size_t i = 0; i < superseded.size(); ++i) {
+    if (!superseded[i].empty()) {
+      PostMessage(MakeResponse(superseded[i], "failure", kSupersededFailure));
+    }
+  }
+  if (queued_ok) return;
+  if (!id.empty()) {
+    PostMessage(MakeResponse(id, "failure",
+                             workers_.empty() ? "no worker threads"
+                                              : "too many queued requests"));
+  }
 }
 
-void NexeVerbHandlerInstance::Success(const pp::VarDictionary& success) {
-  // Ensure that only one response per id is allowed.
-  if (!active_id_.empty()) {
-    Locker lock(&log_mutex_);
-    pp::VarDictionary response;
-    response.Set("verb", "$response");
-    response.Set("id", active_id_);
-    response.Set("success", success);
-    if (!log_.str().empty()) {
-      response.Set("log", log_.str());
+void NexeVerbHandlerInstance::StopWorkers() {
+  {
+    Locker lock(&queue_mutex_);
+    stopping_ = true;
+    queue_.clear();
+    pthread_cond_broadcast(&queue_cond_);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    pthread_join(workers_[i], NULL);
+  }
+  workers_.clear();
+}
+
+void NexeVerbHandlerInstance::HandleCancel(const std::string& id,
+                                           const std::string& cancel_id) {
+  bool canceled = false;
+  if (!cancel_id.empty()) {
+    {
+      Locker lock(&queue_mutex_);
+      for (std::deque<QueuedRequest>::iterator it = queue_.begin();
+           it != queue_.end(); ++it) {
+        if (pp::VarDictionary(it->message).Get("id").AsString() ==
+            cancel_id) {
+          queue_.erase(it);
+          canceled = true;
+          break;
+        }
+      }
     }
-    PostMessage(response);
-    active_id_.clear();
+    if (canceled) {
+      // No worker has seen it, so respond directly.
+      PostMessage(MakeResponse(cancel_id, "failure", kCanceledFailure));
+    } else {
+      Locker lock(&gActiveRequestsMutex);
+      for (std::set<VerbRequest*>::iterator it = gActiveRequests.begin();
+           it != gActiveRequests.end(); ++it) {
+        VerbRequest* request = *it;
+        if (request->instance() == this && request->id() == cancel_id) {
+          request->Cancel();
+          canceled = true;
+        }
+      }
+    }
+  }
+  if (!id.empty()) {
+    pp::VarDictionary success;
+    success.Set("canceled", canceled);
+    PostMessage(MakeResponse(id, "success", success));
   }
 }
 
-void NexeVerbHandlerInstance::Failure(const std::string& error) {
-  // Ensure that only one response per id is allowed.
-  if (!active_id_.empty()) {
-    Locker lock(&log_mutex_);
-    pp::VarDictionary response;
-    response.Set("verb", "$response");
-    response.Set("id", active_id_);
-    response.Set("failure", error);
-    if (!log_.str().empty()) {
-      response.Set("log", log_.str());
+void NexeVerbHandlerInstance::SupersedeActiveRequests(
+    const std::string& coalescing_key) {
+  Locker lock(&gActiveRequestsMutex);
+  for (std::set<VerbRequest*>::iterator it = gActiveRequests.begin();
+       it != gActiveRequests.end(); ++it) {
+    VerbRequest* request = *it;
+    if (request->instance() == this &&
+        request->coalescing_key() == coalescing_key) {
+      request->Supersede();
     }
-    PostMessage(response);
-    active_id_.clear();
   }
 }
 
+std::string NexeVerbHandlerInstance::CoalescingKey(
+    const std::string& verb, const pp::VarDictionary& data) {
+  return std::string();
+}
+
+void* NexeVerbHandlerInstance::WorkerMain(void* instance) {
+  static_cast<NexeVerbHandlerInstance*>(instance)->RunWorker();
+  return NULL;
+}
+
+void NexeVerbHandlerInstance::RunWorker() {
+  for (;;) {
+    QueuedRequest queued;
+    {
+      Locker lock(&queue_mutex_);
+      while (queue_.empty() && !stopping_) {
+        pthread_cond_wait(&queue_cond_, &queue_mutex_);
+      }
+      if (stopping_) return;
+      queued = queue_.front();
+      queue_.pop_front();
+    }
+
+    pp::VarDictionary d(queued.message);
+    VerbRequest request(this, d.Get("verb").AsString(), d.Get("id").AsString(),
+                        queued.coalescing_key, queued.sequence);
+    ActiveRequestSetter setter(&request);
+    // A later request may have been received since this one was dequeued,
+    // but before it became active (and so could be superseded).
+    if (!queued.coalescing_key.empty() &&
+        coalescing_.IsSuperseded(queued.coalescing_key, queued.sequence)) {
+      request.Supersede();
+      continue;
+    }
+    HandleVerb(request.verb(), pp::VarDictionary(d.Get("data")));
+  }
+}
+
+void NexeVerbHandlerInstance::PostFromAnyThread(const pp::Var& message) {
+  pp::Core* core = pp::Module::Get()->core();
+  if (core->IsMainThread()) {
+    PostMessage(message);
+    return;
+  }
+  PendingPost* pending = new PendingPost;
+  pending->instance = pp_instance();
+  pending->message = message;
+  core->CallOnMainThread(0, pp::CompletionCallback(&PostOnMainThread, pending));
+}
+
+void NexeVerbHandlerInstance::PostOnMainThread(void* pending, int32_t result) {
+  PendingPost* post = static_cast<PendingPost*>(pending);
+  pp::Instance* instance =
+      pp::Module::Get()->InstanceForPPInstance(post->instance);
+  if (instance) {
+    instance->PostMessage(post->message);
+  }
+  delete post;
+}
+
+void NexeVerbHandlerInstance::Success(const pp::VarDictionary& success) {
+  VerbRequest* request = GetThreadRequest();
+  if (request) request->Success(success);
+}
+
+void NexeVerbHandlerInstance::Failure(const std::string& error) {
+  VerbRequest* request = GetThreadRequest();
+  if (request) request->Failure(error);
+}
+
+void NexeVerbHandlerInstance::Partial(const pp::VarDictionary& partial) {
+  VerbRequest* request = GetThreadRequest();
+  if (request) request->Partial(partial);
+}
+
 void NexeVerbHandlerInstance::Log(const std::string& msg) {
-  Locker lock(&log_mutex_);
-  log_ << msg;
+  VerbRequest* request = GetThreadRequest();
+  if (request) request->Log(msg);
+}
+
+void* NexeVerbHandlerInstance::user_context() const {
+  return GetThreadRequest();
 }
 
-void NexeVerbHandlerInstance::ClearLog() {
-  Locker lock(&log_mutex_);
-  log_.str("");
+namespace {
+
+// Must be called with gActiveRequestsMutex held.
+VerbRequest* FindActiveRequest(void* user_context) {
+  if (user_context) {
+    VerbRequest* request = static_cast<VerbRequest*>(user_context);
+    return gActiveRequests.count(request) ? request : NULL;
+  }
+  VerbRequest* request = GetThreadRequest();
+  if (request) return request;
+  return gActiveRequests.size() == 1 ? *gActiveRequests.begin() : NULL;
 }
 
-bool NexeVerbHandlerInstance::AttemptFailure(const std::string& error) {
-  if (gActiveInstance) {
-    gActiveInstance->Failure(error);
+}  // namespace
+
+bool NexeVerbHandlerInstance::AttemptFailure(void* user_context,
+                                             const std::string& error) {
+  Locker lock(&gActiveRequestsMutex);
+  VerbRequest* request = FindActiveRequest(user_context);
+  if (request) {
+    request->Failure(error);
     return true;
   }
   return false;
 }
 
-bool NexeVerbHandlerInstance::AttemptLog(const std::string& msg) {
-  if (gActiveInstance) {
-    gActiveInstance->Log(msg);
+bool NexeVerbHandlerInstance::AttemptLog(void* user_context,
+                                         const std::string& msg) {
+  Locker lock(&gActiveRequestsMutex);
+  VerbRequest* request = FindActiveRequest(user_context);
+  if (request) {
+    request->Log(msg);
     return true;
   }
   return false;
 }
 
+bool NexeVerbHandlerInstance::IsCanceled(void* user_context) {
+  // This is called for every task, so avoid gActiveRequestsMutex unless
+  // there's no other way to find the request.
+  if (user_context) {
+    return static_cast<VerbRequest*>(user_context)->canceled();
+  }
+  VerbRequest* thread_request = GetThreadRequest();
+  if (thread_request) return thread_request->canceled();
+  Locker lock(&gActiveRequestsMutex);
+  VerbRequest* request = FindActiveRequest(user_context);
+  return request && request->canceled();
+}
+
 }  // namespace packaged_call_runtime
 
 #endif  // defined(__native_client__)
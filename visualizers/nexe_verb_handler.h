@@ -21,12 +21,17 @@
 
 #include <pthread.h>
 
+#include <atomic>
 #include <cstring>
+#include <deque>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include "ppapi/cpp/instance.h"
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/var_dictionary.h"
+#include "visualizers/packaged_call_runtime.h"
 
 namespace packaged_call_runtime {
 
@@ -49,44 +54,182 @@ namespace packaged_call_runtime {
 // -- the id field of the response is an arbitrary string and
 // always matches the id field of the request.
 //
-// -- exactly one response will be sent for each request.
+// -- exactly one response will be sent for each request; it may be
+// preceded by any number of partial results, of the form
+//
+//   { verb: "$partial", id: "unique-string", partial: { ... } }
 //
 // -- the JS host is expected to generate a unique id for the "id" field
 // and to examine the responses returned to match responses appropriately.
 // (If the JS host does not need to match responses, it can re-use
 // ids, e.g. pass the empty string for every request)
+//
+// -- verbs are handled on a pool of worker threads (one, unless the
+// subclass asks for more), so that a slow verb doesn't block the main
+// (Pepper) thread; responses are posted back via the main thread. With
+// more than one worker, verbs may run concurrently, and their responses
+// may arrive in any order. At most kMaxQueuedRequests may be waiting at
+// once; beyond that, requests fail immediately.
+//
+// -- the "cancel" verb is handled by NexeVerbHandlerInstance itself, on
+// the main thread, rather than being passed to HandleVerb():
+//
+//   { verb: "cancel", id: "unique-string", data: { id: "id-to-cancel" } }
+//
+// If the request to cancel is still queued, it's dropped; if it's being
+// handled, it's marked as canceled (see IsCanceled()). Either way, it
+// fails immediately with kCanceledFailure, and the cancel request succeeds
+// with { canceled: true }. If there's no such request (e.g. it has
+// already completed), the cancel request succeeds with { canceled: false }.
+//
+// -- a subclass may give requests a coalescing key (see CoalescingKey()).
+// When a request with a key is received, any earlier requests with the
+// same key fail immediately with kSupersededFailure: those still queued
+// are dropped without being handled, and those being handled are marked
+// as canceled (see IsCanceled()). Only the latest is run to completion,
+// and no response (or partial result) to an earlier request is ever
+// posted after one to a later request.
+
+class NexeVerbHandlerInstance;
+
+// The state of a single request, from the time a worker starts handling
+// it until it's done. Its address is the user_context for any Halide
+// calls made on its behalf (see NexeVerbHandlerInstance::user_context()),
+// so that halide_error() and halide_print() can be routed to the right
+// request from any thread.
+class VerbRequest {
+ public:
+  // A request with a non-empty coalescing_key responds only if no later
+  // request with that key has been received since sequence (see
+  // CoalescingSequencer); otherwise it fails with kSupersededFailure.
+  VerbRequest(NexeVerbHandlerInstance* instance, const std::string& verb,
+              const std::string& id, const std::string& coalescing_key,
+              uint64_t sequence);
+  ~VerbRequest();
+
+  NexeVerbHandlerInstance* instance() const { return instance_; }
+  const std::string& verb() const { return verb_; }
+  const std::string& id() const { return id_; }
+  const std::string& coalescing_key() const { return coalescing_key_; }
+
+  // Only the first call to Success(), Failure() or Cancel() has any effect.
+  void Success(const pp::VarDictionary& success);
+  void Failure(const std::string& error);
+  void Partial(const pp::VarDictionary& partial);
+  void Log(const std::string& msg);
+  // Fail with kCanceledFailure, and mark the request as canceled, so that
+  // work on its behalf can be abandoned.
+  void Cancel();
+  // As for Cancel(), but fails with kSupersededFailure.
+  void Supersede();
+  // Doesn't lock, so that it's cheap enough to check from every task.
+  bool canceled() const { return canceled_.load(std::memory_order_acquire); }
+
+ private:
+  void Respond(const char* key, const pp::Var& value);
+
+  NexeVerbHandlerInstance* const instance_;
+  const std::string verb_;
+  const std::string id_;
+  const std::string coalescing_key_;
+  const uint64_t sequence_;
+
+  // Access to responded_ and log_ is controlled by mutex_.
+  bool responded_;
+  std::ostringstream log_;
+  std::atomic<bool> canceled_;
+  mutable pthread_mutex_t mutex_;
+
+  explicit VerbRequest(const VerbRequest&);    // unimplemented
+  VerbRequest& operator=(const VerbRequest&);  // unimplemented
+};
 
 class NexeVerbHandlerInstance : public pp::Instance {
  public:
-  explicit NexeVerbHandlerInstance(PP_Instance instance);
+  static const size_t kMaxQueuedRequests = 32;
+  // The failure sent in response to a canceled request.
+  static const char kCanceledFailure[];
+  // The failure sent in response to a request superseded by a later one.
+  static const char kSupersededFailure[];
+
+  explicit NexeVerbHandlerInstance(PP_Instance instance, int num_workers = 1);
   virtual ~NexeVerbHandlerInstance();
 
   virtual void HandleMessage(const pp::Var& var_message);  // override
 
-  // If there is an active instance, call Failure() on it and return true.
-  // If not, return false.
-  static bool AttemptFailure(const std::string& error);
+  // Find the request for user_context (or, if it's null, the request being
+  // handled by the calling thread, or failing that, the only active
+  // request, if there's just one), call Failure() on it and return true.
+  // If there's no such request, return false.
+  static bool AttemptFailure(void* user_context, const std::string& error);
 
-  // If there is an active instance, call Log() on it and return true.
-  // If not, return false.
-  static bool AttemptLog(const std::string& msg);
+  // As with AttemptFailure(), but calls Log().
+  static bool AttemptLog(void* user_context, const std::string& msg);
+
+  // Return true if the request for user_context (found as for
+  // AttemptFailure()) has been canceled. This may be called from any
+  // thread, so that e.g. a custom halide_do_task() can abandon the
+  // remaining work of a canceled call. A non-null user_context must be
+  // that of a request still being handled (as it is for any Halide call
+  // made on the request's behalf), since it's used without taking a lock.
+  static bool IsCanceled(void* user_context);
 
  protected:
+  // Called on a worker thread.
   virtual void HandleVerb(const std::string& verb,
                           const pp::VarDictionary& data) = 0;
 
+  // Called on the main thread, as each request is received. Requests
+  // with the same non-empty key supersede one another while queued. The
+  // default returns the empty string (i.e., requests are never coalesced).
+  virtual std::string CoalescingKey(const std::string& verb,
+                                    const pp::VarDictionary& data);
+
+  // Wait for the verbs in progress (if any) to finish, and stop the
+  // worker threads; queued requests are dropped. Subclasses whose
+  // HandleVerb() uses their own members must call this from their
+  // destructors.
+  void StopWorkers();
+
+  // These apply to the request being handled by the calling thread, and
+  // so may only be called from within HandleVerb().
   void Success(const pp::VarDictionary& success);
   void Failure(const std::string& error);
+  // Send part of the result ahead of the response; may be called any
+  // number of times before Success() or Failure().
+  void Partial(const pp::VarDictionary& partial);
   void Log(const std::string& msg);
-  void ClearLog();
+  // The user_context to pass to Halide calls made on behalf of the request.
+  void* user_context() const;
 
  private:
-  std::string active_verb_;
-  std::string active_id_;
-
-  // Access to log_ is controlled by log_mutex_.
-  std::ostringstream log_;
-  pthread_mutex_t log_mutex_;
+  friend class VerbRequest;
+
+  static void* WorkerMain(void* instance);
+  void RunWorker();
+  // Called on the main thread for the "cancel" verb.
+  void HandleCancel(const std::string& id, const std::string& cancel_id);
+  // Called on the main thread when a request with coalescing_key is
+  // received.
+  void SupersedeActiveRequests(const std::string& coalescing_key);
+  // Post message to JS from any thread.
+  void PostFromAnyThread(const pp::Var& message);
+  static void PostOnMainThread(void* pending, int32_t result);
+
+  struct QueuedRequest {
+    pp::Var message;
+    std::string coalescing_key;
+    // From coalescing_, if coalescing_key isn't empty.
+    uint64_t sequence;
+  };
+
+  // Requests waiting for a worker; access is controlled by queue_mutex_.
+  std::deque<QueuedRequest> queue_;
+  bool stopping_;
+  pthread_mutex_t queue_mutex_;
+  pthread_cond_t queue_cond_;
+  std::vector<pthread_t> workers_;
+  CoalescingSequencer coalescing_;
 };
 
 }  // namespace packaged_call_runtime
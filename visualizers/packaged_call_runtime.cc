@@ -16,12 +16,30 @@
 
 #include "visualizers/packaged_call_runtime.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <iterator>
+#include <new>
 #include <sstream>
+#include <thread>
 
 #include "copy_image_uint8_filter.h"
 #include "copy_image_uint16_filter.h"
 #include "copy_image_float32_filter.h"
+#include "downsample_image_uint8_filter.h"
+#include "downsample_image_uint16_filter.h"
+#include "downsample_image_float32_filter.h"
+
+// The Halide profiler is only linked in if some filter was built with the
+// "profile" target feature, so it may not be there at all.
+#pragma weak halide_profiler_get_state
 
 namespace packaged_call_runtime {
 
@@ -29,12 +47,50 @@ using std::string;
 using std::unique_ptr;
 using std::vector;
 
+const char kLayoutVariantSeparator[] = "__";
+
 namespace {
 
 static const char* kTypeCode[4] = {"int", "uint", "float", "handle"};
 
+// Alignment (in bytes) of all buffer storage allocated by the runtime,
+// and of each row, where we're free to choose the row stride.
+const size_t kBufferAlignment = 64;
+
 int CopyImageInvalid(buffer_t* src, buffer_t* dst) { return -1; }
 
+typedef int (*DownsampleImageFunc)(buffer_t*, int32_t, buffer_t*);
+
+// Return the downsample_image_xxx filter for elements of the given type, or
+// nullptr if there is none. (Unlike copying, averaging depends on the type,
+// so signed and 32-bit integer elements can't borrow the filter for another
+// type of the same size.)
+DownsampleImageFunc FindDownsampleFunc(int type_code, int type_bits) {
+  if (type_code == halide_type_uint && type_bits == 8) {
+    return downsample_image_uint8_filter;
+  }
+  if (type_code == halide_type_uint && type_bits == 16) {
+    return downsample_image_uint16_filter;
+  }
+  if (type_code == halide_type_float && type_bits == 32) {
+    return downsample_image_float32_filter;
+  }
+  return nullptr;
+}
+
+// copy_image_xxx (and downsample_image_xxx) always operate on a
+// 4-dimensional image; if we have fewer than that, add extra dimensions
+// with extent 1 to make the validity checks happy (memory layout will be
+// the same).
+buffer_t Pad4d(const buffer_t& buf) {
+  buffer_t buf_4d = buf;
+  for (int i = 0; i < 4; ++i) {
+    if (buf_4d.extent[i] == 0) buf_4d.extent[i] = 1;
+    if (buf_4d.stride[i] == 0) buf_4d.stride[i] = 1;
+  }
+  return buf_4d;
+}
+
 // Calculate the maximum number of elements needed for the buffer.
 // This can be larger than extents[] would imply if stride[] is padded
 // or otherwise nonstandard. (e.g.: if rows are padded to 32-byte increments,
@@ -49,22 +105,207 @@ size_t MaxElemCount(int dim, const buffer_t& buf) {
   return count;
 }
 
-int64_t GetTimeUsec() {
+// As MaxElemCount(), but in bytes, for buffers whose extents (at least 1)
+// and strides (at least 0) come from an untrusted message. Returns false
+// if the size would exceed max_bytes (or overflow on the way there).
+bool CheckedBufferBytes(int dim, const buffer_t& buf, uint64_t max_bytes,
+                        uint64_t* bytes) {
+  uint64_t count = 1;
+  for (int i = 0; i < dim; ++i) {
+    // Each product is less than 2^62, so can't overflow.
+    const uint64_t span = static_cast<uint64_t>(buf.extent[i] - 1) *
+                          static_cast<uint64_t>(buf.stride[i]);
+    if (span > max_bytes || count > max_bytes - span) return false;
+    count += span;
+  }
+  const uint64_t elem_size = static_cast<uint64_t>(buf.elem_size);
+  if (elem_size == 0 || count > max_bytes / elem_size) return false;
+  *bytes = count * elem_size;
+  return true;
+}
+
+// Use a monotonic clock, so that timings can't be skewed by
+// adjustments to the wall clock.
+double GetTimeUsec() {
   timespec t;
-  clock_gettime(CLOCK_REALTIME, &t);
-  return t.tv_sec * 1000000 + t.tv_nsec / 1000;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+// PhaseTimer accumulates elapsed time into named phases of a call; starting
+// a phase ends the previous one, so a single timer can be threaded through
+// an entire call.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(ResultStats* phases)
+      : phases_(phases), phase_(nullptr), start_(0.0) {}
+  ~PhaseTimer() { End(); }
+
+  void Begin(const char* phase) {
+    const double now = GetTimeUsec();
+    Accumulate(now);
+    phase_ = phase;
+    start_ = now;
+  }
+
+  void End() {
+    Accumulate(GetTimeUsec());
+    phase_ = nullptr;
+  }
+
+ private:
+  void Accumulate(double now) {
+    if (phase_) {
+      (*phases_)[phase_] += now - start_;
+    }
+  }
+
+  ResultStats* phases_;
+  const char* phase_;
+  double start_;
+
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+};
+
+// Return true if feature is one of the features of the Halide target
+// string (e.g. "x86-64-nacl-profile" has the feature "profile").
+bool TargetHasFeature(const char* target, const string& feature) {
+  if (!target) return false;
+  std::istringstream features(target);
+  string f;
+  while (std::getline(features, f, '-')) {
+    if (f == feature) return true;
+  }
+  return false;
+}
+
+// The cumulative profiler counters for a pipeline, as of some moment.
+struct ProfilerSnapshot {
+  struct Func {
+    string name;
+    uint64_t time;
+    uint64_t memory_total;
+    uint64_t active_threads_numerator;
+    uint64_t active_threads_denominator;
+    int num_allocs;
+  };
+  int runs;
+  uint64_t time;
+  vector<Func> funcs;
+
+  ProfilerSnapshot() : runs(0), time(0) {}
+};
+
+// Copy the profiler's counters for the pipeline with the given name. The
+// pipeline only appears once it has run, so its absence isn't an error;
+// if the profiler isn't linked in at all, return false.
+bool TakeProfilerSnapshot(const char* name, ProfilerSnapshot* snapshot) {
+  *snapshot = ProfilerSnapshot();
+  if (!halide_profiler_get_state) return false;
+  halide_profiler_state* s = halide_profiler_get_state();
+  halide_mutex_lock(&s->lock);
+  for (halide_profiler_pipeline_stats* p = s->pipelines; p;
+       p = static_cast<halide_profiler_pipeline_stats*>(p->next)) {
+    if (strcmp(p->name, name) != 0) continue;
+    snapshot->runs = p->runs;
+    snapshot->time = p->time;
+    snapshot->funcs.resize(p->num_funcs);
+    for (int i = 0; i < p->num_funcs; ++i) {
+      const halide_profiler_func_stats& fs = p->funcs[i];
+      ProfilerSnapshot::Func& f = snapshot->funcs[i];
+      f.name = fs.name;
+      f.time = fs.time;
+      f.memory_total = fs.memory_total;
+      f.active_threads_numerator = fs.active_threads_numerator;
+      f.active_threads_denominator = fs.active_threads_denominator;
+      f.num_allocs = fs.num_allocs;
+    }
+    break;
+  }
+  halide_mutex_unlock(&s->lock);
+  return true;
+}
+
+// Compute each Func's share of the runs between the two snapshots. (The
+// profiler keeps one set of counters per pipeline, so concurrent calls to
+// the same filter are counted together.)
+vector<FuncProfile> ComputeFuncProfiles(const ProfilerSnapshot& before,
+                                        const ProfilerSnapshot& after) {
+  vector<FuncProfile> profiles;
+  const int runs = after.runs - before.runs;
+  if (runs <= 0) return profiles;
+  const double total_time = after.time - before.time;
+  for (size_t i = 0; i < after.funcs.size(); ++i) {
+    const ProfilerSnapshot::Func& a = after.funcs[i];
+    // A Func that's new since the first snapshot started from zero.
+    const ProfilerSnapshot::Func zero = ProfilerSnapshot::Func();
+    const ProfilerSnapshot::Func& b =
+        i < before.funcs.size() ? before.funcs[i] : zero;
+    const double time = a.time - b.time;
+    const double threads_numerator =
+        a.active_threads_numerator - b.active_threads_numerator;
+    const double threads_denominator =
+        a.active_threads_denominator - b.active_threads_denominator;
+    FuncProfile profile;
+    profile.name = a.name;
+    // The profiler's times are in nanoseconds.
+    profile.stats["time_usec"] = time / 1e3 / runs;
+    profile.stats["percent"] =
+        total_time > 0.0 ? 100.0 * time / total_time : 0.0;
+    profile.stats["threads"] = threads_denominator > 0.0
+                                   ? threads_numerator / threads_denominator
+                                   : 0.0;
+    profile.stats["allocs"] =
+        static_cast<double>(a.num_allocs - b.num_allocs) / runs;
+    profile.stats["alloc_bytes"] =
+        static_cast<double>(a.memory_total - b.memory_total) / runs;
+    profiles.push_back(profile);
+  }
+  return profiles;
+}
+
+// Summarize the per-iteration times of a benchmarked call. Percentiles
+// use the nearest-rank method.
+ResultStats ComputeTimingStats(vector<double> samples) {
+  ResultStats stats;
+  const size_t n = samples.size();
+  if (n == 0) return stats;
+  std::sort(samples.begin(), samples.end());
+  double sum = 0.0;
+  for (double s : samples) sum += s;
+  const double mean = sum / n;
+  double sum_sq = 0.0;
+  for (double s : samples) sum_sq += (s - mean) * (s - mean);
+  const size_t p90 =
+      static_cast<size_t>(std::ceil(0.9 * static_cast<double>(n))) - 1;
+  stats["iterations"] = n;
+  stats["min"] = samples.front();
+  stats["max"] = samples.back();
+  stats["median"] = (n % 2) ? samples[n / 2]
+                            : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+  stats["p90"] = samples[p90];
+  stats["mean"] = mean;
+  stats["stddev"] = std::sqrt(sum_sq / n);
+  return stats;
 }
 
-void ChooseOutputExtents(const halide_filter_metadata_t* metadata,
-                         const ArgumentPackager::ArgValue* arg_values,
-                         int32_t output_extent[4]) {
+void ChooseOutputExtents(
+    const halide_filter_metadata_t* metadata,
+    const ArgumentPackager::ArgValue* arg_values,
+    const std::shared_ptr<const ResidentInputs::Entry>* resident,
+    int32_t output_extent[4]) {
   const int num_args = metadata->num_arguments;
   const halide_filter_argument_t* args = metadata->arguments;
 
   for (int i = 0; i < num_args; ++i) {
-    if (args[i].type_code == halide_argument_kind_input_buffer) {
+    if (args[i].kind == halide_argument_kind_input_buffer) {
+      // A resident input is sized as it was uploaded, so that calls by
+      // handle have the same outputs as calls by value.
+      const buffer_t& buf =
+          resident[i] ? resident[i]->uploaded : arg_values[i].buffer;
       for (int e = 0; e < 4; ++e) {
-        output_extent[e] = arg_values[i].buffer.extent[e];
+        output_extent[e] = buf.extent[e];
       }
       return;
     }
@@ -76,6 +317,41 @@ void ChooseOutputExtents(const halide_filter_metadata_t* metadata,
   output_extent[3] = 0;
 }
 
+// Choose the region of the outputs to compute: the extents chosen by
+// ChooseOutputExtents(), at the origin, unless the call asks for a
+// particular region. (Only min and extent of the result are used.)
+void ChooseOutputRegion(
+    const halide_filter_metadata_t* metadata,
+    const vector<ArgumentPackager::ArgValue>& arg_values,
+    const vector<std::shared_ptr<const ResidentInputs::Entry>>& resident,
+    const PackagedCallOptions& options, buffer_t* region) {
+  memset(region, 0, sizeof(*region));
+  ChooseOutputExtents(metadata, &arg_values[0], &resident[0], region->extent);
+  for (size_t e = 0; e < options.output_extent.size(); ++e) {
+    region->min[e] = options.output_min[e];
+    region->extent[e] = options.output_extent[e];
+  }
+}
+
+size_t AlignedSize(size_t bytes) {
+  return (bytes + kBufferAlignment - 1) & ~(kBufferAlignment - 1);
+}
+
+// Return the row stride (in elements) to use for rows of at least
+// min_stride elements: rounded up so that each row starts on an aligned
+// boundary, unless the filter has constrained stride[1]. (Rows shorter
+// than the alignment are left alone, since padding them would waste more
+// than it could gain.)
+int32_t RowStride(const buffer_t& constraint, int32_t min_stride,
+                  int32_t elem_size) {
+  const size_t row_bytes = static_cast<size_t>(min_stride) * elem_size;
+  if (constraint.stride[1] != 0 || elem_size <= 0 ||
+      kBufferAlignment % elem_size != 0 || row_bytes < kBufferAlignment) {
+    return min_stride;
+  }
+  return static_cast<int32_t>(AlignedSize(row_bytes) / elem_size);
+}
+
 void FixChunkyStrides(int dim, const buffer_t& constraint, buffer_t* buf) {
   // Special-case Chunky: most "chunky" generators tend to constrain stride[0]
   // and stride[2] to exact values, leaving stride[1] unconstrained;
@@ -97,53 +373,124 @@ void FixChunkyStrides(int dim, const buffer_t& constraint, buffer_t* buf) {
         buf->stride[0] = buf->extent[2];
       }
       // Ensure stride[1] is reasonable.
-      buf->stride[1] = buf->extent[0] * buf->stride[0];
+      buf->stride[1] = RowStride(constraint, buf->extent[0] * buf->stride[0],
+                                 buf->elem_size);
     }
   }
 }
 
-bool AdaptInputBufferLayout(const halide_filter_argument_t& arg,
-                            const buffer_t& constraint, buffer_t* buf,
-                            vector<uint8_t>* storage) {
-  const buffer_t buf_original = *buf;
-  bool need_copy = false;
+// Decide the layout an input buffer must have to satisfy the constraint
+// returned by the bounds query.
+void PlanInputBufferLayout(const halide_filter_argument_t& arg,
+                           const buffer_t& constraint, const buffer_t& buf,
+                           CallPlan::BufferLayout* layout) {
+  buffer_t* planned = &layout->buffer;
+  *planned = buf;
+  planned->host = NULL;
+  planned->dev = 0;
+  layout->needs_copy = false;
   for (int i = 0; i < arg.dimensions; ++i) {
     // min of nonzero means "min"
-    if (constraint.min[i] != 0 && buf->min[i] > constraint.min[i]) {
-      buf->min[i] = constraint.min[i];
-      need_copy = true;
+    if (constraint.min[i] != 0 && planned->min[i] > constraint.min[i]) {
+      planned->min[i] = constraint.min[i];
+      layout->needs_copy = true;
     }
     // extent of nonzero means "max"
-    if (constraint.extent[i] != 0 && buf->extent[i] > constraint.extent[i]) {
-      buf->extent[i] = constraint.extent[i];
-      need_copy = true;
+    if (constraint.extent[i] != 0 &&
+        planned->extent[i] > constraint.extent[i]) {
+      planned->extent[i] = constraint.extent[i];
+      layout->needs_copy = true;
     }
     // stride of 0 means "no constraints"
-    if (constraint.stride[i] != 0 && constraint.stride[i] != buf->stride[i]) {
-      buf->stride[i] = constraint.stride[i];
-      need_copy = true;
-    }
-  }
-  if (need_copy) {
-    FixChunkyStrides(arg.dimensions, constraint, buf);
-    size_t bytes = buf->elem_size * MaxElemCount(arg.dimensions, *buf);
-    storage->resize(bytes, 0);
-    if (storage->size() != bytes) return false;
-    buf->host = &(*storage)[0];
-    buf->dev = 0;
-    if (!packaged_call_runtime::Copy(&buf_original, buf)) {
-      return false;
+    if (constraint.stride[i] != 0 &&
+        constraint.stride[i] != planned->stride[i]) {
+      planned->stride[i] = constraint.stride[i];
+      layout->needs_copy = true;
     }
-  } else {
-    storage->resize(0);
   }
-  return true;
+  if (layout->needs_copy) {
+    FixChunkyStrides(arg.dimensions, constraint, planned);
+  }
+}
+
+// CallArena hands out aligned storage for the buffers of a single call,
+// all of which is released together when the call completes. Storage is
+// carved out of as few blocks as possible (ideally one, via Reserve()),
+// drawn from the pool if there is one, so that later calls can reuse it.
+class CallArena {
+ public:
+  explicit CallArena(BufferPool* pool)
+      : pool_(pool), next_(nullptr), end_(nullptr) {}
+  ~CallArena() {
+    if (!pool_) return;
+    for (auto& block : blocks_) {
+      pool_->Release(std::move(block));
+    }
+  }
+
+  // Ensure that at least the given number of bytes can be allocated
+  // without acquiring another block.
+  bool Reserve(size_t bytes) {
+    if (static_cast<size_t>(end_ - next_) >= bytes) return true;
+    // Over-allocate, so that the start of the block can be aligned.
+    const size_t size = bytes + kBufferAlignment - 1;
+    BufferPool::Block block;
+    if (pool_) {
+      if (!pool_->Acquire(size, &block)) return false;
+    } else {
+      block.data.reset(new (std::nothrow) uint8_t[size]);
+      if (!block.data) return false;
+      block.size = size;
+    }
+    uint8_t* data = block.data.get();
+    const uintptr_t misalignment =
+        reinterpret_cast<uintptr_t>(data) % kBufferAlignment;
+    next_ = data + (misalignment ? kBufferAlignment - misalignment : 0);
+    end_ = data + block.size;
+    blocks_.push_back(std::move(block));
+    return true;
+  }
+
+  // Return aligned, uninitialized storage, or null on failure.
+  uint8_t* Allocate(size_t bytes) {
+    bytes = AlignedSize(bytes);
+    if (!Reserve(bytes)) return nullptr;
+    uint8_t* result = next_;
+    next_ += bytes;
+    return result;
+  }
+
+ private:
+  BufferPool* const pool_;
+  vector<BufferPool::Block> blocks_;
+  uint8_t* next_;
+  uint8_t* end_;
+
+  CallArena(const CallArena&) = delete;
+  CallArena& operator=(const CallArena&) = delete;
+};
+
+bool AdaptInputBufferLayout(const halide_filter_argument_t& arg,
+                            const CallPlan::BufferLayout& layout,
+                            buffer_t* buf, CallArena* arena) {
+  if (!layout.needs_copy) return true;
+  const buffer_t buf_original = *buf;
+  *buf = layout.buffer;
+  size_t bytes = buf->elem_size * MaxElemCount(arg.dimensions, *buf);
+  buf->host = arena->Allocate(bytes);
+  if (!buf->host) return false;
+  buf->dev = 0;
+  return packaged_call_runtime::Copy(&buf_original, buf);
 }
 
-bool PrepareOutputBuffer(const halide_filter_argument_t& arg,
-                         const buffer_t& constraint, buffer_t* buf,
-                         vector<uint8_t>* storage) {
+// Decide the layout of an output buffer, given the constraint returned
+// by the bounds query.
+void PlanOutputBufferLayout(const halide_filter_argument_t& arg,
+                            const buffer_t& constraint,
+                            CallPlan::BufferLayout* layout) {
+  buffer_t* buf = &layout->buffer;
   *buf = constraint;
+  buf->elem_size = arg.type_bits / 8;
   // constraint can have zero values within buffer_dimensions,
   // e.g. if a dimension has no constraints on it at all. Make
   // sure that the extents and strides for these are nonzero.
@@ -178,147 +525,111 @@ bool PrepareOutputBuffer(const halide_filter_argument_t& arg,
     buf->stride[0] = 1;
     for (int i = 1; i < arg.dimensions; ++i) {
       buf->stride[i] = buf->stride[i - 1] * buf->extent[i - 1];
+      if (i == 1) {
+        buf->stride[i] = RowStride(constraint, buf->stride[i], buf->elem_size);
+      }
     }
   }
-  buf->elem_size = arg.type_bits / 8;
-  size_t bytes = buf->elem_size * MaxElemCount(arg.dimensions, *buf);
-  storage->resize(bytes);
-  if (storage->size() != bytes) return false;
-  buf->host = storage->data();
+  buf->host = NULL;
   buf->dev = 0;
-  return true;
 }
 
-bool EmitScalar(std::ostream* oss, int type_code, int type_bits,
-                const halide_scalar_value_t& scalar) {
-#define TYPE_AND_SIZE(CODE, BITS) (((CODE) << 8) | (BITS))
-  switch (TYPE_AND_SIZE(type_code, type_bits)) {
-    case TYPE_AND_SIZE(halide_type_float, 32):
-      *oss << scalar.u.f32;
-      return true;
-    case TYPE_AND_SIZE(halide_type_float, 64):
-      *oss << scalar.u.f64;
-      return true;
-    case TYPE_AND_SIZE(halide_type_int, 8):
-      // emit as number, not char
-      *oss << static_cast<int>(scalar.u.i8);
-      return true;
-    case TYPE_AND_SIZE(halide_type_int, 16):
-      *oss << scalar.u.i16;
-      return true;
-    case TYPE_AND_SIZE(halide_type_int, 32):
-      *oss << scalar.u.i32;
-      return true;
-    case TYPE_AND_SIZE(halide_type_int, 64):
-      *oss << scalar.u.i64;
-      return true;
-    case TYPE_AND_SIZE(halide_type_uint, 1):
-      *oss << (scalar.u.b ? "true" : "false");
-      return true;
-    case TYPE_AND_SIZE(halide_type_uint, 8):
-      // emit as number, not char
-      *oss << static_cast<unsigned int>(scalar.u.u8);
-      return true;
-    case TYPE_AND_SIZE(halide_type_uint, 16):
-      *oss << scalar.u.u16;
-      return true;
-    case TYPE_AND_SIZE(halide_type_uint, 32):
-      *oss << scalar.u.u32;
-      return true;
-    case TYPE_AND_SIZE(halide_type_uint, 64):
-      *oss << scalar.u.u64;
-      return true;
-    case TYPE_AND_SIZE(halide_type_handle, 64):
-      // Handles are always emitted as literal 0.
-      *oss << 0;
-      return true;
-    default:
-      return false;
-  }
-#undef TYPE_AND_SIZE
+// Storage supplied by the packager is preferred, since that avoids a copy
+// when the result is packed; if there is none, host is left null, to be
+// filled in by PrepareOutputBuffer().
+void RequestOutputStorage(const halide_filter_argument_t& arg,
+                          const CallPlan::BufferLayout& layout, buffer_t* buf,
+                          ArgumentPackager* packager) {
+  *buf = layout.buffer;
+  size_t bytes = buf->elem_size * MaxElemCount(arg.dimensions, *buf);
+  buf->host = packager->AllocateOutputStorage(arg, bytes);
+  buf->dev = 0;
 }
 
-int EnumerateFilters(void* enumerate_context,
-                     const halide_filter_metadata_t* metadata,
-                     ArgvFunc argv_func) {
-  HalideFilterInfoMap* m =
-      reinterpret_cast<HalideFilterInfoMap*>(enumerate_context);
-  m->emplace(std::pair<string, HalideFilterInfo>(metadata->name,
-                                                 {metadata, argv_func}));
-  return 0;
+// Output storage is left uninitialized: Halide will overwrite every
+// element that is part of the output.
+bool PrepareOutputBuffer(const halide_filter_argument_t& arg, buffer_t* buf,
+                         CallArena* arena) {
+  if (buf->host) return true;
+  size_t bytes = buf->elem_size * MaxElemCount(arg.dimensions, *buf);
+  buf->host = arena->Allocate(bytes);
+  return buf->host != nullptr;
 }
 
-}  // namespace
-
-bool Copy(const buffer_t* src, buffer_t* dst) {
-  typedef int (*CopyImageFunc)(buffer_t*, buffer_t*);
-
-  static const CopyImageFunc kCopyFuncs[4] = {
-      // elem_size = 1
-      copy_image_uint8_filter,
-      // elem_size = 2
-      copy_image_uint16_filter,
-      // elem_size = 3
-      CopyImageInvalid,
-      // elem_size = 4
-      copy_image_float32_filter,
-  };
-  const int elem_size = (src->elem_size - 1) & 3;
-
-  if (src->elem_size > 4 || src->elem_size != dst->elem_size) {
-    return false;
+// Return the layout of the tile of buf that starts at the given offset
+// (in dimensions 0 and 1) and has at most the given extent, densely
+// packed, with its dimensions in the same order in memory as in buf (so
+// that it meets the same stride constraints).
+buffer_t TileBufferLayout(const buffer_t& buf, int dimensions,
+                          const int32_t offset[2], const int32_t extent[2]) {
+  buffer_t tile = buf;
+  tile.host = NULL;
+  tile.dev = 0;
+  for (int i = 0; i < 2 && i < dimensions; ++i) {
+    tile.min[i] = buf.min[i] + offset[i];
+    tile.extent[i] = std::min(extent[i], buf.extent[i] - offset[i]);
   }
-
-  // copy_image_xxx always operates on a 4-dimensional image;
-  // if we have fewer than that, add extra dimensions with extent 1
-  // to make the validity checks happy (memory layout will be the same).
-  buffer_t src_4d = *src;
-  buffer_t dst_4d = *dst;
-  for (int i = 0; i < 4; ++i) {
-    if (src_4d.extent[i] == 0) src_4d.extent[i] = 1;
-    if (src_4d.stride[i] == 0) src_4d.stride[i] = 1;
-    if (dst_4d.extent[i] == 0) dst_4d.extent[i] = 1;
-    if (dst_4d.stride[i] == 0) dst_4d.stride[i] = 1;
+  int order[4] = {0, 1, 2, 3};
+  std::stable_sort(order, order + dimensions, [&buf](int a, int b) {
+    return buf.stride[a] < buf.stride[b];
+  });
+  int32_t stride = 1;
+  for (int i = 0; i < dimensions; ++i) {
+    tile.stride[order[i]] = stride;
+    stride *= tile.extent[order[i]];
   }
+  return tile;
+}
 
-  return kCopyFuncs[elem_size](&src_4d, &dst_4d) == 0;
+// Narrow buf to the region given by the min and extent of region, which
+// must lie within it; the storage is shared, not copied.
+bool CropBuffer(int dimensions, const buffer_t& region, buffer_t* buf) {
+  ptrdiff_t offset = 0;
+  for (int i = 0; i < dimensions; ++i) {
+    if (region.min[i] < buf->min[i] ||
+        region.min[i] + region.extent[i] > buf->min[i] + buf->extent[i]) {
+      return false;
+    }
+    offset += static_cast<ptrdiff_t>(region.min[i] - buf->min[i]) *
+              buf->stride[i];
+    buf->min[i] = region.min[i];
+    buf->extent[i] = region.extent[i];
+  }
+  buf->host += offset * buf->elem_size;
+  return true;
 }
 
-int MakePackagedCall(void* user_context,
-                     const halide_filter_metadata_t* metadata,
-                     ArgvFunc argv_func, ArgumentPackager* packager) {
-  if (!metadata || !argv_func || !packager) return -6809;
+// Round a size up to one of four buckets per power of two, so that
+// slightly different sizes can share blocks, wasting at most 25%.
+size_t BufferPoolBucketSize(size_t bytes) {
+  size_t p = 4096;
+  while (p * 2 <= bytes) p *= 2;
+  const size_t step = p / 4;
+  return (bytes + step - 1) / step * step;
+}
 
-  // All locals declared at top to allow for "goto fail" error handling.
+// Build the plan for a call that computes the given region of its outputs,
+// by running the filter in bounds-query mode. Returns the status of the
+// bounds query.
+int MakeCallPlan(const halide_filter_metadata_t* metadata, ArgvFunc argv_func,
+                 const vector<ArgumentPackager::ArgValue>& arg_values,
+                 const buffer_t& output_region, CallPlan* plan) {
   const int num_args = metadata->num_arguments;
   const halide_filter_argument_t* args = metadata->arguments;
-  vector<void*> arg_value_ptrs(num_args);
-  vector<ArgumentPackager::ArgValue> arg_values(num_args);
-  vector<ArgumentPackager::ArgValue> bounds_query_arg_values(num_args);
-  vector<vector<uint8_t>> buffer_storage(num_args);
-  int32_t output_extent[4] = {0};
-  int bounds_query_status = 0, call_status = 0;
-  double time_usec = 0.0;
-
-  for (int i = 0; i < num_args; ++i) {
-    if (args[i].kind == halide_argument_kind_output_buffer) continue;
-    if (!packager->UnpackArgumentValue(user_context, args[i], &arg_values[i])) {
-      goto fail;
-    }
-  }
-
-  ChooseOutputExtents(metadata, &arg_values[0], output_extent);
 
   // Prep copy of arguments buffers, but with nulled host/dev in all buffers
-  // for bounds-query mode, and reasonable extents set in the output
-  // output buffers.
-  bounds_query_arg_values = arg_values;
+  // for bounds-query mode, and the output region set in the output
+  // buffers.
+  vector<ArgumentPackager::ArgValue> bounds_query_arg_values = arg_values;
   for (int i = 0; i < num_args; ++i) {
     switch (args[i].kind) {
       case halide_argument_kind_output_buffer: {
         for (int e = 0; e < 4; ++e) {
+          const bool used = e < args[i].dimensions;
+          bounds_query_arg_values[i].buffer.min[e] =
+              used ? output_region.min[e] : 0;
           bounds_query_arg_values[i].buffer.extent[e] =
-              (e < args[i].dimensions) ? output_extent[e] : 0;
+              used ? output_region.extent[e] : 0;
         }
         break;
       }
@@ -330,275 +641,2851 @@ int MakePackagedCall(void* user_context,
     }
   }
 
+  vector<void*> arg_value_ptrs(num_args);
   for (int i = 0; i < num_args; ++i) {
     arg_value_ptrs[i] = &bounds_query_arg_values[i];
   }
-  bounds_query_status = argv_func(&arg_value_ptrs[0]);
-  if (bounds_query_status != 0) {
-    // Don't emit our own halide_error or custom error code;
-    // halide_error has already been called, so just return the failure
-    // code as-is.
-    return bounds_query_status;
-  }
+  const int status = argv_func(&arg_value_ptrs[0]);
+  if (status != 0) return status;
 
+  plan->metadata = metadata;
+  plan->argv_func = argv_func;
+  plan->layouts.assign(num_args, CallPlan::BufferLayout());
   for (int i = 0; i < num_args; ++i) {
     switch (args[i].kind) {
       case halide_argument_kind_input_buffer: {
-        if (!AdaptInputBufferLayout(args[i], bounds_query_arg_values[i].buffer,
-                                    &arg_values[i].buffer,
-                                    &buffer_storage[i])) {
-          goto fail;
+        // If the filter needs only part of the input (e.g. because only
+        // part of the output is computed), plan to copy just that part,
+        // should it need copying at all.
+        const buffer_t& constraint = bounds_query_arg_values[i].buffer;
+        buffer_t needed = arg_values[i].buffer;
+        bool cropped = true;
+        for (int e = 0; e < args[i].dimensions; ++e) {
+          if (constraint.extent[e] <= 0) cropped = false;
         }
+        if (!cropped || !CropBuffer(args[i].dimensions, constraint, &needed)) {
+          needed = arg_values[i].buffer;
+        }
+        PlanInputBufferLayout(args[i], constraint, needed, &plan->layouts[i]);
         break;
       }
       case halide_argument_kind_output_buffer: {
-        if (!PrepareOutputBuffer(args[i], bounds_query_arg_values[i].buffer,
-                                 &arg_values[i].buffer, &buffer_storage[i])) {
-          goto fail;
-        }
+        PlanOutputBufferLayout(args[i], bounds_query_arg_values[i].buffer,
+                               &plan->layouts[i]);
         break;
       }
     }
   }
+  return 0;
+}
 
-  {
-    for (int i = 0; i < num_args; ++i) {
-      arg_value_ptrs[i] = &arg_values[i];
-    }
-    const int64_t kTimeStart = GetTimeUsec();
-    call_status = argv_func(&arg_value_ptrs[0]);
-    if (call_status != 0) {
-      // Don't emit our own halide_error or custom error code;
-      // halide_error has already been called, so just return the failure
-      // code as-is.
-      return call_status;
+// Build the plan for the tile of the outputs of plan that starts at the
+// given offset (in dimensions 0 and 1) and has at most the given extent,
+// by running the filter in bounds-query mode for just that region. The
+// outputs of the tile are thus laid out just as those of an untiled call
+// computing that region would be (see PlanOutputBufferLayout()). Returns
+// the status of the bounds query.
+int MakeTilePlan(const CallPlan& plan,
+                 const vector<ArgumentPackager::ArgValue>& arg_values,
+                 const buffer_t& output_region, const int32_t offset[2],
+                 const int32_t extent[2], CallPlan* tile_plan) {
+  const halide_filter_metadata_t* metadata = plan.metadata;
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+  buffer_t tile_region = output_region;
+  vector<ArgumentPackager::ArgValue> values = arg_values;
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    const buffer_t& buf = plan.layouts[i].buffer;
+    for (int d = 0; d < 2 && d < args[i].dimensions; ++d) {
+      tile_region.min[d] = buf.min[d] + offset[d];
+      tile_region.extent[d] = std::min(extent[d], buf.extent[d] - offset[d]);
     }
-    const int64_t kTimeEnd = GetTimeUsec();
-    time_usec = kTimeEnd - kTimeStart;
+    // As in an untiled call, the outputs are unconstrained to begin with.
+    memset(&values[i].buffer, 0, sizeof(values[i].buffer));
   }
+  return MakeCallPlan(metadata, plan.argv_func, values, tile_region,
+                      tile_plan);
+}
 
-  if (!packager->PackResultTimeUsec(time_usec)) {
-    goto fail;
+// Run the filter over its outputs in tiles of (at most) tile_extent,
+// packing each tile as soon as it's done. On entry, arg_values must be
+// ready to run, except that each output should have the layout (and
+// storage) of the first tile (see MakeTilePlan()), which is reused for
+// every tile. For each tile, a bounds query determines the layout of each
+// output and the region of each input it needs, and the input is cropped
+// to that region.
+//
+// Returns false if the tiles can't be run or packed; otherwise, the
+// status of the filter is returned in *call_status.
+bool RunTiled(const CallPlan& plan, const buffer_t& output_region,
+              const int32_t tile_extent[2],
+              vector<ArgumentPackager::ArgValue>* arg_values,
+              ArgumentPackager* packager, PhaseTimer* timer, double* time_usec,
+              int* num_tiles, int* call_status) {
+  const halide_filter_metadata_t* metadata = plan.metadata;
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+
+  // All outputs are tiled alike, so they must all be the same size.
+  int first_output = -1;
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    if (first_output < 0) {
+      first_output = i;
+      continue;
+    }
+    for (int d = 0; d < 2; ++d) {
+      if (plan.layouts[i].buffer.extent[d] !=
+          plan.layouts[first_output].buffer.extent[d]) {
+        return false;
+      }
+    }
   }
+  if (first_output < 0) return false;
+  const int dimensions = args[first_output].dimensions;
+  int32_t extent[2] = {1, 1};
+  for (int d = 0; d < 2 && d < dimensions; ++d) {
+    extent[d] = plan.layouts[first_output].buffer.extent[d];
+  }
+
+  const vector<ArgumentPackager::ArgValue> full_values = *arg_values;
+  vector<void*> arg_value_ptrs(num_args);
+  // The storage of each output, as sized for the first tile; no later
+  // tile is larger.
+  vector<size_t> tile_bytes(num_args);
   for (int i = 0; i < num_args; ++i) {
+    arg_value_ptrs[i] = &(*arg_values)[i];
     if (args[i].kind != halide_argument_kind_output_buffer) continue;
-    if (!packager->PackResultValue(args[i], arg_values[i])) {
-      goto fail;
+    const buffer_t& buf = full_values[i].buffer;
+    tile_bytes[i] = buf.elem_size * MaxElemCount(args[i].dimensions, buf);
+  }
+  CallPlan tile_plan;
+
+  *time_usec = 0.0;
+  *num_tiles = 0;
+  *call_status = 0;
+  int32_t offset[2];
+  for (offset[1] = 0; offset[1] < extent[1]; offset[1] += tile_extent[1]) {
+    for (offset[0] = 0; offset[0] < extent[0]; offset[0] += tile_extent[0]) {
+      timer->Begin("tile_bounds_query");
+      *call_status = MakeTilePlan(plan, full_values, output_region, offset,
+                                  tile_extent, &tile_plan);
+      if (*call_status != 0) return true;
+      for (int i = 0; i < num_args; ++i) {
+        ArgumentPackager::ArgValue& value = (*arg_values)[i];
+        const buffer_t& layout = tile_plan.layouts[i].buffer;
+        if (args[i].kind == halide_argument_kind_output_buffer) {
+          if (layout.elem_size * MaxElemCount(args[i].dimensions, layout) >
+              tile_bytes[i]) {
+            return false;
+          }
+          uint8_t* host = value.buffer.host;
+          value.buffer = layout;
+          value.buffer.host = host;
+        } else if (args[i].kind == halide_argument_kind_input_buffer) {
+          value.buffer = full_values[i].buffer;
+          if (!CropBuffer(args[i].dimensions, layout, &value.buffer)) {
+            return false;
+          }
+        }
+      }
+
+      timer->Begin("run");
+      const double kTimeStart = GetTimeUsec();
+      *call_status = plan.argv_func(&arg_value_ptrs[0]);
+      if (*call_status != 0) return true;
+      *time_usec += GetTimeUsec() - kTimeStart;
+
+      timer->Begin("pack");
+      if (!packager->BeginResultTile()) return false;
+      for (int i = 0; i < num_args; ++i) {
+        if (args[i].kind != halide_argument_kind_output_buffer) continue;
+        if (!packager->PackResultValue(args[i], (*arg_values)[i])) {
+          return false;
+        }
+      }
+      if (!packager->EndResultTile()) return false;
+      ++*num_tiles;
     }
   }
+  return true;
+}
 
-  return 0;
+bool NeedsInputCopy(const CallPlan& plan) {
+  for (const auto& layout : plan.layouts) {
+    if (layout.needs_copy) return true;
+  }
+  return false;
+}
 
-fail:
-  halide_error(user_context, "MakePackagedCall_Failure.");
-  return -6502;
+// Layout variants must take exactly the same arguments as their filter
+// (only the constraints on the buffers may differ); anything else is
+// presumably a misnamed filter, and is never dispatched to.
+bool SameArguments(const halide_filter_metadata_t* a,
+                   const halide_filter_metadata_t* b) {
+  if (a->num_arguments != b->num_arguments) return false;
+  for (int i = 0; i < a->num_arguments; ++i) {
+    const halide_filter_argument_t& x = a->arguments[i];
+    const halide_filter_argument_t& y = b->arguments[i];
+    if (strcmp(x.name, y.name) != 0 || x.kind != y.kind ||
+        x.dimensions != y.dimensions || x.type_code != y.type_code ||
+        x.type_bits != y.type_bits) {
+      return false;
+    }
+  }
+  return true;
 }
 
-bool MetadataToJSON(const halide_filter_metadata_t* metadata, string* json) {
-  if (!metadata || !json) return false;
+// Plan the call for the filter, and if that would require copying any of
+// the inputs, for each of its layout variants in turn, choosing the first
+// that wouldn't. If all of them would, the filter itself is used.
+int ChooseCallPlan(const HalideFilterInfo& info,
+                   const vector<ArgumentPackager::ArgValue>& arg_values,
+                   const buffer_t& output_region, CallPlan* plan) {
+  int status = MakeCallPlan(info.metadata, info.argv_func, arg_values,
+                            output_region, plan);
+  if (status != 0) return status;
+  plan->variant = "default";
+  if (!NeedsInputCopy(*plan)) return 0;
 
-  std::ostringstream oss;
-  oss << "{"
-      << "\"version\":" << metadata->version << ","
-      << "\"target\":\"" << metadata->target << "\","
-      << "\"name\":\"" << metadata->name << "\","
-      << "\"arguments\":[";
+  for (const auto& v : info.variants) {
+    if (!SameArguments(info.metadata, v.metadata)) continue;
+    CallPlan variant_plan;
+    status = MakeCallPlan(v.metadata, v.argv_func, arg_values, output_region,
+                          &variant_plan);
+    if (status != 0) return status;
+    if (!NeedsInputCopy(variant_plan)) {
+      *plan = variant_plan;
+      plan->variant = v.layout;
+      return 0;
+    }
+  }
+  return 0;
+}
 
-  const size_t num_args = metadata->num_arguments;
-  const halide_filter_argument_t* args = metadata->arguments;
+// Return the factor by which to shrink the inputs of a progressive call
+// for its preview: the smallest power of two that brings every input
+// within kMaxPreviewPixels, or 1 if they already are (in which case a
+// preview wouldn't be any quicker than the call itself) or if any input
+// has a type that can't be downsampled.
+int32_t ChoosePreviewFactor(
+    const halide_filter_metadata_t* metadata,
+    const vector<ArgumentPackager::ArgValue>& arg_values) {
+  int32_t factor = 1;
+  for (int i = 0; i < metadata->num_arguments; ++i) {
+    const halide_filter_argument_t& a = metadata->arguments[i];
+    if (a.kind != halide_argument_kind_input_buffer) continue;
+    if (!FindDownsampleFunc(a.type_code, a.type_bits)) return 1;
+    const buffer_t& buf = arg_values[i].buffer;
+    const int64_t width = a.dimensions > 0 ? buf.extent[0] : 1;
+    const int64_t height = a.dimensions > 1 ? buf.extent[1] : 1;
+    while (factor < kMaxPreviewFactor &&
+           ((width + factor - 1) / factor) * ((height + factor - 1) / factor) >
+               kMaxPreviewPixels) {
+      factor *= 2;
+    }
+  }
+  return factor;
+}
 
-  for (size_t i = 0; i < num_args; ++i) {
-    const halide_filter_argument_t& arg = args[i];
-    if (i > 0) oss << ",";
-    oss << "{"
-        << "\"name\":\"" << arg.name << "\","
-        << "\"kind\":" << static_cast<int>(arg.kind) << ","
-        << "\"type_code\":\"" << kTypeCode[arg.type_code] << "\","
-        << "\"type_bits\":" << arg.type_bits;
-    // JSON doesn't allow trailing commas.
-    bool need_comma = true;
-    if (arg.kind != halide_argument_kind_input_scalar) {
-      if (need_comma) oss << ",";
-      oss << "\"dimensions\":" << arg.dimensions;
-      // unnecessary
-      // need_comma = true;
-    } else {
-      if (arg.def) {
-        if (need_comma) oss << ",";
-        oss << "\"def\":";
-        if (!EmitScalar(&oss, arg.type_code, arg.type_bits, *arg.def))
-          return false;
-        need_comma = true;
-      }
-      if (arg.min) {
-        if (need_comma) oss << ",";
-        oss << "\"min\":";
-        if (!EmitScalar(&oss, arg.type_code, arg.type_bits, *arg.min))
-          return false;
-        need_comma = true;
+// Shrink the region of buf (in dimensions 0 and 1) by factor, rounding
+// outwards, so that each pixel of the result covers factor x factor pixels
+// of the original.
+void ShrinkRegion(int dimensions, int32_t factor, buffer_t* buf) {
+  for (int i = 0; i < 2 && i < dimensions; ++i) {
+    const int32_t end = buf->min[i] + buf->extent[i];
+    const int32_t min = buf->min[i] >= 0
+                            ? buf->min[i] / factor
+                            : -((-buf->min[i] + factor - 1) / factor);
+    const int32_t max = end >= 0 ? (end + factor - 1) / factor
+                                 : -(-end / factor);
+    buf->min[i] = min;
+    buf->extent[i] = max - min;
+  }
+}
+
+// Run the filter on copies of its inputs shrunk by factor, computing the
+// correspondingly shrunk output region, and pack the result as a preview.
+// Storage for the preview is drawn from the pool, if any, and returned to
+// it before returning.
+//
+// Returns false if the preview can't be run or packed; otherwise, the
+// status of the filter (or its bounds query) is returned in *call_status.
+bool RunPreview(const HalideFilterInfo& info,
+                const vector<ArgumentPackager::ArgValue>& arg_values,
+                const buffer_t& output_region, int32_t factor,
+                ArgumentPackager* packager, BufferPool* pool,
+                int* call_status) {
+  const halide_filter_metadata_t* metadata = info.metadata;
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+  CallArena arena(pool);
+  vector<ArgumentPackager::ArgValue> values = arg_values;
+  vector<void*> arg_value_ptrs(num_args);
+  const int32_t kOrigin[2] = {0, 0};
+
+  for (int i = 0; i < num_args; ++i) {
+    arg_value_ptrs[i] = &values[i];
+    if (args[i].kind != halide_argument_kind_input_buffer) continue;
+    // Densely packed, with the same order of dimensions as the original.
+    buffer_t shrunk = arg_values[i].buffer;
+    ShrinkRegion(args[i].dimensions, factor, &shrunk);
+    buffer_t& buf = values[i].buffer;
+    buf = TileBufferLayout(shrunk, args[i].dimensions, kOrigin,
+                           shrunk.extent);
+    buf.host = arena.Allocate(buf.elem_size *
+                              MaxElemCount(args[i].dimensions, buf));
+    if (!buf.host ||
+        !packaged_call_runtime::Downsample(args[i].type_code,
+                                           args[i].type_bits,
+                                           &arg_values[i].buffer, factor,
+                                           &buf)) {
+      return false;
+    }
+  }
+
+  buffer_t preview_region = output_region;
+  ShrinkRegion(4, factor, &preview_region);
+  CallPlan plan;
+  *call_status = ChooseCallPlan(info, values, preview_region, &plan);
+  if (*call_status != 0) return true;
+
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind == halide_argument_kind_output_buffer) {
+      values[i].buffer = plan.layouts[i].buffer;
+      if (!PrepareOutputBuffer(args[i], &values[i].buffer, &arena)) {
+        return false;
       }
-      if (arg.max) {
-        if (need_comma) oss << ",";
-        oss << "\"max\":";
-        if (!EmitScalar(&oss, arg.type_code, arg.type_bits, *arg.max))
-          return false;
-        // unnecessary
-        // need_comma = true;
+    } else if (args[i].kind == halide_argument_kind_input_buffer) {
+      if (!AdaptInputBufferLayout(args[i], plan.layouts[i], &values[i].buffer,
+                                  &arena)) {
+        return false;
       }
     }
-    oss << "}";
   }
-  oss << "]}";
-  *json = oss.str();
-  return true;
+
+  const double kTimeStart = GetTimeUsec();
+  *call_status = plan.argv_func(&arg_value_ptrs[0]);
+  if (*call_status != 0) return true;
+  const double kTimeEnd = GetTimeUsec();
+
+  ResultStats preview;
+  preview["factor"] = factor;
+  if (!packager->BeginResultPreview() ||
+      !packager->PackResultTimeUsec(kTimeEnd - kTimeStart) ||
+      !packager->PackResultStats("preview", preview)) {
+    return false;
+  }
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    if (!packager->PackResultValue(args[i], values[i])) return false;
+  }
+  return packager->EndResultPreview();
 }
 
-bool ArgumentPackagerJson::GetMemberAsInt32Array(
-    const unique_ptr<JsonValue>& value, const string& name, const size_t len,
-    int32_t* result) {
-  unique_ptr<JsonValue> a = value->GetMember(name);
-  std::vector<int> v;
-  if (!a->AsInt32Array(&v) || v.size() != len) return false;
-  for (size_t i = 0; i < len; ++i) {
-    result[i] = static_cast<int32_t>(v[i]);
+void MakeCallPlanKey(const halide_filter_metadata_t* metadata,
+                     const vector<ArgumentPackager::ArgValue>& arg_values,
+                     const buffer_t& output_region,
+                     PackagedCallState::CallPlanKey* key) {
+  key->metadata = metadata;
+  key->values.clear();
+  key->values.insert(key->values.end(), output_region.min,
+                     output_region.min + 4);
+  key->values.insert(key->values.end(), output_region.extent,
+                     output_region.extent + 4);
+  for (int i = 0; i < metadata->num_arguments; ++i) {
+    const halide_filter_argument_t& a = metadata->arguments[i];
+    if (a.kind == halide_argument_kind_input_scalar) {
+      // Handles (e.g. the user_context) differ from call to call, but
+      // don't affect the bounds. Unused bytes of the scalar are always
+      // zero.
+      if (a.type_code == halide_type_handle) continue;
+      int32_t value[2];
+      static_assert(sizeof(arg_values[i].scalar) == sizeof(value),
+                    "halide_scalar_value_t must be 64 bits");
+      memcpy(value, &arg_values[i].scalar, sizeof(value));
+      key->values.insert(key->values.end(), value, value + 2);
+      continue;
+    }
+    if (a.kind != halide_argument_kind_input_buffer) continue;
+    const buffer_t& buf = arg_values[i].buffer;
+    key->values.push_back(buf.elem_size);
+    key->values.insert(key->values.end(), buf.extent, buf.extent + 4);
+    key->values.insert(key->values.end(), buf.stride, buf.stride + 4);
+    key->values.insert(key->values.end(), buf.min, buf.min + 4);
   }
-  return true;
 }
 
-bool ArgumentPackagerJson::UnpackArgumentValue(
-    void* user_context, const halide_filter_argument_t& a,
-    ArgValue* arg_value) {
-  if (a.kind == halide_argument_kind_output_buffer) return false;
+// Streaming implementation of the XXH64 hash, as specified at
+// https://github.com/Cyan4973/xxHash; assumes a little-endian host.
+class Xxh64 {
+ public:
+  explicit Xxh64(uint64_t seed) : seed_(seed), total_len_(0), pending_len_(0) {
+    acc_[0] = seed + kPrime1 + kPrime2;
+    acc_[1] = seed + kPrime2;
+    acc_[2] = seed;
+    acc_[3] = seed - kPrime1;
+  }
 
-  const JsonValue* var = GetInputMessage();
-  if (!var->IsMap()) return false;
+  void Update(const uint8_t* data, size_t len) {
+    total_len_ += len;
+    if (pending_len_ + len < kStripeSize) {
+      memcpy(pending_ + pending_len_, data, len);
+      pending_len_ += len;
+      return;
+    }
+    if (pending_len_ > 0) {
+      const size_t fill = kStripeSize - pending_len_;
+      memcpy(pending_ + pending_len_, data, fill);
+      ConsumeStripe(pending_);
+      data += fill;
+      len -= fill;
+      pending_len_ = 0;
+    }
+    while (len >= kStripeSize) {
+      ConsumeStripe(data);
+      data += kStripeSize;
+      len -= kStripeSize;
+    }
+    memcpy(pending_, data, len);
+    pending_len_ = len;
+  }
 
-  unique_ptr<JsonValue> inputs = var->GetMember("inputs");
-  if (!inputs->IsMap()) return false;
+  uint64_t Digest() const {
+    uint64_t h;
+    if (total_len_ >= kStripeSize) {
+      h = Rotl(acc_[0], 1) + Rotl(acc_[1], 7) + Rotl(acc_[2], 12) +
+          Rotl(acc_[3], 18);
+      for (int i = 0; i < 4; ++i) {
+        h ^= Round(0, acc_[i]);
+        h = h * kPrime1 + kPrime4;
+      }
+    } else {
+      h = seed_ + kPrime5;
+    }
+    h += total_len_;
 
-  if (a.type_code == halide_type_handle) {
-    // user_context is always specified via an explicit arg to the packaged
-    // call, never via the input message, and so should never be present
-    // there: it's an error if we find one.
-    if (!inputs->GetMember(a.name)->IsUndefined()) return false;
-    arg_value->scalar.u.handle = user_context;
-    return true;
+    const uint8_t* p = pending_;
+    size_t len = pending_len_;
+    for (; len >= 8; p += 8, len -= 8) {
+      h ^= Round(0, Read64(p));
+      h = Rotl(h, 27) * kPrime1 + kPrime4;
+    }
+    if (len >= 4) {
+      uint32_t k;
+      memcpy(&k, p, sizeof(k));
+      h ^= static_cast<uint64_t>(k) * kPrime1;
+      h = Rotl(h, 23) * kPrime2 + kPrime3;
+      p += 4;
+      len -= 4;
+    }
+    for (; len > 0; ++p, --len) {
+      h ^= *p * kPrime5;
+      h = Rotl(h, 11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
   }
 
-  unique_ptr<JsonValue> value = inputs->GetMember(a.name);
-  if (value->IsUndefined()) return false;
+ private:
+  static const size_t kStripeSize = 32;
+  static const uint64_t kPrime1 = 11400714785074694791ULL;
+  static const uint64_t kPrime2 = 14029467366897019727ULL;
+  static const uint64_t kPrime3 = 1609587929392839161ULL;
+  static const uint64_t kPrime4 = 9650029242287828579ULL;
+  static const uint64_t kPrime5 = 2870177450012600261ULL;
 
-  if (a.kind == halide_argument_kind_input_buffer) {
-    // input buffer
-    if (!value->IsMap()) return false;
-    host_storage_.emplace_back(new vector<uint8_t>);
-    vector<uint8_t>* storage = host_storage_.back().get();
-    if (!value->GetMember("elem_size")->AsInt32(&arg_value->buffer.elem_size) ||
-        !GetMemberAsInt32Array(value, "extent", 4, arg_value->buffer.extent) ||
-        !GetMemberAsInt32Array(value, "stride", 4, arg_value->buffer.stride) ||
-        !GetMemberAsInt32Array(value, "min", 4, arg_value->buffer.min) ||
-        !value->GetMember("host")->AsByteArray(storage))
-      return false;
-    arg_value->buffer.host = storage->data();
-    return true;
+  static uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+  static uint64_t Read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
   }
 
-#define TYPE_AND_SIZE(CODE, BITS) (((CODE) << 8) | (BITS))
+  static uint64_t Round(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    return Rotl(acc, 31) * kPrime1;
+  }
 
-  if (TYPE_AND_SIZE(a.type_code, a.type_bits) ==
-      TYPE_AND_SIZE(halide_type_uint, 1)) {
-    // bool is modeled as uint(1) in Halide
-    return value->AsBool(&arg_value->scalar.u.b);
+  void ConsumeStripe(const uint8_t* p) {
+    for (int i = 0; i < 4; ++i) {
+      acc_[i] = Round(acc_[i], Read64(p + 8 * i));
+    }
   }
 
-  // JS doesn't really distinguish between numeric types, so we have to
-  // play a bit loose here. Oh well.
+  uint64_t seed_;
+  uint64_t acc_[4];
+  uint64_t total_len_;
+  uint8_t pending_[kStripeSize];
+  size_t pending_len_;
+};
 
-  int32_t i;
-  double d;
-  switch (TYPE_AND_SIZE(a.type_code, a.type_bits)) {
+bool EmitScalar(std::ostream* oss, int type_code, int type_bits,
+                const halide_scalar_value_t& scalar) {
+#define TYPE_AND_SIZE(CODE, BITS) (((CODE) << 8) | (BITS))
+  switch (TYPE_AND_SIZE(type_code, type_bits)) {
     case TYPE_AND_SIZE(halide_type_float, 32):
-      if (!value->AsDouble(&d)) return false;
-      arg_value->scalar.u.f32 = static_cast<float>(d);
+      *oss << scalar.u.f32;
       return true;
     case TYPE_AND_SIZE(halide_type_float, 64):
-      if (!value->AsDouble(&d)) return false;
-      arg_value->scalar.u.f64 = static_cast<double>(d);
+      *oss << scalar.u.f64;
       return true;
     case TYPE_AND_SIZE(halide_type_int, 8):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.i8 = static_cast<int8_t>(i);
+      // emit as number, not char
+      *oss << static_cast<int>(scalar.u.i8);
       return true;
     case TYPE_AND_SIZE(halide_type_int, 16):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.i16 = static_cast<int16_t>(i);
+      *oss << scalar.u.i16;
       return true;
     case TYPE_AND_SIZE(halide_type_int, 32):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.i32 = static_cast<int32_t>(i);
+      *oss << scalar.u.i32;
       return true;
     case TYPE_AND_SIZE(halide_type_int, 64):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.i64 = static_cast<int64_t>(i);
+      *oss << scalar.u.i64;
+      return true;
+    case TYPE_AND_SIZE(halide_type_uint, 1):
+      *oss << (scalar.u.b ? "true" : "false");
       return true;
     case TYPE_AND_SIZE(halide_type_uint, 8):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.u8 = static_cast<uint8_t>(i);
+      // emit as number, not char
+      *oss << static_cast<unsigned int>(scalar.u.u8);
       return true;
     case TYPE_AND_SIZE(halide_type_uint, 16):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.u16 = static_cast<uint16_t>(i);
+      *oss << scalar.u.u16;
       return true;
     case TYPE_AND_SIZE(halide_type_uint, 32):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.u32 = static_cast<uint32_t>(i);
+      *oss << scalar.u.u32;
       return true;
     case TYPE_AND_SIZE(halide_type_uint, 64):
-      if (!value->AsInt32(&i)) return false;
-      arg_value->scalar.u.u64 = static_cast<uint64_t>(i);
+      *oss << scalar.u.u64;
+      return true;
+    case TYPE_AND_SIZE(halide_type_handle, 64):
+      // Handles are always emitted as literal 0.
+      *oss << 0;
       return true;
     default:
       return false;
   }
-
 #undef TYPE_AND_SIZE
 }
 
-bool ArgumentPackagerJson::PackResultValue(const halide_filter_argument_t& a,
-                                           const ArgValue& arg_value) {
-  if (a.kind != halide_argument_kind_output_buffer) return false;
-  const buffer_t& buf = arg_value.buffer;
+// Write s to oss as a JSON string literal.
+void EmitJsonString(std::ostream* oss, const string& s) {
+  *oss << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      *oss << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      *oss << escaped;
+    } else {
+      *oss << c;
+    }
+  }
+  *oss << '"';
+}
 
-  unique_ptr<JsonValue> d = NewMap();
-  if (!d->SetMember("elem_size", NewInt32(buf.elem_size)) ||
-      !d->SetMember("extent", NewInt32Array(buf.extent, 4)) ||
-      !d->SetMember("stride", NewInt32Array(buf.stride, 4)) ||
-      !d->SetMember("min", NewInt32Array(buf.min, 4)) ||
-      !d->SetMember("dimensions", NewInt32(a.dimensions)) ||
-      !d->SetMember("type_code", NewString(kTypeCode[a.type_code])) ||
-      !d->SetMember("host",
-                    NewByteArray(buf.host, MaxElemCount(a.dimensions, buf)))) {
+// Write d to oss as a JSON number (or null, since JSON has no NaN or
+// infinity).
+void EmitJsonNumber(std::ostream* oss, double d) {
+  if (std::isfinite(d)) {
+    *oss << d;
+  } else {
+    *oss << "null";
+  }
+}
+
+// Write the members of stats to oss (as the members of a JSON object),
+// preceded by separator.
+void EmitJsonStats(std::ostream* oss, const ResultStats& stats,
+                   const char* separator) {
+  for (const auto& it : stats) {
+    *oss << separator;
+    EmitJsonString(oss, it.first);
+    *oss << ':';
+    EmitJsonNumber(oss, it.second);
+    separator = ",";
+  }
+}
+
+// Move each layout variant in m into the variants of its filter, if
+// that filter is present.
+void GroupLayoutVariants(HalideFilterInfoMap* m) {
+  for (auto it = m->begin(); it != m->end();) {
+    const size_t pos = it->first.rfind(kLayoutVariantSeparator);
+    auto filter = (pos == string::npos) ? m->end()
+                                        : m->find(it->first.substr(0, pos));
+    if (filter == m->end()) {
+      ++it;
+      continue;
+    }
+    HalideFilterVariant v;
+    v.layout = it->first.substr(pos + strlen(kLayoutVariantSeparator));
+    v.metadata = it->second.metadata;
+    v.argv_func = it->second.argv_func;
+    filter->second.variants.push_back(v);
+    it = m->erase(it);
+  }
+}
+
+int EnumerateFilters(void* enumerate_context,
+                     const halide_filter_metadata_t* metadata,
+                     ArgvFunc argv_func) {
+  HalideFilterInfoMap* m =
+      reinterpret_cast<HalideFilterInfoMap*>(enumerate_context);
+  m->emplace(std::pair<string, HalideFilterInfo>(
+      metadata->name, {metadata, argv_func, {}}));
+  return 0;
+}
+
+}  // namespace
+
+bool Copy(const buffer_t* src, buffer_t* dst) {
+  typedef int (*CopyImageFunc)(buffer_t*, buffer_t*);
+
+  static const CopyImageFunc kCopyFuncs[4] = {
+      // elem_size = 1
+      copy_image_uint8_filter,
+      // elem_size = 2
+      copy_image_uint16_filter,
+      // elem_size = 3
+      CopyImageInvalid,
+      // elem_size = 4
+      copy_image_float32_filter,
+  };
+  const int elem_size = (src->elem_size - 1) & 3;
+
+  if (src->elem_size > 4 || src->elem_size != dst->elem_size) {
     return false;
   }
 
-  JsonValue* results = GetOutputMessage();
-  if (!results->IsMap()) return false;
+  buffer_t src_4d = Pad4d(*src);
+  buffer_t dst_4d = Pad4d(*dst);
+  return kCopyFuncs[elem_size](&src_4d, &dst_4d) == 0;
+}
 
-  unique_ptr<JsonValue> outputs = results->GetMember("outputs");
-  if (!outputs->IsMap()) {
-    outputs = NewMap();
+bool Downsample(int type_code, int type_bits, const buffer_t* src,
+                int32_t factor, buffer_t* dst) {
+  const DownsampleImageFunc downsample_func =
+      FindDownsampleFunc(type_code, type_bits);
+
+  if (!downsample_func || src->elem_size != (type_bits + 7) / 8 ||
+      src->elem_size != dst->elem_size || factor < 1) {
+    return false;
   }
-  outputs->SetMember(a.name, d);
-  results->SetMember("outputs", outputs);
 
-  return true;
+  buffer_t src_4d = Pad4d(*src);
+  buffer_t dst_4d = Pad4d(*dst);
+  return downsample_func(&src_4d, factor, &dst_4d) == 0;
 }
 
-bool ArgumentPackagerJson::PackResultTimeUsec(double time_usec) {
-  JsonValue* results = GetOutputMessage();
-  if (!results->IsMap()) return false;
-  if (!results->SetMember("time_usec", NewDouble(time_usec))) return false;
-  return true;
+namespace {
+
+// Per-call statistics of the work-stealing pool, with one slot per worker,
+// plus a last one for the threads outside the pool that start loops.
+struct WorkStealingStats {
+  explicit WorkStealingStats(int slots)
+      : tasks(new std::atomic<int>[slots]),
+        steals(new std::atomic<int>[slots]) {
+    for (int i = 0; i < slots; ++i) {
+      tasks[i] = 0;
+      steals[i] = 0;
+    }
+  }
+
+  unique_ptr<std::atomic<int>[]> tasks;
+  unique_ptr<std::atomic<int>[]> steals;
+};
+
+class WorkStealingPool {
+ public:
+  // The pool is created on first use, and lives as long as the process.
+  static WorkStealingPool* Get() {
+    static WorkStealingPool* pool = new WorkStealingPool(
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+    return pool;
+  }
+
+  int num_workers() const { return static_cast<int>(workers_.size()); }
+
+  int DoParFor(void* user_context, halide_task_t f, int min, int size,
+               uint8_t* closure, WorkStealingStats* stats);
+
+  // The total time each worker has spent waiting for work.
+  vector<double> IdleUsec() const;
+
+ private:
+  struct Job {
+    halide_task_t f;
+    uint8_t* closure;
+    void* user_context;
+    WorkStealingStats* stats;
+    std::atomic<int> remaining;
+    // The first nonzero result of any task.
+    std::atomic<int> status;
+  };
+
+  struct Task {
+    Job* job;
+    int index;
+  };
+
+  struct Worker {
+    // Access to tasks is controlled by mutex.
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    // These are protected by the pool's mutex_.
+    bool idle;
+    double idle_since;
+    double idle_usec;
+
+    Worker() : idle(false), idle_since(0.0), idle_usec(0.0) {}
+  };
+
+  explicit WorkStealingPool(int num_workers);
+
+  // Run one queued task, if there are any: from the back of the deque of
+  // worker self (if it's a worker), or else from the front of another's.
+  bool RunOneTask(int self);
+  void WorkerMain(int self);
+
+  vector<unique_ptr<Worker>> workers_;
+  // Access to pending_ and the idle state of the workers is controlled by
+  // mutex_; wake_ is signaled when tasks are queued or a job completes.
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  // The number of queued tasks.
+  int pending_;
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+};
+
+// The index of the pool worker running on this thread, or -1.
+thread_local int tls_worker_index = -1;
+
+WorkStealingPool::WorkStealingPool(int num_workers) : pending_(0) {
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.emplace_back(new Worker);
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    std::thread(&WorkStealingPool::WorkerMain, this, i).detach();
+  }
+}
+
+int WorkStealingPool::DoParFor(void* user_context, halide_task_t f, int min,
+                               int size, uint8_t* closure,
+                               WorkStealingStats* stats) {
+  if (size <= 0) return 0;
+  Job job;
+  job.f = f;
+  job.closure = closure;
+  job.user_context = user_context;
+  job.stats = stats;
+  job.remaining = size;
+  job.status = 0;
+
+  // A worker queues a nested loop on its own deque, for the others to
+  // steal; any other thread deals it out to the workers in contiguous
+  // runs, so that neighboring tasks tend to run on the same thread.
+  const int self = tls_worker_index;
+  const int n = num_workers();
+  for (int w = 0; w < n; ++w) {
+    if (self >= 0 && w != self) continue;
+    const int begin = self >= 0 ? 0 : static_cast<int>(int64_t(size) * w / n);
+    const int end =
+        self >= 0 ? size : static_cast<int>(int64_t(size) * (w + 1) / n);
+    std::lock_guard<std::mutex> lock(workers_[w]->mutex);
+    for (int i = begin; i < end; ++i) {
+      workers_[w]->tasks.push_back(Task{&job, min + i});
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ += size;
+  }
+  wake_.notify_all();
+
+  // Help out (with any job's tasks, so that nested loops can't deadlock)
+  // until this job is done.
+  for (;;) {
+    if (job.remaining == 0) break;
+    if (RunOneTask(self)) continue;
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_.wait(lock, [&job, this] {
+      return job.remaining == 0 || pending_ > 0;
+    });
+  }
+  return job.status;
+}
+
+vector<double> WorkStealingPool::IdleUsec() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const double now = GetTimeUsec();
+  vector<double> idle_usec;
+  for (const auto& worker : workers_) {
+    idle_usec.push_back(worker->idle_usec +
+                        (worker->idle ? now - worker->idle_since : 0.0));
+  }
+  return idle_usec;
+}
+
+bool WorkStealingPool::RunOneTask(int self) {
+  const int n = num_workers();
+  Task task = {nullptr, 0};
+  bool found = false, stolen = false;
+  if (self >= 0) {
+    Worker* worker = workers_[self].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    if (!worker->tasks.empty()) {
+      task = worker->tasks.back();
+      worker->tasks.pop_back();
+      found = true;
+    }
+  }
+  for (int i = 1; i <= n && !found; ++i) {
+    const int victim = (std::max(self, 0) + i) % n;
+    if (victim == self) continue;
+    Worker* worker = workers_[victim].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    if (!worker->tasks.empty()) {
+      task = worker->tasks.front();
+      worker->tasks.pop_front();
+      found = stolen = true;
+    }
+  }
+  if (!found) return false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --pending_;
+  }
+
+  Job* job = task.job;
+  const int slot = self >= 0 ? self : n;
+  if (job->stats) {
+    job->stats->tasks[slot]++;
+    // Threads outside the pool have no deque of their own to steal from.
+    if (stolen && self >= 0) job->stats->steals[slot]++;
+  }
+  // Go through halide_do_task(), so that any custom do_task still applies.
+  const int result =
+      halide_do_task(job->user_context, job->f, task.index, job->closure);
+  if (result != 0) {
+    int expected = 0;
+    job->status.compare_exchange_strong(expected, result);
+  }
+  if (--job->remaining == 0) {
+    // Lock, so that the thread waiting on the job can't miss the wakeup.
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_.notify_all();
+  }
+  return true;
+}
+
+void WorkStealingPool::WorkerMain(int self) {
+  tls_worker_index = self;
+  Worker* worker = workers_[self].get();
+  for (;;) {
+    if (RunOneTask(self)) continue;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (pending_ > 0) continue;
+    worker->idle = true;
+    worker->idle_since = GetTimeUsec();
+    wake_.wait(lock, [this] { return pending_ > 0; });
+    worker->idle = false;
+    worker->idle_usec += GetTimeUsec() - worker->idle_since;
+  }
+}
+
+// The WorkStealingStats for each user_context with a WorkStealingScope.
+// Access is controlled by gWorkStealingStatsMutex.
+std::map<void*, WorkStealingStats*> gWorkStealingStats;
+std::mutex gWorkStealingStatsMutex;
+
+// The number of registered WorkStealingScopes, so that the parallel loops
+// of calls without work stealing needn't take gWorkStealingStatsMutex.
+std::atomic<int> gWorkStealingScopes(0);
+
+// WorkStealingScope runs the parallel loops of calls with the given
+// user_context on the work-stealing pool, from Begin() until End() (or
+// its destruction).
+class WorkStealingScope {
+ public:
+  explicit WorkStealingScope(void* user_context)
+      : user_context_(user_context), registered_(false) {}
+  ~WorkStealingScope() { Unregister(); }
+
+  void Begin() {
+    WorkStealingPool* pool = WorkStealingPool::Get();
+    stats_.reset(new WorkStealingStats(pool->num_workers() + 1));
+    idle_usec_ = pool->IdleUsec();
+    std::lock_guard<std::mutex> lock(gWorkStealingStatsMutex);
+    gWorkStealingStats[user_context_] = stats_.get();
+    if (!registered_) {
+      registered_ = true;
+      gWorkStealingScopes.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  // Return the statistics for each worker (and, last, for the threads
+  // outside the pool) since Begin().
+  vector<ResultStats> End() {
+    Unregister();
+    vector<ResultStats> list;
+    if (!stats_) return list;
+    const vector<double> idle_usec = WorkStealingPool::Get()->IdleUsec();
+    for (size_t i = 0; i <= idle_usec.size(); ++i) {
+      const bool worker = i < idle_usec.size();
+      ResultStats stats;
+      stats["worker"] = worker ? static_cast<double>(i) : -1.0;
+      stats["tasks"] = stats_->tasks[i];
+      stats["steals"] = stats_->steals[i];
+      if (worker) stats["idle_usec"] = idle_usec[i] - idle_usec_[i];
+      list.push_back(stats);
+    }
+    return list;
+  }
+
+ private:
+  void Unregister() {
+    if (!registered_) return;
+    std::lock_guard<std::mutex> lock(gWorkStealingStatsMutex);
+    auto it = gWorkStealingStats.find(user_context_);
+    if (it != gWorkStealingStats.end() && it->second == stats_.get()) {
+      gWorkStealingStats.erase(it);
+    }
+    registered_ = false;
+    gWorkStealingScopes.fetch_sub(1, std::memory_order_release);
+  }
+
+  void* const user_context_;
+  bool registered_;
+  unique_ptr<WorkStealingStats> stats_;
+  vector<double> idle_usec_;
+
+  WorkStealingScope(const WorkStealingScope&) = delete;
+  WorkStealingScope& operator=(const WorkStealingScope&) = delete;
+};
+
+// The number of running calls that leave the thread count alone, and
+// whether a call that changes it is running (or how many are waiting to).
+// Access is controlled by gThreadCountMutex; gThreadCountChanged is
+// signaled whenever a call finishes.
+int gSharedThreadCountCalls = 0;
+bool gExclusiveThreadCountCall = false;
+int gWaitingExclusiveThreadCountCalls = 0;
+std::mutex gThreadCountMutex;
+std::condition_variable gThreadCountChanged;
+
+// The thread count is global to the Halide runtime, but calls may run
+// concurrently (e.g. on the nexe shell's workers). ThreadCountScope lets
+// any number of calls that leave the thread count alone run at once, but
+// a call that changes it (i.e. a scaling sweep) runs alone, and restores
+// the original count when it's done, from Release() (or its
+// destruction).
+class ThreadCountScope {
+ public:
+  ThreadCountScope() : held_(false), exclusive_(false), restore_(0) {}
+  ~ThreadCountScope() { Release(); }
+
+  // Wait until the call may run; exclusive if it will change the thread
+  // count. Waiting exclusive calls take precedence, so that a sweep can't
+  // be starved by a stream of ordinary calls.
+  void Acquire(bool exclusive) {
+    std::unique_lock<std::mutex> lock(gThreadCountMutex);
+    if (exclusive) {
+      ++gWaitingExclusiveThreadCountCalls;
+      gThreadCountChanged.wait(lock, [] {
+        return !gExclusiveThreadCountCall && gSharedThreadCountCalls == 0;
+      });
+      --gWaitingExclusiveThreadCountCalls;
+      gExclusiveThreadCountCall = true;
+    } else {
+      gThreadCountChanged.wait(lock, [] {
+        return !gExclusiveThreadCountCall &&
+               gWaitingExclusiveThreadCountCalls == 0;
+      });
+      ++gSharedThreadCountCalls;
+    }
+    held_ = true;
+    exclusive_ = exclusive;
+  }
+
+  // Only valid after Acquire(true).
+  void SetNumThreads(int threads) {
+    const int previous = halide_set_num_threads(threads);
+    if (restore_ == 0) restore_ = previous;
+  }
+
+  void Release() {
+    if (!held_) return;
+    if (restore_ > 0) halide_set_num_threads(restore_);
+    restore_ = 0;
+    {
+      std::lock_guard<std::mutex> lock(gThreadCountMutex);
+      if (exclusive_) {
+        gExclusiveThreadCountCall = false;
+      } else {
+        --gSharedThreadCountCalls;
+      }
+    }
+    gThreadCountChanged.notify_all();
+    held_ = false;
+  }
+
+ private:
+  bool held_;
+  bool exclusive_;
+  // The thread count to restore, or 0 if it hasn't been changed.
+  int restore_;
+
+  ThreadCountScope(const ThreadCountScope&) = delete;
+  ThreadCountScope& operator=(const ThreadCountScope&) = delete;
+};
+
+// Fill in the ResultCache key for a call to the filter with the given
+// inputs.
+void MakeResultCacheKey(
+    const halide_filter_metadata_t* metadata,
+    const vector<ArgumentPackager::ArgValue>& arg_values,
+    const vector<std::shared_ptr<const ResidentInputs::Entry>>& resident,
+    const buffer_t& output_region, ResultCache::Key* key) {
+  key->metadata = metadata;
+  key->values.clear();
+  for (int j = 0; j < 4; ++j) {
+    key->values.push_back(static_cast<uint32_t>(output_region.min[j]));
+    key->values.push_back(static_cast<uint32_t>(output_region.extent[j]));
+  }
+  for (int i = 0; i < metadata->num_arguments; ++i) {
+    const halide_filter_argument_t& a = metadata->arguments[i];
+    if (a.kind == halide_argument_kind_output_buffer ||
+        a.type_code == halide_type_handle) {
+      continue;
+    }
+    if (a.kind == halide_argument_kind_input_scalar) {
+      // Unused bytes of the scalar are always zero.
+      uint64_t value = 0;
+      static_assert(sizeof(arg_values[i].scalar) == sizeof(value),
+                    "halide_scalar_value_t must be 64 bits");
+      memcpy(&value, &arg_values[i].scalar, sizeof(value));
+      key->values.push_back(value);
+      continue;
+    }
+    // The layout of the buffer in memory doesn't matter.
+    const buffer_t& buf = arg_values[i].buffer;
+    key->values.push_back(buf.elem_size);
+    for (int j = 0; j < a.dimensions; ++j) {
+      key->values.push_back(static_cast<uint32_t>(buf.min[j]));
+      key->values.push_back(static_cast<uint32_t>(buf.extent[j]));
+    }
+    // Resident inputs were hashed when they were uploaded.
+    key->values.push_back(resident[i] ? resident[i]->hash
+                                      : HashBuffer(buf, a.dimensions));
+  }
+}
+
+// Add copies of the outputs of a call to the cache, unless they're too
+// large for it.
+void AddCachedResults(const halide_filter_metadata_t* metadata,
+                      const vector<ArgumentPackager::ArgValue>& arg_values,
+                      double time_usec, const string& variant,
+                      const ResultCache::Key& key, ResultCache* cache) {
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+  size_t bytes = 0;
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    const buffer_t& buf = arg_values[i].buffer;
+    bytes += buf.elem_size * MaxElemCount(args[i].dimensions, buf);
+  }
+  if (bytes > cache->max_bytes()) return;
+
+  std::shared_ptr<ResultCache::Entry> entry(new ResultCache::Entry);
+  entry->outputs.resize(num_args);
+  entry->time_usec = time_usec;
+  entry->variant = variant;
+  entry->bytes = bytes;
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    const buffer_t& buf = arg_values[i].buffer;
+    const size_t size = buf.elem_size * MaxElemCount(args[i].dimensions, buf);
+    uint8_t* storage = new (std::nothrow) uint8_t[size];
+    if (!storage) return;
+    entry->storage.emplace_back(storage);
+    memcpy(storage, buf.host, size);
+    entry->outputs[i] = buf;
+    entry->outputs[i].host = storage;
+  }
+  cache->Add(key, entry);
+}
+
+// Unpack the filter's inputs, looking up any given as handles in state's
+// resident inputs; resident[i] is set to the entry for each of those. If
+// an input's handle is invalid, *unknown_handle is set, and false returned.
+bool UnpackInputs(
+    void* user_context, const halide_filter_metadata_t* metadata,
+    ArgumentPackager* packager, PackagedCallState* state,
+    vector<ArgumentPackager::ArgValue>* arg_values,
+    vector<std::shared_ptr<const ResidentInputs::Entry>>* resident,
+    bool* unknown_handle) {
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+  *unknown_handle = false;
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind == halide_argument_kind_output_buffer) continue;
+    int32_t handle = 0;
+    if (args[i].kind == halide_argument_kind_input_buffer &&
+        packager->UnpackInputHandle(args[i], &handle)) {
+      if (state) (*resident)[i] = state->resident_inputs()->Find(handle);
+      if (!(*resident)[i]) {
+        *unknown_handle = true;
+        return false;
+      }
+      (*arg_values)[i].buffer = (*resident)[i]->buffer;
+      continue;
+    }
+    if (!packager->UnpackArgumentValue(user_context, args[i],
+                                       &(*arg_values)[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Fill in entry with a copy of buf (which may be borrowed from the message),
+// in the layout the filter requires of it.
+bool MakeResidentInput(const halide_filter_argument_t& arg,
+                       const CallPlan::BufferLayout& layout,
+                       const buffer_t& buf, ResidentInputs::Entry* entry) {
+  entry->uploaded = buf;
+  entry->uploaded.host = NULL;
+  entry->uploaded.dev = 0;
+  entry->buffer = layout.needs_copy ? layout.buffer : buf;
+  entry->bytes = entry->buffer.elem_size *
+                 MaxElemCount(arg.dimensions, entry->buffer);
+  // Over-allocate, so that the contents can be aligned.
+  entry->storage.reset(
+      new (std::nothrow) uint8_t[entry->bytes + kBufferAlignment - 1]);
+  if (!entry->storage) return false;
+  uint8_t* data = entry->storage.get();
+  const uintptr_t misalignment =
+      reinterpret_cast<uintptr_t>(data) % kBufferAlignment;
+  entry->buffer.host =
+      data + (misalignment ? kBufferAlignment - misalignment : 0);
+  entry->buffer.dev = 0;
+  if (layout.needs_copy) {
+    if (!packaged_call_runtime::Copy(&buf, &entry->buffer)) return false;
+  } else {
+    memcpy(entry->buffer.host, buf.host, entry->bytes);
+  }
+  entry->hash = HashBuffer(entry->buffer, arg.dimensions);
+  return true;
+}
+
+}  // namespace
+
+int SetNumThreads(int threads) {
+  std::unique_lock<std::mutex> lock(gThreadCountMutex);
+  gThreadCountChanged.wait(lock, [] {
+    return !gExclusiveThreadCountCall &&
+           gWaitingExclusiveThreadCountCalls == 0;
+  });
+  return halide_set_num_threads(threads);
+}
+
+int WorkStealingDoParFor(void* user_context, halide_task_t f, int min,
+                         int size, uint8_t* closure) {
+  if (gWorkStealingScopes.load(std::memory_order_acquire) == 0) {
+    return halide_default_do_par_for(user_context, f, min, size, closure);
+  }
+  WorkStealingStats* stats = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(gWorkStealingStatsMutex);
+    auto it = gWorkStealingStats.find(user_context);
+    if (it != gWorkStealingStats.end()) stats = it->second;
+  }
+  if (!stats) {
+    return halide_default_do_par_for(user_context, f, min, size, closure);
+  }
+  return WorkStealingPool::Get()->DoParFor(user_context, f, min, size,
+                                           closure, stats);
+}
+
+int MakePackagedCall(void* user_context,
+                     const halide_filter_metadata_t* metadata,
+                     ArgvFunc argv_func, ArgumentPackager* packager) {
+  return MakePackagedCall(user_context, metadata, argv_func, packager,
+                          nullptr);
+}
+
+int MakePackagedCall(void* user_context,
+                     const halide_filter_metadata_t* metadata,
+                     ArgvFunc argv_func, ArgumentPackager* packager,
+                     PackagedCallState* state) {
+  if (!metadata || !argv_func) return -6809;
+  const HalideFilterInfo info = {metadata, argv_func, {}};
+  return MakePackagedCall(user_context, info, packager, state);
+}
+
+int MakePackagedCall(void* user_context, const HalideFilterInfo& info,
+                     ArgumentPackager* packager, PackagedCallState* state) {
+  const halide_filter_metadata_t* metadata = info.metadata;
+  if (!metadata || !info.argv_func || !packager) return -6809;
+
+  // All locals declared at top to allow for "goto fail" error handling.
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+  vector<void*> arg_value_ptrs(num_args);
+  vector<ArgumentPackager::ArgValue> arg_values(num_args);
+  CallArena arena(state ? state->buffer_pool() : nullptr);
+  size_t arena_bytes = 0;
+  PackagedCallState::CallPlanKey plan_key;
+  CallPlan new_plan;
+  const CallPlan* plan = nullptr;
+  bool cached_plan = false;
+  int bounds_query_status = 0, call_status = 0;
+  double time_usec = 0.0;
+  PackagedCallOptions options;
+  vector<int32_t> thread_counts;
+  vector<double> samples;
+  vector<ResultStats> scaling;
+  bool tiled = false;
+  CallPlan tile_plan;
+  const int32_t kOrigin[2] = {0, 0};
+  int num_tiles = 0;
+  bool profiled = false;
+  ProfilerSnapshot profile_before, profile_after;
+  MemoryStats memory;
+  ScopedMemoryStats memory_scope(user_context, &memory);
+  WorkStealingScope work_stealing(user_context);
+  vector<ResultStats> work_stealing_stats;
+  ThreadCountScope thread_count_scope;
+  CallTrace trace;
+  unique_ptr<ScopedCallTrace> trace_scope;
+  bool cacheable = false;
+  ResultCache::Key cache_key;
+  std::shared_ptr<const ResultCache::Entry> cached;
+  buffer_t output_region;
+  int32_t preview_factor = 1;
+  vector<std::shared_ptr<const ResidentInputs::Entry>> resident(num_args);
+  bool unknown_handle = false;
+  ResultStats phases;
+  PhaseTimer timer(&phases);
+
+  timer.Begin("unpack");
+  if (!packager->UnpackCallOptions(&options) ||
+      options.warmup_iterations < 0 || options.iterations < 1) {
+    goto fail;
+  }
+  for (int32_t n : options.thread_counts) {
+    if (n < 1) goto fail;
+  }
+  if (options.work_stealing && !options.thread_counts.empty()) {
+    goto fail;
+  }
+  // Tiles are only ever run once, so tiled calls can't be benchmarked.
+  // Nor can they be previewed, since the tiles of the preview and of the
+  // call itself would be indistinguishable.
+  tiled = options.tile_extent[0] != 0 || options.tile_extent[1] != 0;
+  if (tiled &&
+      (options.tile_extent[0] < 1 || options.tile_extent[1] < 1 ||
+       options.warmup_iterations != 0 || options.iterations != 1 ||
+       !options.thread_counts.empty() || options.progressive)) {
+    goto fail;
+  }
+  if (options.output_min.size() != options.output_extent.size() ||
+      options.output_extent.size() > 4) {
+    goto fail;
+  }
+  for (int32_t extent : options.output_extent) {
+    if (extent < 1) goto fail;
+  }
+  // A thread count of zero means "leave it alone".
+  thread_counts = options.thread_counts;
+  if (thread_counts.empty()) thread_counts.push_back(0);
+
+  if (!UnpackInputs(user_context, metadata, packager, state, &arg_values,
+                    &resident, &unknown_handle)) {
+    if (unknown_handle) {
+      // Distinguished, so that the caller knows to upload the input again.
+      halide_error(user_context, "MakePackagedCall_UnknownHandle.");
+      return -6502;
+    }
+    goto fail;
+  }
+  ChooseOutputRegion(metadata, arg_values, resident, options,
+                     &output_region);
+
+  // A call that runs the filter just once can reuse the outputs of an
+  // identical earlier call.
+  cacheable = state && options.use_cache && !tiled && !options.trace &&
+              !options.work_stealing && options.warmup_iterations == 0 &&
+              options.iterations == 1 && options.thread_counts.empty();
+  if (cacheable) {
+    timer.Begin("cache_lookup");
+    MakeResultCacheKey(metadata, arg_values, resident, output_region,
+                       &cache_key);
+    cached = state->result_cache()->Find(cache_key);
+  }
+  if (cached) {
+    timer.Begin("pack");
+    if (!packager->PackResultTimeUsec(cached->time_usec) ||
+        !packager->PackResultBool("cache_hit", true) ||
+        !packager->PackResultStats("memory", memory.GetStats())) {
+      goto fail;
+    }
+    if (!info.variants.empty() &&
+        !packager->PackResultString("variant", cached->variant)) {
+      goto fail;
+    }
+    for (int i = 0; i < num_args; ++i) {
+      if (args[i].kind != halide_argument_kind_output_buffer) continue;
+      arg_values[i].buffer = cached->outputs[i];
+      if (!packager->PackResultValue(args[i], arg_values[i])) {
+        goto fail;
+      }
+    }
+    timer.End();
+    if (!packager->PackResultStats("phase_usec", phases)) {
+      goto fail;
+    }
+    return 0;
+  }
+
+  // From here until the runs are done, the filter may be run.
+  thread_count_scope.Acquire(!options.thread_counts.empty());
+
+  // Cached results are quicker than any preview.
+  if (options.progressive) {
+    preview_factor = ChoosePreviewFactor(metadata, arg_values);
+  }
+  if (preview_factor > 1) {
+    timer.Begin("preview");
+    if (!RunPreview(info, arg_values, output_region, preview_factor, packager,
+                    state ? state->buffer_pool() : nullptr, &call_status)) {
+      goto fail;
+    }
+    if (call_status != 0) {
+      // halide_error has already been called.
+      return call_status;
+    }
+  }
+
+  if (state) {
+    MakeCallPlanKey(metadata, arg_values, output_region, &plan_key);
+    cached_plan = state->FindCallPlan(plan_key, &new_plan);
+  }
+  if (!cached_plan) {
+    timer.Begin("bounds_query");
+    bounds_query_status =
+        ChooseCallPlan(info, arg_values, output_region, &new_plan);
+    if (bounds_query_status != 0) {
+      // Don't emit our own halide_error or custom error code;
+      // halide_error has already been called, so just return the failure
+      // code as-is.
+      return bounds_query_status;
+    }
+  }
+  plan = &new_plan;
+
+  timer.Begin("prepare_outputs");
+  if (tiled) {
+    bounds_query_status = MakeTilePlan(*plan, arg_values, output_region,
+                                       kOrigin, options.tile_extent,
+                                       &tile_plan);
+    if (bounds_query_status != 0) {
+      // halide_error has already been called.
+      return bounds_query_status;
+    }
+  }
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    if (tiled) {
+      // Storage for a single tile, reused for each of them in turn.
+      arg_values[i].buffer = tile_plan.layouts[i].buffer;
+      continue;
+    }
+    RequestOutputStorage(args[i], plan->layouts[i], &arg_values[i].buffer,
+                         packager);
+  }
+
+  // Size the arena for all the storage the packager didn't supply,
+  // so that it can be allocated as a single block.
+  for (int i = 0; i < num_args; ++i) {
+    const buffer_t& buf = args[i].kind == halide_argument_kind_output_buffer
+                              ? arg_values[i].buffer
+                              : plan->layouts[i].buffer;
+    if ((args[i].kind == halide_argument_kind_input_buffer &&
+         plan->layouts[i].needs_copy) ||
+        (args[i].kind == halide_argument_kind_output_buffer &&
+         !arg_values[i].buffer.host)) {
+      arena_bytes +=
+          AlignedSize(buf.elem_size * MaxElemCount(args[i].dimensions, buf));
+    }
+  }
+  if (!arena.Reserve(arena_bytes)) {
+    goto fail;
+  }
+
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    if (!PrepareOutputBuffer(args[i], &arg_values[i].buffer, &arena)) {
+      goto fail;
+    }
+  }
+
+  timer.Begin("adapt_inputs");
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_input_buffer) continue;
+    if (!AdaptInputBufferLayout(args[i], plan->layouts[i],
+                                &arg_values[i].buffer, &arena)) {
+      goto fail;
+    }
+  }
+
+  // Profile every run; the profiler only keeps running totals, so take
+  // the difference afterwards.
+  profiled = TargetHasFeature(plan->metadata->target, "profile") &&
+             TakeProfilerSnapshot(plan->metadata->name, &profile_before);
+  if (options.work_stealing) work_stealing.Begin();
+  if (options.trace) {
+    trace_scope.reset(new ScopedCallTrace(user_context, &trace));
+  }
+
+  if (tiled) {
+    if (!RunTiled(*plan, output_region, options.tile_extent, &arg_values,
+                  packager, &timer, &time_usec, &num_tiles, &call_status)) {
+      goto fail;
+    }
+    if (call_status != 0) {
+      if (state) state->RemoveCallPlan(plan_key);
+      // halide_error has already been called.
+      return call_status;
+    }
+    samples.push_back(time_usec);
+  } else {
+    for (int i = 0; i < num_args; ++i) {
+      arg_value_ptrs[i] = &arg_values[i];
+    }
+    const int runs = options.warmup_iterations + options.iterations;
+    samples.reserve(options.iterations);
+    // Each thread count reruns the filter on the same (already adapted)
+    // inputs and outputs.
+    for (int32_t threads : thread_counts) {
+      if (threads > 0) thread_count_scope.SetNumThreads(threads);
+      samples.clear();
+      for (int run = 0; run < runs; ++run) {
+        timer.Begin(run < options.warmup_iterations ? "warmup" : "run");
+        const double kTimeStart = GetTimeUsec();
+        call_status = plan->argv_func(&arg_value_ptrs[0]);
+        if (call_status != 0) {
+          // Don't let a plan that failed be reused.
+          if (state) state->RemoveCallPlan(plan_key);
+          // Don't emit our own halide_error or custom error code;
+          // halide_error has already been called, so just return the
+          // failure code as-is.
+          return call_status;
+        }
+        const double kTimeEnd = GetTimeUsec();
+        if (run >= options.warmup_iterations) {
+          samples.push_back(kTimeEnd - kTimeStart);
+        }
+      }
+      if (threads > 0) {
+        ResultStats point;
+        point["threads"] = threads;
+        point["time_usec"] = ComputeTimingStats(samples).at("median");
+        scaling.push_back(point);
+      }
+    }
+  }
+
+  if (options.work_stealing) work_stealing_stats = work_stealing.End();
+  trace_scope.reset();
+  thread_count_scope.Release();
+
+  // Speedup and efficiency are relative to the first thread count
+  // (normally 1).
+  for (ResultStats& point : scaling) {
+    const ResultStats& base = scaling.front();
+    const double speedup =
+        point["time_usec"] > 0.0 ? base.at("time_usec") / point["time_usec"]
+                                 : 0.0;
+    point["speedup"] = speedup;
+    point["efficiency"] = speedup * base.at("threads") / point["threads"];
+  }
+
+  // Only remember plans that worked.
+  if (state && !cached_plan) {
+    state->AddCallPlan(plan_key, new_plan);
+  }
+
+  // Outputs are only packed once, from the final run.
+  timer.Begin("pack");
+  if (options.iterations > 1) {
+    const ResultStats stats = ComputeTimingStats(samples);
+    time_usec = stats.at("median");
+    if (!packager->PackResultStats("time_stats", stats)) {
+      goto fail;
+    }
+  } else {
+    time_usec = samples[0];
+  }
+  if (!packager->PackResultTimeUsec(time_usec)) {
+    goto fail;
+  }
+  if (!packager->PackResultStats("memory", memory.GetStats())) {
+    goto fail;
+  }
+  if (!scaling.empty() && !packager->PackResultStatsList("scaling", scaling)) {
+    goto fail;
+  }
+  if (options.work_stealing &&
+      !packager->PackResultStatsList("work_stealing", work_stealing_stats)) {
+    goto fail;
+  }
+  if (options.trace && !packager->PackResultString("trace", trace.ToJson())) {
+    goto fail;
+  }
+  if (profiled) {
+    TakeProfilerSnapshot(plan->metadata->name, &profile_after);
+    if (!packager->PackResultProfile(
+            ComputeFuncProfiles(profile_before, profile_after))) {
+      goto fail;
+    }
+  }
+  if (!info.variants.empty() &&
+      !packager->PackResultString("variant", plan->variant)) {
+    goto fail;
+  }
+  if (cacheable) {
+    AddCachedResults(metadata, arg_values, time_usec, plan->variant,
+                     cache_key, state->result_cache());
+    if (!packager->PackResultBool("cache_hit", false)) {
+      goto fail;
+    }
+  }
+  if (tiled) {
+    // The outputs have already been packed, tile by tile.
+    ResultStats tiling;
+    tiling["count"] = num_tiles;
+    tiling["width"] = options.tile_extent[0];
+    tiling["height"] = options.tile_extent[1];
+    if (!packager->PackResultStats("tiling", tiling)) {
+      goto fail;
+    }
+  }
+  for (int i = 0; i < num_args && !tiled; ++i) {
+    if (args[i].kind != halide_argument_kind_output_buffer) continue;
+    if (!packager->PackResultValue(args[i], arg_values[i])) {
+      goto fail;
+    }
+  }
+
+  // The phase breakdown is packed last, so it can include the time spent
+  // packing everything else.
+  timer.End();
+  if (!packager->PackResultStats("phase_usec", phases)) {
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  halide_error(user_context, "MakePackagedCall_Failure.");
+  return -6502;
+}
+
+int MakePackagedCallBatch(void* user_context, const HalideFilterInfo& info,
+                          ArgumentPackagerJson* packager,
+                          PackagedCallState* state) {
+  if (!info.metadata || !info.argv_func || !packager) return -6809;
+
+  // Entries share buffers and call plans even if the caller has no
+  // state of its own to offer.
+  PackagedCallState local_state;
+  if (!state) state = &local_state;
+
+  const int batch_size = packager->BatchSize();
+  if (batch_size < 0) {
+    halide_error(user_context, "MakePackagedCallBatch_Failure.");
+    return -6502;
+  }
+
+  const double kTimeStart = GetTimeUsec();
+  for (int i = 0; i < batch_size; ++i) {
+    if (!packager->BeginBatchEntry(i)) {
+      halide_error(user_context, "MakePackagedCallBatch_Failure.");
+      return -6502;
+    }
+    const int status = MakePackagedCall(user_context, info, packager, state);
+    if (status != 0) {
+      // halide_error has already been called.
+      return status;
+    }
+    if (!packager->EndBatchEntry()) {
+      halide_error(user_context, "MakePackagedCallBatch_Failure.");
+      return -6502;
+    }
+  }
+  const double kTimeEnd = GetTimeUsec();
+
+  if (!packager->EndBatch() ||
+      !packager->PackResultTimeUsec(kTimeEnd - kTimeStart)) {
+    halide_error(user_context, "MakePackagedCallBatch_Failure.");
+    return -6502;
+  }
+  return 0;
+}
+
+int UploadInputs(void* user_context, const HalideFilterInfo& info,
+                 ArgumentPackagerJson* packager, PackagedCallState* state) {
+  const halide_filter_metadata_t* metadata = info.metadata;
+  if (!metadata || !info.argv_func || !packager || !state) return -6809;
+
+  // All locals declared at top to allow for "goto fail" error handling.
+  const int num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+  vector<ArgumentPackager::ArgValue> arg_values(num_args);
+  vector<std::shared_ptr<const ResidentInputs::Entry>> resident(num_args);
+  bool unknown_handle = false;
+  const PackagedCallOptions options;
+  buffer_t output_region;
+  CallPlan plan;
+  int bounds_query_status = 0;
+  ResultStats handles;
+
+  if (!UnpackInputs(user_context, metadata, packager, state, &arg_values,
+                    &resident, &unknown_handle)) {
+    goto fail;
+  }
+  // The layout required for a call on the whole of the inputs.
+  ChooseOutputRegion(metadata, arg_values, resident, options,
+                     &output_region);
+  bounds_query_status =
+      ChooseCallPlan(info, arg_values, output_region, &plan);
+  if (bounds_query_status != 0) {
+    // halide_error has already been called.
+    return bounds_query_status;
+  }
+
+  for (int i = 0; i < num_args; ++i) {
+    if (args[i].kind != halide_argument_kind_input_buffer || resident[i]) {
+      continue;
+    }
+    std::shared_ptr<ResidentInputs::Entry> entry(new ResidentInputs::Entry);
+    if (!MakeResidentInput(args[i], plan.layouts[i], arg_values[i].buffer,
+                           entry.get())) {
+      goto fail;
+    }
+    const int32_t handle = state->resident_inputs()->Add(entry);
+    if (handle == 0) goto fail;
+    handles[args[i].name] = handle;
+  }
+  if (!packager->PackResultStats("handles", handles)) {
+    goto fail;
+  }
+  return 0;
+
+fail:
+  halide_error(user_context, "UploadInputs_Failure.");
+  return -6502;
+}
+
+int ReleaseInputs(void* user_context, ArgumentPackagerJson* packager,
+                  PackagedCallState* state) {
+  if (!packager || !state) return -6809;
+  vector<int32_t> handles;
+  if (!packager->UnpackHandles(&handles)) {
+    halide_error(user_context, "ReleaseInputs_Failure.");
+    return -6502;
+  }
+  for (int32_t handle : handles) {
+    state->resident_inputs()->Release(handle);
+  }
+  return 0;
+}
+
+vector<int32_t> ScalingSweepThreadCounts(int max_threads) {
+  vector<int32_t> thread_counts;
+  for (int32_t n = 1; n < max_threads; n *= 2) {
+    thread_counts.push_back(n);
+  }
+  thread_counts.push_back(std::max(1, max_threads));
+  return thread_counts;
+}
+
+uint64_t HashBuffer(const buffer_t& buf, int dimensions) {
+  Xxh64 hash(0);
+  int32_t extent[4] = {1, 1, 1, 1};
+  for (int i = 0; i < dimensions && i < 4; ++i) {
+    extent[i] = buf.extent[i];
+    if (extent[i] <= 0) return hash.Digest();
+  }
+  const int32_t elem_size = buf.elem_size;
+  for (int32_t i3 = 0; i3 < extent[3]; ++i3) {
+    for (int32_t i2 = 0; i2 < extent[2]; ++i2) {
+      for (int32_t i1 = 0; i1 < extent[1]; ++i1) {
+        const uint8_t* row =
+            buf.host + elem_size * (static_cast<ptrdiff_t>(i3) * buf.stride[3] +
+                                    static_cast<ptrdiff_t>(i2) * buf.stride[2] +
+                                    static_cast<ptrdiff_t>(i1) * buf.stride[1]);
+        if (dimensions < 1 || buf.stride[0] == 1) {
+          hash.Update(row, static_cast<size_t>(elem_size) * extent[0]);
+          continue;
+        }
+        for (int32_t i0 = 0; i0 < extent[0]; ++i0) {
+          hash.Update(row + static_cast<ptrdiff_t>(elem_size) * i0 *
+                                buf.stride[0],
+                      elem_size);
+        }
+      }
+    }
+  }
+  return hash.Digest();
+}
+
+bool MetadataToJSON(const halide_filter_metadata_t* metadata, string* json) {
+  if (!metadata || !json) return false;
+
+  std::ostringstream oss;
+  oss << "{"
+      << "\"version\":" << metadata->version << ","
+      << "\"target\":\"" << metadata->target << "\","
+      << "\"name\":\"" << metadata->name << "\","
+      << "\"arguments\":[";
+
+  const size_t num_args = metadata->num_arguments;
+  const halide_filter_argument_t* args = metadata->arguments;
+
+  for (size_t i = 0; i < num_args; ++i) {
+    const halide_filter_argument_t& arg = args[i];
+    if (i > 0) oss << ",";
+    oss << "{"
+        << "\"name\":\"" << arg.name << "\","
+        << "\"kind\":" << static_cast<int>(arg.kind) << ","
+        << "\"type_code\":\"" << kTypeCode[arg.type_code] << "\","
+        << "\"type_bits\":" << arg.type_bits;
+    // JSON doesn't allow trailing commas.
+    bool need_comma = true;
+    if (arg.kind != halide_argument_kind_input_scalar) {
+      if (need_comma) oss << ",";
+      oss << "\"dimensions\":" << arg.dimensions;
+      // unnecessary
+      // need_comma = true;
+    } else {
+      if (arg.def) {
+        if (need_comma) oss << ",";
+        oss << "\"def\":";
+        if (!EmitScalar(&oss, arg.type_code, arg.type_bits, *arg.def))
+          return false;
+        need_comma = true;
+      }
+      if (arg.min) {
+        if (need_comma) oss << ",";
+        oss << "\"min\":";
+        if (!EmitScalar(&oss, arg.type_code, arg.type_bits, *arg.min))
+          return false;
+        need_comma = true;
+      }
+      if (arg.max) {
+        if (need_comma) oss << ",";
+        oss << "\"max\":";
+        if (!EmitScalar(&oss, arg.type_code, arg.type_bits, *arg.max))
+          return false;
+        // unnecessary
+        // need_comma = true;
+      }
+    }
+    oss << "}";
+  }
+  oss << "]}";
+  *json = oss.str();
+  return true;
+}
+
+bool ArgumentPackagerJson::GetMemberAsInt32Array(
+    const unique_ptr<JsonValue>& value, const string& name, const size_t len,
+    int32_t* result) {
+  unique_ptr<JsonValue> a = value->GetMember(name);
+  std::vector<int> v;
+  if (!a->AsInt32Array(&v) || v.size() != len) return false;
+  for (size_t i = 0; i < len; ++i) {
+    result[i] = static_cast<int32_t>(v[i]);
+  }
+  return true;
+}
+
+unique_ptr<ArgumentPackagerJson::JsonValue> ArgumentPackagerJson::GetInput(
+    const string& name, bool* shared) {
+  *shared = false;
+  if (batch_entry_) {
+    unique_ptr<JsonValue> inputs = batch_entry_->GetMember("inputs");
+    if (inputs->IsMap()) {
+      unique_ptr<JsonValue> value = inputs->GetMember(name);
+      if (!value->IsUndefined()) return value;
+    }
+  }
+  *shared = true;
+  unique_ptr<JsonValue> inputs = GetInputMessage()->GetMember("inputs");
+  if (!inputs->IsMap()) return nullptr;
+  return inputs->GetMember(name);
+}
+
+ArgumentPackagerJson::JsonValue* ArgumentPackagerJson::GetCurrentResults()
+    const {
+  if (partial_results_) return partial_results_.get();
+  return batch_entry_results_ ? batch_entry_results_.get() : GetOutputMessage();
+}
+
+bool ArgumentPackagerJson::UnpackArgumentValue(
+    void* user_context, const halide_filter_argument_t& a,
+    ArgValue* arg_value) {
+  if (a.kind == halide_argument_kind_output_buffer) return false;
+
+  const JsonValue* var = GetInputMessage();
+  if (!var->IsMap()) return false;
+
+  bool shared = false;
+  unique_ptr<JsonValue> value = GetInput(a.name, &shared);
+  if (!value) return false;
+
+  if (a.type_code == halide_type_handle) {
+    // user_context is always specified via an explicit arg to the packaged
+    // call, never via the input message, and so should never be present
+    // there: it's an error if we find one.
+    if (!value->IsUndefined()) return false;
+    arg_value->scalar.u.handle = user_context;
+    return true;
+  }
+
+  if (value->IsUndefined()) return false;
+
+  if (a.kind == halide_argument_kind_input_buffer) {
+    // input buffer
+    if (shared) {
+      auto it = unpacked_buffers_.find(a.name);
+      if (it != unpacked_buffers_.end()) {
+        arg_value->buffer = it->second;
+        return true;
+      }
+    }
+    if (!value->IsMap()) return false;
+    if (!value->GetMember("elem_size")->AsInt32(&arg_value->buffer.elem_size) ||
+        !GetMemberAsInt32Array(value, "extent", 4, arg_value->buffer.extent) ||
+        !GetMemberAsInt32Array(value, "stride", 4, arg_value->buffer.stride) ||
+        !GetMemberAsInt32Array(value, "min", 4, arg_value->buffer.min))
+      return false;
+    // As for ArgumentPackagerBinary, the contents must cover every element
+    // (checked below, once we have them), so the geometry must make sense.
+    if (arg_value->buffer.elem_size != (a.type_bits + 7) / 8) return false;
+    for (int j = 0; j < a.dimensions; ++j) {
+      if (arg_value->buffer.extent[j] < 1 || arg_value->buffer.stride[j] < 0) {
+        return false;
+      }
+    }
+    uint64_t bytes = 0;
+    unique_ptr<JsonValue> host = value->GetMember("host");
+    const uint8_t* data = nullptr;
+    size_t len = 0;
+    if (BorrowByteArray(*host, &data, &len)) {
+      if (!CheckedBufferBytes(a.dimensions, arg_value->buffer, len, &bytes)) {
+        return false;
+      }
+      // Halide never writes to input buffers, so casting away const is safe.
+      arg_value->buffer.host = const_cast<uint8_t*>(data);
+    } else {
+      host_storage_.emplace_back(new vector<uint8_t>);
+      vector<uint8_t>* storage = host_storage_.back().get();
+      if (!host->AsByteArray(storage) ||
+          !CheckedBufferBytes(a.dimensions, arg_value->buffer,
+                              storage->size(), &bytes)) {
+        return false;
+      }
+      arg_value->buffer.host = storage->data();
+    }
+    // Both borrowed and copied storage live as long as we do, so the
+    // buffer can be reused by every entry of a batch.
+    if (shared) unpacked_buffers_[a.name] = arg_value->buffer;
+    return true;
+  }
+
+#define TYPE_AND_SIZE(CODE, BITS) (((CODE) << 8) | (BITS))
+
+  if (TYPE_AND_SIZE(a.type_code, a.type_bits) ==
+      TYPE_AND_SIZE(halide_type_uint, 1)) {
+    // bool is modeled as uint(1) in Halide
+    return value->AsBool(&arg_value->scalar.u.b);
+  }
+
+  // JS doesn't really distinguish between numeric types, so we have to
+  // play a bit loose here. Oh well.
+
+  int32_t i;
+  double d;
+  switch (TYPE_AND_SIZE(a.type_code, a.type_bits)) {
+    case TYPE_AND_SIZE(halide_type_float, 32):
+      if (!value->AsDouble(&d)) return false;
+      arg_value->scalar.u.f32 = static_cast<float>(d);
+      return true;
+    case TYPE_AND_SIZE(halide_type_float, 64):
+      if (!value->AsDouble(&d)) return false;
+      arg_value->scalar.u.f64 = static_cast<double>(d);
+      return true;
+    case TYPE_AND_SIZE(halide_type_int, 8):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.i8 = static_cast<int8_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_int, 16):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.i16 = static_cast<int16_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_int, 32):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.i32 = static_cast<int32_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_int, 64):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.i64 = static_cast<int64_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_uint, 8):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.u8 = static_cast<uint8_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_uint, 16):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.u16 = static_cast<uint16_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_uint, 32):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.u32 = static_cast<uint32_t>(i);
+      return true;
+    case TYPE_AND_SIZE(halide_type_uint, 64):
+      if (!value->AsInt32(&i)) return false;
+      arg_value->scalar.u.u64 = static_cast<uint64_t>(i);
+      return true;
+    default:
+      return false;
+  }
+
+#undef TYPE_AND_SIZE
+}
+
+bool ArgumentPackagerJson::PackResultValue(const halide_filter_argument_t& a,
+                                           const ArgValue& arg_value) {
+  if (a.kind != halide_argument_kind_output_buffer) return false;
+  const buffer_t& buf = arg_value.buffer;
+
+  // If the filter wrote directly into a byte array we allocated, return
+  // that as-is; otherwise, copy the result into a new one.
+  // In digests_only mode, return a hash of the contents instead.
+  unique_ptr<JsonValue> host;
+  auto it = output_arrays_.find(a.name);
+  if (digests_only_) {
+    char digest[17];
+    snprintf(digest, sizeof(digest), "%016llx",
+             static_cast<unsigned long long>(HashBuffer(buf, a.dimensions)));
+    host = NewString(digest);
+  } else if (it != output_arrays_.end()) {
+    host = std::move(it->second);
+    output_arrays_.erase(it);
+  } else {
+    host = NewByteArray(buf.host,
+                        buf.elem_size * MaxElemCount(a.dimensions, buf));
+  }
+
+  unique_ptr<JsonValue> d = NewMap();
+  if (!d->SetMember("elem_size", NewInt32(buf.elem_size)) ||
+      !d->SetMember("extent", NewInt32Array(buf.extent, 4)) ||
+      !d->SetMember("stride", NewInt32Array(buf.stride, 4)) ||
+      !d->SetMember("min", NewInt32Array(buf.min, 4)) ||
+      !d->SetMember("dimensions", NewInt32(a.dimensions)) ||
+      !d->SetMember("type_code", NewString(kTypeCode[a.type_code])) ||
+      !d->SetMember(digests_only_ ? "digest" : "host", host)) {
+    return false;
+  }
+
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+
+  unique_ptr<JsonValue> outputs = results->GetMember("outputs");
+  if (!outputs->IsMap()) {
+    outputs = NewMap();
+  }
+  outputs->SetMember(a.name, d);
+  results->SetMember("outputs", outputs);
+
+  return true;
+}
+
+uint8_t* ArgumentPackagerJson::AllocateOutputStorage(
+    const halide_filter_argument_t& a, size_t bytes) {
+  if (a.kind != halide_argument_kind_output_buffer) return nullptr;
+  // Digests are computed from runtime-owned storage, which (unlike a
+  // byte array that we'd hand back) can be reused from call to call.
+  if (digests_only_) return nullptr;
+  uint8_t* data = nullptr;
+  unique_ptr<JsonValue> array = NewMappedByteArray(bytes, &data);
+  if (!array || !data) return nullptr;
+  output_arrays_[a.name] = std::move(array);
+  return data;
+}
+
+bool ArgumentPackagerJson::PackResultTimeUsec(double time_usec) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  if (!results->SetMember("time_usec", NewDouble(time_usec))) return false;
+  return true;
+}
+
+bool ArgumentPackagerJson::PackResultStats(const string& key,
+                                           const ResultStats& stats) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  unique_ptr<JsonValue> d = NewMap();
+  for (const auto& it : stats) {
+    if (!d->SetMember(it.first, NewDouble(it.second))) return false;
+  }
+  return results->SetMember(key, d);
+}
+
+bool ArgumentPackagerJson::PackResultStatsList(
+    const string& key, const vector<ResultStats>& list) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  unique_ptr<JsonValue> a = NewArray();
+  for (const ResultStats& stats : list) {
+    unique_ptr<JsonValue> d = NewMap();
+    for (const auto& it : stats) {
+      if (!d->SetMember(it.first, NewDouble(it.second))) return false;
+    }
+    if (!a->AppendElement(d)) return false;
+  }
+  return results->SetMember(key, a);
+}
+
+bool ArgumentPackagerJson::PackResultProfile(
+    const vector<FuncProfile>& funcs) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  unique_ptr<JsonValue> a = NewArray();
+  for (const FuncProfile& func : funcs) {
+    unique_ptr<JsonValue> d = NewMap();
+    if (!d->SetMember("name", NewString(func.name))) return false;
+    for (const auto& it : func.stats) {
+      if (!d->SetMember(it.first, NewDouble(it.second))) return false;
+    }
+    if (!a->AppendElement(d)) return false;
+  }
+  return results->SetMember("profile", a);
+}
+
+bool ArgumentPackagerJson::PackResultString(const string& key,
+                                            const string& value) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  return results->SetMember(key, NewString(value));
+}
+
+bool ArgumentPackagerJson::PackResultBool(const string& key, bool value) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  return results->SetMember(key, NewBool(value));
+}
+
+bool ArgumentPackagerJson::UnpackCallOptions(PackagedCallOptions* options) {
+  const JsonValue* var = GetInputMessage();
+  if (!var->IsMap()) return false;
+
+  // All options are optional; absent values keep their defaults.
+  unique_ptr<JsonValue> value = var->GetMember("warmup_iterations");
+  if (!value->IsUndefined() && !value->AsInt32(&options->warmup_iterations)) {
+    return false;
+  }
+  value = var->GetMember("iterations");
+  if (!value->IsUndefined() && !value->AsInt32(&options->iterations)) {
+    return false;
+  }
+  value = var->GetMember("tile_extent");
+  if (!value->IsUndefined()) {
+    vector<int32_t> tile_extent;
+    if (!value->AsInt32Array(&tile_extent) || tile_extent.size() != 2) {
+      return false;
+    }
+    options->tile_extent[0] = tile_extent[0];
+    options->tile_extent[1] = tile_extent[1];
+  }
+  value = var->GetMember("thread_counts");
+  if (!value->IsUndefined()) {
+    if (!value->AsInt32Array(&options->thread_counts)) return false;
+  } else if (!thread_counts_.empty()) {
+    options->thread_counts = thread_counts_;
+  }
+  value = var->GetMember("work_stealing");
+  if (!value->IsUndefined() && !value->AsBool(&options->work_stealing)) {
+    return false;
+  }
+  value = var->GetMember("trace");
+  if (!value->IsUndefined() && !value->AsBool(&options->trace)) {
+    return false;
+  }
+  value = var->GetMember("cache");
+  if (!value->IsUndefined() && !value->AsBool(&options->use_cache)) {
+    return false;
+  }
+  value = var->GetMember("progressive");
+  if (!value->IsUndefined() && !value->AsBool(&options->progressive)) {
+    return false;
+  }
+  value = var->GetMember("output_crop");
+  if (!value->IsUndefined()) {
+    if (!value->IsMap() ||
+        !value->GetMember("min")->AsInt32Array(&options->output_min) ||
+        !value->GetMember("extent")->AsInt32Array(&options->output_extent)) {
+      return false;
+    }
+  }
+  value = var->GetMember("digests_only");
+  if (!value->IsUndefined() && !value->AsBool(&digests_only_)) {
+    return false;
+  }
+  return true;
+}
+
+bool ArgumentPackagerJson::BeginResultTile() {
+  if (partial_results_) return false;
+  partial_results_ = NewMap();
+  return true;
+}
+
+bool ArgumentPackagerJson::EndResultTile() {
+  if (!partial_results_) return false;
+  unique_ptr<JsonValue> tile = std::move(partial_results_);
+  return EmitResultTile(tile);
+}
+
+bool ArgumentPackagerJson::EmitResultTile(const unique_ptr<JsonValue>& tile) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  unique_ptr<JsonValue> tiles = results->GetMember("tiles");
+  if (tiles->IsUndefined()) tiles = NewArray();
+  return tiles->AppendElement(tile) && results->SetMember("tiles", tiles);
+}
+
+bool ArgumentPackagerJson::BeginResultPreview() {
+  return BeginResultTile();
+}
+
+bool ArgumentPackagerJson::EndResultPreview() {
+  if (!partial_results_) return false;
+  unique_ptr<JsonValue> preview = std::move(partial_results_);
+  return EmitResultPreview(preview);
+}
+
+bool ArgumentPackagerJson::UnpackInputHandle(const halide_filter_argument_t& a,
+                                             int32_t* handle) {
+  if (a.kind != halide_argument_kind_input_buffer) return false;
+  bool shared = false;
+  unique_ptr<JsonValue> value = GetInput(a.name, &shared);
+  if (!value || !value->IsMap()) return false;
+  unique_ptr<JsonValue> h = value->GetMember("handle");
+  return !h->IsUndefined() && h->AsInt32(handle);
+}
+
+bool ArgumentPackagerJson::UnpackHandles(vector<int32_t>* handles) {
+  const JsonValue* var = GetInputMessage();
+  if (!var->IsMap()) return false;
+  return var->GetMember("handles")->AsInt32Array(handles);
+}
+
+bool ArgumentPackagerJson::EmitResultPreview(
+    const unique_ptr<JsonValue>& preview) {
+  JsonValue* results = GetCurrentResults();
+  if (!results->IsMap()) return false;
+  return results->SetMember("preview", preview);
+}
+
+int ArgumentPackagerJson::BatchSize() const {
+  const JsonValue* var = GetInputMessage();
+  if (!var->IsMap()) return -1;
+  unique_ptr<JsonValue> batch = var->GetMember("batch");
+  if (batch->IsUndefined()) return -1;
+  return static_cast<int>(batch->ArrayLength());
+}
+
+bool ArgumentPackagerJson::BeginBatchEntry(int index) {
+  if (index < 0 || index >= BatchSize()) return false;
+  batch_entry_ = GetInputMessage()->GetMember("batch")->GetElement(index);
+  if (!batch_entry_->IsMap()) {
+    batch_entry_.reset();
+    return false;
+  }
+  batch_entry_results_ = NewMap();
+  if (!batch_results_) batch_results_ = NewArray();
+  return true;
+}
+
+bool ArgumentPackagerJson::EndBatchEntry() {
+  if (!batch_entry_results_) return false;
+  const bool ok = batch_results_->AppendElement(batch_entry_results_);
+  batch_entry_.reset();
+  batch_entry_results_.reset();
+  return ok;
+}
+
+bool ArgumentPackagerJson::EndBatch() {
+  if (batch_entry_results_) return false;
+  if (!batch_results_) batch_results_ = NewArray();
+  JsonValue* results = GetOutputMessage();
+  if (!results->IsMap() || !results->SetMember("batch", batch_results_)) {
+    return false;
+  }
+  batch_results_.reset();
+  return true;
+}
+
+ArgumentPackagerBinary::ArgumentPackagerBinary(
+    const halide_filter_metadata_t* metadata, const uint8_t* message,
+    size_t size)
+    : metadata_(metadata),
+      message_(message),
+      size_(size),
+      header_(nullptr),
+      allocated_(metadata ? metadata->num_arguments : 0, nullptr) {
+  if (!metadata || !message || size < sizeof(BinaryHeader)) return;
+  // The header and descriptors are read in place.
+  if (reinterpret_cast<uintptr_t>(message) % alignof(BinaryArgument) != 0) {
+    return;
+  }
+  const BinaryHeader* header = reinterpret_cast<const BinaryHeader*>(message);
+  if (header->magic != kBinaryMagic || header->version != kBinaryVersion ||
+      header->num_arguments !=
+          static_cast<uint32_t>(metadata->num_arguments) ||
+      (size - sizeof(BinaryHeader)) / sizeof(BinaryArgument) <
+          header->num_arguments) {
+    return;
+  }
+  header_ = header;
+}
+
+int ArgumentPackagerBinary::ArgumentIndex(
+    const halide_filter_argument_t& a) const {
+  // Arguments normally come straight from the metadata, so the index is
+  // just a's position there; otherwise, look it up by name.
+  const halide_filter_argument_t* args = metadata_->arguments;
+  const int n = metadata_->num_arguments;
+  const uintptr_t p = reinterpret_cast<uintptr_t>(&a);
+  if (p >= reinterpret_cast<uintptr_t>(args) &&
+      p < reinterpret_cast<uintptr_t>(args + n)) {
+    return static_cast<int>(&a - args);
+  }
+  for (int i = 0; i < n; ++i) {
+    if (!strcmp(args[i].name, a.name)) return i;
+  }
+  return -1;
+}
+
+bool ArgumentPackagerBinary::UnpackArgumentValue(
+    void* user_context, const halide_filter_argument_t& a,
+    ArgValue* arg_value) {
+  if (!header_ || a.kind == halide_argument_kind_output_buffer) return false;
+  const int i = ArgumentIndex(a);
+  if (i < 0) return false;
+  const BinaryArgument& d = reinterpret_cast<const BinaryArgument*>(
+      message_ + sizeof(BinaryHeader))[i];
+  if (d.kind != a.kind || d.type_code != a.type_code ||
+      d.type_bits != a.type_bits) {
+    return false;
+  }
+
+  if (a.type_code == halide_type_handle) {
+    // As for ArgumentPackagerJson, user_context is never taken from the
+    // message.
+    arg_value->scalar.u.handle = user_context;
+    return true;
+  }
+
+  if (a.kind == halide_argument_kind_input_buffer) {
+    buffer_t& buf = arg_value->buffer;
+    if (d.dimensions != a.dimensions || d.elem_size != (a.type_bits + 7) / 8) {
+      return false;
+    }
+    buf.elem_size = d.elem_size;
+    for (int j = 0; j < 4; ++j) {
+      buf.extent[j] = d.extent[j];
+      buf.stride[j] = d.stride[j];
+      buf.min[j] = d.min[j];
+      if (j < a.dimensions && (buf.extent[j] < 1 || buf.stride[j] < 0)) {
+        return false;
+      }
+    }
+    // The contents must lie within the message, suitably aligned, and
+    // cover every element.
+    uint64_t bytes = 0;
+    if (!CheckedBufferBytes(a.dimensions, buf, size_, &bytes) ||
+        d.host_offset > size_ || d.host_size > size_ - d.host_offset ||
+        d.host_size < bytes || d.host_offset % buf.elem_size != 0) {
+      return false;
+    }
+    // Halide never writes to input buffers, so casting away const is safe.
+    buf.host = const_cast<uint8_t*>(message_ + d.host_offset);
+    return true;
+  }
+
+  // Scalars are already in the argument's own type.
+  arg_value->scalar = d.scalar;
+  return true;
+}
+
+uint8_t* ArgumentPackagerBinary::AllocateOutputStorage(
+    const halide_filter_argument_t& a, size_t bytes) {
+  const int i = ArgumentIndex(a);
+  if (i < 0) return nullptr;
+  uint8_t* storage = new (std::nothrow) uint8_t[bytes + kBufferAlignment - 1];
+  if (!storage) return nullptr;
+  output_storage_.emplace_back(storage);
+  allocated_[i] = reinterpret_cast<uint8_t*>(
+      (reinterpret_cast<uintptr_t>(storage) + kBufferAlignment - 1) &
+      ~(kBufferAlignment - 1));
+  return allocated_[i];
+}
+
+bool ArgumentPackagerBinary::PackResultValue(const halide_filter_argument_t& a,
+                                             const ArgValue& arg_value) {
+  if (a.kind != halide_argument_kind_output_buffer) return false;
+  const int i = ArgumentIndex(a);
+  if (i < 0) return false;
+  const buffer_t& buf = arg_value.buffer;
+
+  Output output;
+  memset(&output.descriptor, 0, sizeof(output.descriptor));
+  BinaryArgument& d = output.descriptor;
+  d.kind = a.kind;
+  d.type_code = a.type_code;
+  d.type_bits = a.type_bits;
+  d.dimensions = a.dimensions;
+  d.elem_size = buf.elem_size;
+  for (int j = 0; j < 4; ++j) {
+    d.extent[j] = buf.extent[j];
+    d.stride[j] = buf.stride[j];
+    d.min[j] = buf.min[j];
+  }
+  d.host_size = uint64_t(buf.elem_size) * MaxElemCount(a.dimensions, buf);
+
+  // If the filter wrote directly into storage we allocated, keep it until
+  // the results are encoded; otherwise, the storage won't outlive the call,
+  // so take a copy.
+  if (buf.host == allocated_[i]) {
+    output.host = buf.host;
+  } else {
+    uint8_t* copy = AllocateOutputStorage(a, d.host_size);
+    if (!copy) return false;
+    memcpy(copy, buf.host, d.host_size);
+    output.host = copy;
+  }
+  outputs_.push_back(output);
+  return true;
+}
+
+bool ArgumentPackagerBinary::PackResultTimeUsec(double time_usec) {
+  std::ostringstream oss;
+  oss.precision(15);
+  EmitJsonNumber(&oss, time_usec);
+  results_["time_usec"] = oss.str();
+  return true;
+}
+
+bool ArgumentPackagerBinary::PackResultStats(const string& key,
+                                             const ResultStats& stats) {
+  std::ostringstream oss;
+  oss.precision(15);
+  oss << '{';
+  EmitJsonStats(&oss, stats, "");
+  oss << '}';
+  results_[key] = oss.str();
+  return true;
+}
+
+bool ArgumentPackagerBinary::PackResultStatsList(
+    const string& key, const vector<ResultStats>& list) {
+  std::ostringstream oss;
+  oss.precision(15);
+  oss << '[';
+  for (size_t i = 0; i < list.size(); ++i) {
+    oss << (i ? ",{" : "{");
+    EmitJsonStats(&oss, list[i], "");
+    oss << '}';
+  }
+  oss << ']';
+  results_[key] = oss.str();
+  return true;
+}
+
+bool ArgumentPackagerBinary::PackResultProfile(
+    const vector<FuncProfile>& funcs) {
+  std::ostringstream oss;
+  oss.precision(15);
+  oss << '[';
+  for (size_t i = 0; i < funcs.size(); ++i) {
+    oss << (i ? ",{" : "{") << "\"name\":";
+    EmitJsonString(&oss, funcs[i].name);
+    EmitJsonStats(&oss, funcs[i].stats, ",");
+    oss << '}';
+  }
+  oss << ']';
+  results_["profile"] = oss.str();
+  return true;
+}
+
+bool ArgumentPackagerBinary::PackResultString(const string& key,
+                                              const string& value) {
+  std::ostringstream oss;
+  EmitJsonString(&oss, value);
+  results_[key] = oss.str();
+  return true;
+}
+
+bool ArgumentPackagerBinary::PackResultBool(const string& key, bool value) {
+  results_[key] = value ? "true" : "false";
+  return true;
+}
+
+bool ArgumentPackagerBinary::UnpackCallOptions(PackagedCallOptions* options) {
+  if (!header_) return false;
+  if (header_->flags & ~(kBinaryWorkStealing | kBinaryTrace | kBinaryNoCache)) {
+    return false;
+  }
+  options->warmup_iterations = header_->warmup_iterations;
+  options->iterations = header_->iterations;
+  options->work_stealing = (header_->flags & kBinaryWorkStealing) != 0;
+  options->trace = (header_->flags & kBinaryTrace) != 0;
+  options->use_cache = (header_->flags & kBinaryNoCache) == 0;
+  return true;
+}
+
+namespace {
+
+uint64_t AlignBinaryOffset(uint64_t offset) {
+  return (offset + kBinaryAlignment - 1) & ~uint64_t(kBinaryAlignment - 1);
+}
+
+}  // namespace
+
+string ArgumentPackagerBinary::ResultsJson() const {
+  std::ostringstream oss;
+  oss << '{';
+  const char* separator = "";
+  for (const auto& it : results_) {
+    oss << separator;
+    EmitJsonString(&oss, it.first);
+    oss << ':' << it.second;
+    separator = ",";
+  }
+  oss << '}';
+  return oss.str();
+}
+
+vector<uint64_t> ArgumentPackagerBinary::ResultsLayout(
+    uint64_t* results_offset) const {
+  vector<uint64_t> offsets;
+  uint64_t offset =
+      sizeof(BinaryHeader) + outputs_.size() * sizeof(BinaryArgument);
+  for (const Output& output : outputs_) {
+    offset = AlignBinaryOffset(offset);
+    offsets.push_back(offset);
+    offset += output.descriptor.host_size;
+  }
+  *results_offset = offset;
+  return offsets;
+}
+
+size_t ArgumentPackagerBinary::ResultsSize() const {
+  uint64_t results_offset;
+  ResultsLayout(&results_offset);
+  return static_cast<size_t>(results_offset + ResultsJson().size());
+}
+
+void ArgumentPackagerBinary::EncodeResults(uint8_t* data) const {
+  uint64_t results_offset;
+  const vector<uint64_t> offsets = ResultsLayout(&results_offset);
+  const string json = ResultsJson();
+
+  BinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kBinaryMagic;
+  header.version = kBinaryVersion;
+  header.num_arguments = static_cast<uint32_t>(outputs_.size());
+  header.results_offset = results_offset;
+  header.results_size = json.size();
+  memcpy(data, &header, sizeof(header));
+
+  // Zero the padding before the contents of each output, so that the
+  // message doesn't leak whatever the storage held before.
+  uint64_t end =
+      sizeof(BinaryHeader) + outputs_.size() * sizeof(BinaryArgument);
+  for (size_t i = 0; i < outputs_.size(); ++i) {
+    BinaryArgument d = outputs_[i].descriptor;
+    d.host_offset = offsets[i];
+    memcpy(data + sizeof(BinaryHeader) + i * sizeof(BinaryArgument), &d,
+           sizeof(d));
+    memset(data + end, 0, offsets[i] - end);
+    memcpy(data + offsets[i], outputs_[i].host, d.host_size);
+    end = offsets[i] + d.host_size;
+  }
+  memcpy(data + results_offset, json.data(), json.size());
+}
+
+std::shared_ptr<const ResultCache::Entry> ResultCache::Find(const Key& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) return nullptr;
+  // Move the entry to the front of the list.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+void ResultCache::Add(const Key& key, std::shared_ptr<const Entry> entry) {
+  if (entry->bytes > max_bytes_) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    bytes_ -= it->second->second->bytes;
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+  bytes_ += entry->bytes;
+  entries_.emplace_front(key, std::move(entry));
+  index_[key] = entries_.begin();
+  while (bytes_ > max_bytes_) {
+    bytes_ -= entries_.back().second->bytes;
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+int32_t ResidentInputs::Add(std::shared_ptr<const Entry> entry) {
+  if (entry->bytes > max_bytes_) return 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int32_t handle = next_handle_++;
+  bytes_ += entry->bytes;
+  entries_.emplace_front(handle, std::move(entry));
+  index_[handle] = entries_.begin();
+  while (bytes_ > max_bytes_) {
+    bytes_ -= entries_.back().second->bytes;
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+  return handle;
+}
+
+std::shared_ptr<const ResidentInputs::Entry> ResidentInputs::Find(
+    int32_t handle) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(handle);
+  if (it == index_.end()) return nullptr;
+  // Move the entry to the front of the list.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+bool ResidentInputs::Release(int32_t handle) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(handle);
+  if (it == index_.end()) return false;
+  bytes_ -= it->second->second->bytes;
+  entries_.erase(it->second);
+  index_.erase(it);
+  return true;
+}
+
+uint64_t CoalescingSequencer::Receive(const string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const uint64_t sequence = next_sequence_++;
+  latest_[key] = sequence;
+  return sequence;
+}
+
+bool CoalescingSequencer::IsSuperseded(const string& key,
+                                       uint64_t sequence) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = latest_.find(key);
+  return it != latest_.end() && it->second > sequence;
+}
+
+bool CoalescingSequencer::RespondUnlessSuperseded(
+    const string& key, uint64_t sequence,
+    const std::function<void()>& respond) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = latest_.find(key);
+  if (it != latest_.end() && it->second > sequence) return false;
+  respond();
+  return true;
+}
+
+bool BufferPool::Acquire(size_t bytes, Block* block) {
+  const size_t size = BufferPoolBucketSize(bytes);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+    if (it->size == size) {
+      *block = std::move(*it);
+      bytes_ -= size;
+      idle_.erase(it);
+      return true;
+    }
+  }
+  lock.unlock();
+  block->data.reset(new (std::nothrow) uint8_t[size]);
+  block->size = block->data ? size : 0;
+  return block->data != nullptr;
+}
+
+void BufferPool::Release(Block block) {
+  if (!block.data || block.size > max_bytes_) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  bytes_ += block.size;
+  idle_.push_front(std::move(block));
+  while (bytes_ > max_bytes_) {
+    bytes_ -= idle_.back().size;
+    idle_.pop_back();
+  }
+}
+
+namespace {
+
+// The MemoryStats of the live ScopedMemoryStats for each user_context,
+// innermost last. (Scopes for the same user_context, e.g. concurrent calls
+// with a null one, needn't end in the order they began.) Access is
+// controlled by gMemoryStatsMutex.
+std::map<void*, vector<MemoryStats*>> gMemoryStats;
+std::mutex gMemoryStatsMutex;
+
+// The number of live ScopedMemoryStats, so that untracked allocations
+// needn't take gMemoryStatsMutex.
+std::atomic<int> gMemoryStatsScopes(0);
+
+MemoryStats* FindMemoryStats(void* user_context) {
+  if (gMemoryStatsScopes.load(std::memory_order_acquire) == 0) return nullptr;
+  std::lock_guard<std::mutex> lock(gMemoryStatsMutex);
+  auto it = gMemoryStats.find(user_context);
+  return it != gMemoryStats.end() ? it->second.back() : nullptr;
+}
+
+// Precedes each block returned by TrackedMalloc().
+struct TrackedBlockHeader {
+  void* base;
+  size_t bytes;
+};
+
+}  // namespace
+
+void MemoryStats::Allocated(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  current_bytes_ += bytes;
+  peak_bytes_ = std::max(peak_bytes_, current_bytes_);
+  allocs_ += 1;
+  largest_alloc_ = std::max(largest_alloc_, bytes);
+}
+
+void MemoryStats::Freed(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  current_bytes_ -= std::min(bytes, current_bytes_);
+}
+
+ResultStats MemoryStats::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ResultStats stats;
+  stats["current_bytes"] = current_bytes_;
+  stats["peak_bytes"] = peak_bytes_;
+  stats["allocs"] = allocs_;
+  stats["largest_alloc_bytes"] = largest_alloc_;
+  return stats;
+}
+
+ScopedMemoryStats::ScopedMemoryStats(void* user_context, MemoryStats* stats)
+    : user_context_(user_context), stats_(stats) {
+  std::lock_guard<std::mutex> lock(gMemoryStatsMutex);
+  gMemoryStats[user_context_].push_back(stats_);
+  gMemoryStatsScopes.fetch_add(1, std::memory_order_release);
+}
+
+ScopedMemoryStats::~ScopedMemoryStats() {
+  std::lock_guard<std::mutex> lock(gMemoryStatsMutex);
+  vector<MemoryStats*>& scopes = gMemoryStats[user_context_];
+  // Remove the innermost entry for our stats, wherever it now lies.
+  auto it = std::find(scopes.rbegin(), scopes.rend(), stats_);
+  if (it != scopes.rend()) scopes.erase(std::next(it).base());
+  if (scopes.empty()) gMemoryStats.erase(user_context_);
+  gMemoryStatsScopes.fetch_sub(1, std::memory_order_release);
+}
+
+void* TrackedMalloc(void* user_context, size_t bytes) {
+  const size_t kHeaderSize = sizeof(TrackedBlockHeader);
+  uint8_t* base = static_cast<uint8_t*>(
+      malloc(bytes + kHeaderSize + kBufferAlignment - 1));
+  if (!base) return nullptr;
+  const uintptr_t aligned =
+      (reinterpret_cast<uintptr_t>(base) + kHeaderSize + kBufferAlignment -
+       1) & ~(kBufferAlignment - 1);
+  TrackedBlockHeader* header =
+      reinterpret_cast<TrackedBlockHeader*>(aligned) - 1;
+  header->base = base;
+  header->bytes = bytes;
+  MemoryStats* stats = FindMemoryStats(user_context);
+  if (stats) stats->Allocated(bytes);
+  return reinterpret_cast<void*>(aligned);
+}
+
+void TrackedFree(void* user_context, void* ptr) {
+  if (!ptr) return;
+  TrackedBlockHeader* header = static_cast<TrackedBlockHeader*>(ptr) - 1;
+  MemoryStats* stats = FindMemoryStats(user_context);
+  if (stats) stats->Freed(header->bytes);
+  free(header->base);
+}
+
+namespace {
+
+// The CallTraces of the live ScopedCallTraces for each user_context,
+// innermost last (as for gMemoryStats). Access is controlled by
+// gCallTracesMutex.
+std::map<void*, vector<CallTrace*>> gCallTraces;
+std::mutex gCallTracesMutex;
+
+// The number of live ScopedCallTraces, so that untraced calls needn't take
+// gCallTracesMutex for every task.
+std::atomic<int> gCallTraceScopes(0);
+
+CallTrace* FindCallTrace(void* user_context) {
+  if (gCallTraceScopes.load(std::memory_order_acquire) == 0) return nullptr;
+  std::lock_guard<std::mutex> lock(gCallTracesMutex);
+  auto it = gCallTraces.find(user_context);
+  return it != gCallTraces.end() ? it->second.back() : nullptr;
+}
+
+}  // namespace
+
+CallTrace::CallTrace() : start_usec_(GetTimeUsec()) {}
+
+int32_t CallTrace::Begin(const char* name, const char* category, int index) {
+  const double now = GetTimeUsec();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (spans_.size() >= kMaxSpans) return -1;
+  // Insert the thread, if it's new, with the next number.
+  const int thread =
+      threads_.insert(std::make_pair(std::this_thread::get_id(),
+                                     static_cast<int>(threads_.size())))
+          .first->second;
+  spans_.push_back(
+      Span{name ? name : "", category, index, thread, now - start_usec_, -1.0});
+  return static_cast<int32_t>(spans_.size() - 1);
+}
+
+void CallTrace::End(int32_t id) {
+  const double now = GetTimeUsec();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id < 0 || static_cast<size_t>(id) >= spans_.size()) return;
+  spans_[id].end_usec = now - start_usec_;
+}
+
+string CallTrace::ToJson() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream oss;
+  oss.precision(15);
+  oss << "{\"traceEvents\":[";
+  const char* separator = "";
+  for (const Span& span : spans_) {
+    if (span.end_usec < 0.0) continue;
+    // Complete ("X") events carry both their start and duration.
+    oss << separator << "{\"name\":";
+    EmitJsonString(&oss, span.name);
+    oss << ",\"cat\":\"" << span.category << "\",\"ph\":\"X\""
+        << ",\"ts\":" << span.begin_usec
+        << ",\"dur\":" << span.end_usec - span.begin_usec
+        << ",\"pid\":1,\"tid\":" << span.thread;
+    if (span.index >= 0) {
+      oss << ",\"args\":{\"index\":" << span.index << "}";
+    }
+    oss << "}";
+    separator = ",";
+  }
+  oss << "],\"displayTimeUnit\":\"ms\"}";
+  return oss.str();
+}
+
+ScopedCallTrace::ScopedCallTrace(void* user_context, CallTrace* trace)
+    : user_context_(user_context), trace_(trace) {
+  std::lock_guard<std::mutex> lock(gCallTracesMutex);
+  gCallTraces[user_context_].push_back(trace_);
+  gCallTraceScopes.fetch_add(1, std::memory_order_release);
+}
+
+ScopedCallTrace::~ScopedCallTrace() {
+  std::lock_guard<std::mutex> lock(gCallTracesMutex);
+  vector<CallTrace*>& scopes = gCallTraces[user_context_];
+  auto it = std::find(scopes.rbegin(), scopes.rend(), trace_);
+  if (it != scopes.rend()) scopes.erase(std::next(it).base());
+  if (scopes.empty()) gCallTraces.erase(user_context_);
+  gCallTraceScopes.fetch_sub(1, std::memory_order_release);
+}
+
+int32_t TracingTrace(void* user_context, const halide_trace_event* event) {
+  CallTrace* trace = FindCallTrace(user_context);
+  if (!trace) return 0;
+  // Halide matches each end event to its begin event by passing the id
+  // returned for the latter as the parent_id of the former.
+  switch (event->event) {
+    case halide_trace_begin_pipeline:
+      return trace->Begin(event->func, "pipeline", -1);
+    case halide_trace_begin_realization:
+      return trace->Begin(event->func, "realization", -1);
+    case halide_trace_end_realization:
+    case halide_trace_end_pipeline:
+      trace->End(event->parent_id);
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+int TracingDoTask(void* user_context, halide_task_t f, int idx,
+                  uint8_t* closure) {
+  CallTrace* trace = FindCallTrace(user_context);
+  if (!trace) return halide_default_do_task(user_context, f, idx, closure);
+  const int32_t id = trace->Begin("task", "task", idx);
+  const int result = halide_default_do_task(user_context, f, idx, closure);
+  trace->End(id);
+  return result;
+}
+
+bool PackagedCallState::FindCallPlan(const CallPlanKey& key,
+                                     CallPlan* plan) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = call_plans_.find(key);
+  if (it == call_plans_.end()) return false;
+  *plan = it->second;
+  return true;
+}
+
+void PackagedCallState::AddCallPlan(const CallPlanKey& key,
+                                    const CallPlan& plan) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (call_plans_.size() >= kMaxCallPlans) {
+    call_plans_.clear();
+  }
+  call_plans_[key] = plan;
+}
+
+void PackagedCallState::RemoveCallPlan(const CallPlanKey& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  call_plans_.erase(key);
 }
 
 bool BuildHalideFilterInfoMap(HalideFilterInfoMap* m) {
@@ -607,6 +3494,7 @@ bool BuildHalideFilterInfoMap(HalideFilterInfoMap* m) {
     m->clear();
     return false;
   }
+  GroupLayoutVariants(m);
   return true;
 }
 
@@ -19,9 +19,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "HalideRuntime.h"
@@ -54,8 +58,93 @@ namespace packaged_call_runtime {
 // an in-out parameter.)
 bool Copy(const buffer_t* src, buffer_t* dst);
 
+// Shrink the contents of one buffer_t into another by an integer factor in
+// dimensions 0 and 1, averaging each factor x factor block of the source
+// (so pixel (x, y) of dst covers pixels [x * factor, (x + 1) * factor) of
+// src, with the edges of src repeated as needed). The elements of both are
+// of the given Halide type, and dst->host must already point to storage for
+// the result. Only uint8, uint16 and float32 elements can be downsampled;
+// returns false for other types, or on failure.
+bool Downsample(int type_code, int type_bits, const buffer_t* src,
+                int32_t factor, buffer_t* dst);
+
 typedef int (*ArgvFunc)(void** args);
 
+// The most pixels (in dimensions 0 and 1) of any input of the preview of a
+// progressive call (see PackagedCallOptions::progressive); inputs are
+// shrunk by a power of two, up to kMaxPreviewFactor, to fit.
+const int64_t kMaxPreviewPixels = 1 << 16;
+const int32_t kMaxPreviewFactor = 64;
+
+// Options that control how MakePackagedCall() runs the filter; these are
+// unpacked from the call message via ArgumentPackager::UnpackCallOptions().
+struct PackagedCallOptions {
+  // Number of untimed runs of the filter before timing begins
+  // (e.g. to spin up the thread pool and fault in memory).
+  int warmup_iterations;
+  // Number of timed runs of the filter. If more than one, time_usec
+  // is the median, and statistics for all runs are returned as well.
+  int iterations;
+  // If non-empty, the filter is run (warmup_iterations + iterations times)
+  // at each of these thread counts in turn, via halide_set_num_threads(),
+  // and the time taken at each is returned as "scaling"; the outputs and
+  // time_usec are those of the last. The sweep runs while no other call
+  // is running the filter, and the thread count is restored afterwards.
+  // If empty, the thread count is left alone.
+  std::vector<int32_t> thread_counts;
+  // If nonzero, the outputs are computed in tiles of at most this size
+  // (in dimensions 0 and 1), each of which is packed as soon as it's done
+  // (see ArgumentPackager::BeginResultTile()), so that only one tile of
+  // each output need be held at once. Tiled calls are run exactly once.
+  int32_t tile_extent[2];
+  // If true, the filter's parallel loops are run on Safelight's
+  // work-stealing thread pool (see WorkStealingDoParFor()), rather than
+  // Halide's, and the pool's statistics for the call are returned as
+  // "work_stealing". The pool's size is fixed, so this can't be combined
+  // with thread_counts.
+  bool work_stealing;
+  // If true, a timeline of every run of the filter is recorded (see
+  // CallTrace), and returned as "trace", a string of Chrome trace-event
+  // JSON.
+  bool trace;
+  // If true, and the call is made with a PackagedCallState, a call that
+  // runs the filter just once (i.e., one that doesn't benchmark, sweep,
+  // tile, trace or use work_stealing) may return outputs cached from an
+  // earlier call with identical inputs (see ResultCache), rather than
+  // running the filter; if so, "cache_hit" is returned as true.
+  bool use_cache;
+  // If non-empty, only this region of the outputs is computed (rather
+  // than a region the size of the first input buffer, or 100x100x4 if
+  // there is none), so that the filter reads only the region of each input
+  // it needs for it. Both must have the same length (at most 4); further
+  // dimensions keep their default min (0) and extent.
+  std::vector<int32_t> output_min;
+  std::vector<int32_t> output_extent;
+  // If true, and the inputs are large, the filter is first run on copies
+  // of its inputs shrunk (see Downsample()) to at most kMaxPreviewPixels,
+  // and those outputs are packed as a preview (see
+  // ArgumentPackager::BeginResultPreview()) before the filter is run on
+  // the inputs as given. Can't be combined with tile_extent.
+  bool progressive;
+
+  PackagedCallOptions()
+      : warmup_iterations(0), iterations(1), work_stealing(false),
+        trace(false), use_cache(true), progressive(false) {
+    tile_extent[0] = tile_extent[1] = 0;
+  }
+};
+
+// A set of named numeric results (e.g. timing statistics) to be
+// returned alongside the outputs of a call.
+typedef std::map<std::string, double> ResultStats;
+
+// The Halide profiler's statistics for one Func of a filter built with the
+// "profile" target feature, averaged over the runs of a call.
+struct FuncProfile {
+  std::string name;
+  ResultStats stats;
+};
+
 // An ArgumentPackager is the platform-specific bit of PackagedCall runtime
 // that knows how to encode/decode arguments between a Package (which
 // can vary by environment, transport mechanism, etc) and the underlying
@@ -93,13 +182,65 @@ class ArgumentPackager {
   virtual bool PackResultValue(const halide_filter_argument_t& a,
                                const ArgValue& arg_value) = 0;
 
+  // Return at least the given number of bytes of storage for the output
+  // buffer a, valid for the lifetime of the packager. The filter will
+  // write its result directly into this storage, so that PackResultValue()
+  // can return it without a copy. Return null to have the runtime supply
+  // the storage instead.
+  virtual uint8_t* AllocateOutputStorage(const halide_filter_argument_t& a,
+                                         size_t bytes) {
+    return nullptr;
+  }
+
   virtual bool PackResultTimeUsec(double time_usec) = 0;
+
+  virtual bool PackResultStats(const std::string& key,
+                               const ResultStats& stats) = 0;
+
+  virtual bool PackResultStatsList(const std::string& key,
+                                   const std::vector<ResultStats>& list) = 0;
+
+  virtual bool PackResultProfile(const std::vector<FuncProfile>& funcs) = 0;
+
+  virtual bool PackResultString(const std::string& key,
+                                const std::string& value) = 0;
+
+  virtual bool PackResultBool(const std::string& key, bool value) = 0;
+
+  // In a tiled call, the outputs for each tile are packed (via
+  // PackResultValue()) between BeginResultTile() and EndResultTile(),
+  // which should send or save them, rather than accumulating them with
+  // the rest of the results. Packagers that can't do this return false,
+  // which fails the call.
+  virtual bool BeginResultTile() { return false; }
+  virtual bool EndResultTile() { return false; }
+
+  // If the input a is given as the handle of a resident input (see
+  // UploadInputs()), rather than as a buffer, set *handle and return true;
+  // otherwise return false, and a is unpacked via UnpackArgumentValue().
+  virtual bool UnpackInputHandle(const halide_filter_argument_t& a,
+                                 int32_t* handle) {
+    return false;
+  }
+
+  // Likewise, in a progressive call, the preview's outputs, time_usec and
+  // "preview" stats are packed between BeginResultPreview() and
+  // EndResultPreview(), which should send them on ahead of the rest of
+  // the results.
+  virtual bool BeginResultPreview() { return false; }
+  virtual bool EndResultPreview() { return false; }
+
+  // Fill in any options present in the call message; options that
+  // aren't present should be left unchanged.
+  virtual bool UnpackCallOptions(PackagedCallOptions* options) = 0;
 };
 
 // Package* is a JSON-like type; it may be implemented on top
 // of (e.g.) Pepper or jsoncpp
 class ArgumentPackagerJson : public ArgumentPackager {
  public:
+  ArgumentPackagerJson() : digests_only_(false) {}
+
   bool UnpackArgumentValue(void* user_context,
                            const halide_filter_argument_t& a,
                            ArgValue* arg_value) override;
@@ -107,8 +248,54 @@ class ArgumentPackagerJson : public ArgumentPackager {
   bool PackResultValue(const halide_filter_argument_t& a,
                        const ArgValue& arg_value) override;
 
+  uint8_t* AllocateOutputStorage(const halide_filter_argument_t& a,
+                                 size_t bytes) override;
+
   bool PackResultTimeUsec(double time_usec) override;
 
+  bool PackResultStats(const std::string& key,
+                       const ResultStats& stats) override;
+  bool PackResultStatsList(const std::string& key,
+                           const std::vector<ResultStats>& list) override;
+
+  bool PackResultProfile(const std::vector<FuncProfile>& funcs) override;
+
+  bool PackResultString(const std::string& key,
+                        const std::string& value) override;
+  bool PackResultBool(const std::string& key, bool value) override;
+  bool BeginResultTile() override;
+  bool EndResultTile() override;
+  bool BeginResultPreview() override;
+  bool EndResultPreview() override;
+  // An input may be given as { "handle": <handle> }.
+  bool UnpackInputHandle(const halide_filter_argument_t& a,
+                         int32_t* handle) override;
+
+  // Fill in the "handles" array of the input message (see ReleaseInputs()).
+  bool UnpackHandles(std::vector<int32_t>* handles);
+
+  bool UnpackCallOptions(PackagedCallOptions* options) override;
+
+  // Thread counts to sweep (see PackagedCallOptions::thread_counts) if the
+  // input message doesn't specify "thread_counts" itself.
+  void set_thread_counts(const std::vector<int32_t>& thread_counts) {
+    thread_counts_ = thread_counts;
+  }
+
+  // Support for MakePackagedCallBatch(). The input message may contain a
+  // "batch" array of entries, each of which is run as a separate call;
+  // inputs present in an entry's "inputs" override those of the message.
+  // The results of each entry are collected into a "batch" array in the
+  // output message.
+
+  // Return the number of entries in the batch, or -1 if there is none.
+  int BatchSize() const;
+  // Direct subsequent Unpack/Pack calls to the given entry of the batch.
+  bool BeginBatchEntry(int index);
+  bool EndBatchEntry();
+  // Pack the results of all the entries.
+  bool EndBatch();
+
  protected:
   class JsonValue {
    public:
@@ -124,15 +311,22 @@ class ArgumentPackagerJson : public ArgumentPackager {
         const std::string& key) const = 0;
     virtual bool SetMember(const std::string& key,
                            const std::unique_ptr<JsonValue>& value) = 0;
+    // Return the length of an array of arbitrary values (0 if this isn't
+    // an array).
+    virtual size_t ArrayLength() const = 0;
+    virtual std::unique_ptr<JsonValue> GetElement(size_t i) const = 0;
+    virtual bool AppendElement(const std::unique_ptr<JsonValue>& value) = 0;
   };
 
   virtual std::unique_ptr<JsonValue> NewMap() const = 0;
+  virtual std::unique_ptr<JsonValue> NewArray() const = 0;
   virtual std::unique_ptr<JsonValue> NewInt32Array(const int32_t* data,
                                                    size_t len) const = 0;
   virtual std::unique_ptr<JsonValue> NewByteArray(const uint8_t* data,
                                                   size_t len) const = 0;
   virtual std::unique_ptr<JsonValue> NewInt32(int32_t i) const = 0;
   virtual std::unique_ptr<JsonValue> NewDouble(double d) const = 0;
+  virtual std::unique_ptr<JsonValue> NewBool(bool b) const = 0;
   virtual std::unique_ptr<JsonValue> NewString(const std::string& s) const = 0;
 
   // Return a read-only pointer to the input message. Caller does *not* own
@@ -143,7 +337,66 @@ class ArgumentPackagerJson : public ArgumentPackager {
   // the pointer.
   virtual JsonValue* GetOutputMessage() const = 0;
 
+  // Point *data at the contents of value (a byte array) without copying
+  // it, if the underlying representation allows. The data must remain
+  // valid, and unmodified, for the lifetime of the packager. Return false
+  // if value can't be borrowed, in which case it's copied via AsByteArray().
+  virtual bool BorrowByteArray(const JsonValue& value, const uint8_t** data,
+                               size_t* len) {
+    return false;
+  }
+
+  // Create a byte array of len bytes, setting *data to point at its
+  // contents, which must remain valid for the lifetime of the packager.
+  // Return null if the underlying representation can't do this, in which
+  // case outputs are copied via NewByteArray() instead.
+  virtual std::unique_ptr<JsonValue> NewMappedByteArray(size_t len,
+                                                        uint8_t** data) {
+    return nullptr;
+  }
+
+  // Send (or save) the results for a single tile of a tiled call, a map
+  // containing "outputs". By default, tiles are appended to a "tiles"
+  // array in the results, which is useful for testing, but defeats the
+  // purpose of tiling; subclasses should stream them instead.
+  virtual bool EmitResultTile(const std::unique_ptr<JsonValue>& tile);
+
+  // Send (or save) the results of the preview of a progressive call, a map
+  // containing "outputs", "time_usec" and "preview". By default, it's
+  // stored as "preview" in the results; subclasses should send it at once.
+  virtual bool EmitResultPreview(const std::unique_ptr<JsonValue>& preview);
+
  private:
+  // Byte arrays returned by AllocateOutputStorage(), by argument name.
+  std::map<std::string, std::unique_ptr<JsonValue>> output_arrays_;
+
+  // If true, each output is packed as a digest of its contents (see
+  // HashBuffer()), rather than the contents themselves.
+  bool digests_only_;
+
+  std::vector<int32_t> thread_counts_;
+
+  // Buffers unpacked from the input message, by name, so that the inputs
+  // shared by the entries of a batch are only unpacked once.
+  std::map<std::string, buffer_t> unpacked_buffers_;
+
+  // The batch entry being run (if any), and the results so far.
+  std::unique_ptr<JsonValue> batch_entry_;
+  std::unique_ptr<JsonValue> batch_entry_results_;
+  std::unique_ptr<JsonValue> batch_results_;
+
+  // The results for the tile (or preview) being packed, if any.
+  std::unique_ptr<JsonValue> partial_results_;
+
+  // Return the named input, from the batch entry if it's present there,
+  // and otherwise from the input message; *shared is set to indicate
+  // which.
+  std::unique_ptr<JsonValue> GetInput(const std::string& name, bool* shared);
+  // Return the message to pack results into: the results for the tile
+  // (or preview) being packed, or else the batch entry being run, if any,
+  // and otherwise the output message.
+  JsonValue* GetCurrentResults() const;
+
   // Must use a vector-of-ptrs-to-vectors: we must ensure that
   // the data pointer of each vector remains constant, and making
   // the by-value allows vector to copy them to different storage
@@ -155,23 +408,638 @@ class ArgumentPackagerJson : public ArgumentPackager {
                              int32_t* result);
 };
 
-int MakePackagedCall(void* user_context,
-                     const halide_filter_metadata_t* metadata,
-                     ArgvFunc argv_func, ArgumentPackager* packager);
+// The layout of the messages read and written by ArgumentPackagerBinary.
+// A message is a BinaryHeader, then a BinaryArgument for each argument,
+// then a payload holding the contents of each buffer, each starting at an
+// offset (from the start of the message) that is a multiple of
+// kBinaryAlignment. All fields are little-endian.
+const uint32_t kBinaryMagic = 0x31424c53;  // "SLB1"
+const uint32_t kBinaryVersion = 1;
+const size_t kBinaryAlignment = 64;
 
-bool MetadataToJSON(const halide_filter_metadata_t* metadata,
-                    std::string* json);
+// Flags for BinaryHeader::flags, corresponding to the options of the same
+// names in PackagedCallOptions.
+const uint32_t kBinaryWorkStealing = 1 << 0;
+const uint32_t kBinaryTrace = 1 << 1;
+// The inverse of PackagedCallOptions::use_cache.
+const uint32_t kBinaryNoCache = 1 << 2;
+
+struct BinaryHeader {
+  uint32_t magic;
+  uint32_t version;
+  // In a call, one for each argument of the filter, in order; in results,
+  // one for each output.
+  uint32_t num_arguments;
+  uint32_t flags;
+  int32_t warmup_iterations;
+  int32_t iterations;
+  // Results only: the location in the payload of a JSON object holding
+  // everything other than the outputs (time_usec, memory, etc).
+  uint64_t results_offset;
+  uint64_t results_size;
+};
+static_assert(sizeof(BinaryHeader) == 40, "BinaryHeader must be 40 bytes");
+
+struct BinaryArgument {
+  // These must match the filter's argument.
+  int32_t kind;
+  int32_t type_code;
+  int32_t type_bits;
+  int32_t dimensions;
+  // Buffers only.
+  int32_t elem_size;
+  int32_t reserved;
+  int32_t extent[4];
+  int32_t stride[4];
+  int32_t min[4];
+  uint64_t host_offset;
+  uint64_t host_size;
+  // Scalars only.
+  halide_scalar_value_t scalar;
+};
+static_assert(sizeof(BinaryArgument) == 96, "BinaryArgument must be 96 bytes");
+
+// ArgumentPackagerBinary reads a call from a single binary message (see
+// BinaryHeader), rather than a tree of JSON values, and writes the results
+// in the same form. Every argument has a fixed-size descriptor at a known
+// offset, so unpacking or packing one is a constant amount of work (apart
+// from copying the contents of outputs into the results), and input
+// buffers are used in place. Tiled and batch calls aren't supported, nor
+// are thread_counts or digests_only.
+class ArgumentPackagerBinary : public ArgumentPackager {
+ public:
+  // message must remain valid, and unmodified, for the lifetime of the
+  // packager. If it's malformed, or doesn't match the filter, every
+  // Unpack call fails.
+  ArgumentPackagerBinary(const halide_filter_metadata_t* metadata,
+                         const uint8_t* message, size_t size);
+
+  bool UnpackArgumentValue(void* user_context,
+                           const halide_filter_argument_t& a,
+                           ArgValue* arg_value) override;
+
+  bool PackResultValue(const halide_filter_argument_t& a,
+                       const ArgValue& arg_value) override;
+
+  uint8_t* AllocateOutputStorage(const halide_filter_argument_t& a,
+                                 size_t bytes) override;
+
+  bool PackResultTimeUsec(double time_usec) override;
+
+  bool PackResultStats(const std::string& key,
+                       const ResultStats& stats) override;
+  bool PackResultStatsList(const std::string& key,
+                           const std::vector<ResultStats>& list) override;
+
+  bool PackResultProfile(const std::vector<FuncProfile>& funcs) override;
+
+  bool PackResultString(const std::string& key,
+                        const std::string& value) override;
+  bool PackResultBool(const std::string& key, bool value) override;
+
+  bool UnpackCallOptions(PackagedCallOptions* options) override;
+
+  // The size of the results message, once the call has been made.
+  size_t ResultsSize() const;
+  // Write the results message into data, which must hold at least
+  // ResultsSize() bytes.
+  void EncodeResults(uint8_t* data) const;
+
+ private:
+  struct Output {
+    BinaryArgument descriptor;
+    const uint8_t* host;
+  };
+
+  // Return the index of a among the filter's arguments, or -1.
+  int ArgumentIndex(const halide_filter_argument_t& a) const;
+  // Return the layout of the results message: the offset of each output's
+  // contents, and of the results JSON.
+  std::vector<uint64_t> ResultsLayout(uint64_t* results_offset) const;
+  std::string ResultsJson() const;
+
+  const halide_filter_metadata_t* const metadata_;
+  const uint8_t* const message_;
+  const size_t size_;
+  // Null if the message is malformed.
+  const BinaryHeader* header_;
+
+  // Storage returned by AllocateOutputStorage(), and the (aligned) part of
+  // it given to each argument, by index.
+  std::vector<std::unique_ptr<uint8_t[]>> output_storage_;
+  std::vector<uint8_t*> allocated_;
+  std::vector<Output> outputs_;
+  // The JSON for each of the other results, by name.
+  std::map<std::string, std::string> results_;
+
+  ArgumentPackagerBinary(const ArgumentPackagerBinary&) = delete;
+  ArgumentPackagerBinary& operator=(const ArgumentPackagerBinary&) = delete;
+};
+
+// A CallPlan records the decisions MakePackagedCall() makes about the
+// buffers of a call: the layout each input must be adapted to (and whether
+// that requires a copy), and the layout of each output. These depend only
+// on the filter, the geometry of its input buffers, the region of its
+// outputs and its scalar arguments (which can change the region of the
+// inputs it needs), so a plan can be reused for any later call with the
+// same inputs, skipping the bounds query.
+struct CallPlan {
+  struct BufferLayout {
+    // host and dev are always null.
+    buffer_t buffer;
+    // For inputs: true if the input must be copied into this layout.
+    bool needs_copy;
+
+    BufferLayout() : needs_copy(false) { memset(&buffer, 0, sizeof(buffer)); }
+  };
+  // One entry per filter argument; entries for scalars are unused.
+  std::vector<BufferLayout> layouts;
+  // The filter (or layout variant of it) to run.
+  const halide_filter_metadata_t* metadata;
+  ArgvFunc argv_func;
+  // The name of the layout variant, or "default" for the filter itself.
+  std::string variant;
+
+  CallPlan() : metadata(nullptr), argv_func(nullptr) {}
+};
+
+// BufferPool caches blocks of uninitialized memory across calls, bucketed
+// by size, so that re-running a filter doesn't have to allocate (and fault
+// in, and zero-fill) fresh storage for large buffers each time. Idle blocks
+// are evicted least-recently-released first once the pool holds more
+// than max_bytes. Thread-safe.
+class BufferPool {
+ public:
+  struct Block {
+    std::unique_ptr<uint8_t[]> data;
+    size_t size;
+
+    Block() : size(0) {}
+  };
+
+  explicit BufferPool(size_t max_bytes) : max_bytes_(max_bytes), bytes_(0) {}
+
+  // Fill in block with at least the given number of bytes of uninitialized
+  // storage, reusing an idle block if one of the right size is available.
+  // Returns false if the allocation fails.
+  bool Acquire(size_t bytes, Block* block);
+
+  // Return a block to the pool for reuse by a later Acquire().
+  void Release(Block block);
+
+  // Total size of the idle blocks held by the pool.
+  size_t idle_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+ private:
+  const size_t max_bytes_;
+  // Access to bytes_ and idle_ is controlled by mutex_.
+  mutable std::mutex mutex_;
+  size_t bytes_;
+  // Most recently released first.
+  std::list<Block> idle_;
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+};
+
+// ResultCache holds the outputs of recent calls, so that a call repeated
+// with identical inputs (e.g. as the UI switches back to an earlier
+// parameter value) needn't run the filter again. Calls are keyed by the
+// filter and the value of each input: scalars as-is, and buffers by their
+// elem_size, min and extent and a hash of their contents (see
+// HashBuffer()). Entries are evicted least-recently-used first once their
+// outputs total more than max_bytes. Thread-safe.
+class ResultCache {
+ public:
+  struct Key {
+    const halide_filter_metadata_t* metadata;
+    std::vector<uint64_t> values;
+
+    bool operator<(const Key& that) const {
+      if (metadata != that.metadata) return metadata < that.metadata;
+      return values < that.values;
+    }
+  };
+
+  struct Entry {
+    // One per filter argument; only those for outputs are used, and their
+    // host fields point into storage.
+    std::vector<buffer_t> outputs;
+    std::vector<std::unique_ptr<uint8_t[]>> storage;
+    // The time taken by the call that computed the outputs, and the
+    // layout variant that did so (see CallPlan::variant).
+    double time_usec;
+    std::string variant;
+    size_t bytes;
+
+    Entry() : time_usec(0.0), bytes(0) {}
+  };
+
+  explicit ResultCache(size_t max_bytes) : max_bytes_(max_bytes), bytes_(0) {}
+
+  // Return the entry for key, or null if there is none. The entry remains
+  // valid as long as it's referenced, even if it's evicted.
+  std::shared_ptr<const Entry> Find(const Key& key);
+  // Add (or replace) the entry for key. Entries larger than the whole
+  // cache aren't kept.
+  void Add(const Key& key, std::shared_ptr<const Entry> entry);
+
+  size_t max_bytes() const { return max_bytes_; }
+
+  // Total size of the outputs held by the cache.
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+ private:
+  typedef std::list<std::pair<Key, std::shared_ptr<const Entry>>> EntryList;
+
+  const size_t max_bytes_;
+  // Access to all other members is controlled by mutex_.
+  mutable std::mutex mutex_;
+  size_t bytes_;
+  // Most recently used first.
+  EntryList entries_;
+  std::map<Key, EntryList::iterator> index_;
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+};
+
+// ResidentInputs holds input buffers uploaded ahead of the calls that use
+// them (see UploadInputs()), so that calls can refer to them by handle
+// rather than sending (and unpacking, and adapting) them every time. Inputs
+// are evicted least-recently-used first once they total more than
+// max_bytes, and their handles become invalid, as if released; calls that
+// use an invalid handle fail. Thread-safe.
+class ResidentInputs {
+ public:
+  struct Entry {
+    // host points into storage.
+    buffer_t buffer;
+    std::unique_ptr<uint8_t[]> storage;
+    size_t bytes;
+    // HashBuffer() of the contents, for the result cache.
+    uint64_t hash;
+    // The buffer as uploaded, before it was adapted to the filter's layout
+    // (which may change its shape; see FixChunkyStrides()); host is null.
+    buffer_t uploaded;
+
+    Entry() : bytes(0), hash(0) {
+      memset(&buffer, 0, sizeof(buffer));
+      memset(&uploaded, 0, sizeof(uploaded));
+    }
+  };
+
+  explicit ResidentInputs(size_t max_bytes)
+      : max_bytes_(max_bytes), bytes_(0), next_handle_(1) {}
+
+  // Return the handle of the newly-added entry (always positive), or 0 if
+  // it's larger than max_bytes.
+  int32_t Add(std::shared_ptr<const Entry> entry);
+  // Return the entry for handle, or null if there is none. The entry
+  // remains valid as long as it's referenced, even if it's released.
+  std::shared_ptr<const Entry> Find(int32_t handle);
+  // Returns false if there's no entry for handle.
+  bool Release(int32_t handle);
+
+  // Total size of the inputs held.
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+ private:
+  typedef std::list<std::pair<int32_t, std::shared_ptr<const Entry>>>
+      EntryList;
+
+  const size_t max_bytes_;
+  // Access to all other members is controlled by mutex_.
+  mutable std::mutex mutex_;
+  size_t bytes_;
+  int32_t next_handle_;
+  // Most recently used first.
+  EntryList entries_;
+  std::map<int32_t, EntryList::iterator> index_;
+
+  ResidentInputs(const ResidentInputs&) = delete;
+  ResidentInputs& operator=(const ResidentInputs&) = delete;
+};
+
+// CoalescingSequencer orders the responses to requests that supersede one
+// another (e.g. calls made as a parameter is scrubbed): once a request
+// with a given key has been received, no earlier request with that key
+// may respond, so an older result can never follow a newer one.
+// Thread-safe.
+class CoalescingSequencer {
+ public:
+  CoalescingSequencer() : next_sequence_(1) {}
+
+  // Record the receipt of a request with key, superseding any earlier
+  // ones; returns its sequence number.
+  uint64_t Receive(const std::string& key);
+  // Return true if a later request with key has been received.
+  bool IsSuperseded(const std::string& key, uint64_t sequence) const;
+  // Call respond() (which should post the response), unless the request
+  // has been superseded; returns false if it has. No request with key is
+  // received while respond() runs, so a response posted in order (e.g. to
+  // a single thread) precedes that of any later request.
+  bool RespondUnlessSuperseded(const std::string& key, uint64_t sequence,
+                               const std::function<void()>& respond);
+
+ private:
+  // Access to all members is controlled by mutex_.
+  mutable std::mutex mutex_;
+  uint64_t next_sequence_;
+  // The sequence number of the latest request with each key.
+  std::map<std::string, uint64_t> latest_;
+
+  CoalescingSequencer(const CoalescingSequencer&) = delete;
+  CoalescingSequencer& operator=(const CoalescingSequencer&) = delete;
+};
+
+// PackagedCallState holds state that persists across calls to
+// MakePackagedCall() (e.g. for the lifetime of a shell). It is
+// thread-safe, so a single instance may be shared by concurrent calls.
+class PackagedCallState {
+ public:
+  // Enough for a couple of full-resolution float32 RGBA outputs.
+  static const size_t kDefaultMaxPooledBytes = 512 * 1024 * 1024;
+  // Enough for the outputs of a handful of recent calls on large images.
+  static const size_t kDefaultMaxCachedResultBytes = 256 * 1024 * 1024;
+  // Enough for a few full-resolution float32 RGBA inputs.
+  static const size_t kDefaultMaxResidentInputBytes = 512 * 1024 * 1024;
+
+  explicit PackagedCallState(
+      size_t max_pooled_bytes = kDefaultMaxPooledBytes,
+      size_t max_cached_result_bytes = kDefaultMaxCachedResultBytes,
+      size_t max_resident_input_bytes = kDefaultMaxResidentInputBytes)
+      : buffer_pool_(max_pooled_bytes),
+        result_cache_(max_cached_result_bytes),
+        resident_inputs_(max_resident_input_bytes) {}
+
+  // The key is the filter, plus the output region, the elem_size, extent,
+  // stride and min of each of its input buffers, and the value of each of
+  // its (non-handle) scalars.
+  struct CallPlanKey {
+    const halide_filter_metadata_t* metadata;
+    std::vector<int32_t> values;
+
+    bool operator<(const CallPlanKey& that) const {
+      if (metadata != that.metadata) return metadata < that.metadata;
+      return values < that.values;
+    }
+  };
+
+  // Copy the plan for key into *plan, returning false if there is none.
+  bool FindCallPlan(const CallPlanKey& key, CallPlan* plan) const;
+  void AddCallPlan(const CallPlanKey& key, const CallPlan& plan);
+  void RemoveCallPlan(const CallPlanKey& key);
+
+  // Storage for the buffers of each call is drawn from (and returned to)
+  // this pool.
+  BufferPool* buffer_pool() { return &buffer_pool_; }
+
+  // The outputs of recent calls (see PackagedCallOptions::use_cache).
+  ResultCache* result_cache() { return &result_cache_; }
+
+  // Inputs uploaded via UploadInputs().
+  ResidentInputs* resident_inputs() { return &resident_inputs_; }
+
+ private:
+  // Plans are small, but their keys are unbounded; once this many
+  // plans are cached, the cache is simply cleared.
+  static const size_t kMaxCallPlans = 32;
+
+  // Access to call_plans_ is controlled by mutex_.
+  mutable std::mutex mutex_;
+  std::map<CallPlanKey, CallPlan> call_plans_;
+  BufferPool buffer_pool_;
+  ResultCache result_cache_;
+  ResidentInputs resident_inputs_;
+};
+
+// MemoryStats accounts for the memory a filter allocates for itself (i.e.,
+// for its intermediate buffers, via halide_malloc()) during a call. It
+// only sees allocations made via TrackedMalloc(), so shells must override
+// halide_malloc() and halide_free() to use TrackedMalloc() and
+// TrackedFree(). Thread-safe, since a filter may allocate from any of its
+// threads.
+class MemoryStats {
+ public:
+  MemoryStats()
+      : current_bytes_(0), peak_bytes_(0), allocs_(0), largest_alloc_(0) {}
+
+  void Allocated(size_t bytes);
+  void Freed(size_t bytes);
+
+  // Returns current_bytes, peak_bytes, allocs (the number of allocations)
+  // and largest_alloc_bytes.
+  ResultStats GetStats() const;
+
+ private:
+  // Access to all members is controlled by mutex_.
+  mutable std::mutex mutex_;
+  size_t current_bytes_;
+  size_t peak_bytes_;
+  size_t allocs_;
+  size_t largest_alloc_;
+
+  MemoryStats(const MemoryStats&) = delete;
+  MemoryStats& operator=(const MemoryStats&) = delete;
+};
+
+// ScopedMemoryStats accounts allocations made via TrackedMalloc() with
+// the given user_context to stats, for its lifetime. While scopes for the
+// same user_context overlap, the one that began last gets them; the scopes
+// may end in any order.
+class ScopedMemoryStats {
+ public:
+  ScopedMemoryStats(void* user_context, MemoryStats* stats);
+  ~ScopedMemoryStats();
+
+ private:
+  void* const user_context_;
+  MemoryStats* const stats_;
+
+  ScopedMemoryStats(const ScopedMemoryStats&) = delete;
+  ScopedMemoryStats& operator=(const ScopedMemoryStats&) = delete;
+};
+
+// Allocate and free memory on behalf of a filter (see MemoryStats). The
+// memory is aligned as halide_malloc() requires.
+void* TrackedMalloc(void* user_context, size_t bytes);
+void TrackedFree(void* user_context, void* ptr);
+
+// CallTrace records a timeline of a call, as a list of spans, each with
+// the thread it ran on: one for each parallel task (via TracingDoTask()),
+// and, for filters built with the "trace_realizations" target feature, one
+// for the pipeline and for each realization of a Func (via TracingTrace()).
+// Shells must install those with halide_set_custom_do_task() and
+// halide_set_custom_trace() for it to see anything. Thread-safe.
+class CallTrace {
+ public:
+  CallTrace();
+
+  // Begin a span (on the calling thread), returning its id, or -1 if the
+  // trace is full. index is the task index, or -1.
+  int32_t Begin(const char* name, const char* category, int index);
+  void End(int32_t id);
+
+  // Return the spans that have ended as Chrome trace-event JSON (viewable
+  // in chrome://tracing), with times in microseconds since the trace was
+  // created. Threads are numbered in the order they were first seen.
+  std::string ToJson() const;
+
+ private:
+  // A long call can run a great many tasks; beyond this many spans, the
+  // rest are dropped.
+  static const size_t kMaxSpans = 1 << 20;
+
+  struct Span {
+    std::string name;
+    const char* category;
+    int index;
+    int thread;
+    double begin_usec;
+    // Negative until the span ends.
+    double end_usec;
+  };
+
+  const double start_usec_;
+  // Access to spans_ and threads_ is controlled by mutex_.
+  mutable std::mutex mutex_;
+  std::vector<Span> spans_;
+  std::map<std::thread::id, int> threads_;
+
+  CallTrace(const CallTrace&) = delete;
+  CallTrace& operator=(const CallTrace&) = delete;
+};
+
+// ScopedCallTrace records the spans of calls with the given user_context
+// to trace, for its lifetime. As with ScopedMemoryStats, overlapping scopes
+// for the same user_context may end in any order.
+class ScopedCallTrace {
+ public:
+  ScopedCallTrace(void* user_context, CallTrace* trace);
+  ~ScopedCallTrace();
+
+ private:
+  void* const user_context_;
+  CallTrace* const trace_;
+
+  ScopedCallTrace(const ScopedCallTrace&) = delete;
+  ScopedCallTrace& operator=(const ScopedCallTrace&) = delete;
+};
+
+// halide_trace() and halide_do_task() implementations that record spans
+// for calls with a ScopedCallTrace (see CallTrace). Other trace events are
+// ignored, and other tasks are passed on to halide_default_do_task().
+int32_t TracingTrace(void* user_context, const halide_trace_event* event);
+int TracingDoTask(void* user_context, halide_task_t f, int idx,
+                  uint8_t* closure);
+
+// A filter may be built in several variants, each specialized for a
+// different input layout (see buildSafelightGen.sh); each is registered
+// under the name of the filter plus a suffix of kLayoutVariantSeparator
+// and the layout name (e.g. "foo__chunky").
+extern const char kLayoutVariantSeparator[];
+
+struct HalideFilterVariant {
+  std::string layout;
+  const halide_filter_metadata_t* metadata;
+  ArgvFunc argv_func;
+};
 
 struct HalideFilterInfo {
   const halide_filter_metadata_t* const metadata;
   const ArgvFunc argv_func;
+  // Layout variants of the filter, if any.
+  std::vector<HalideFilterVariant> variants;
 };
 typedef std::map<std::string, HalideFilterInfo> HalideFilterInfoMap;
 
+int MakePackagedCall(void* user_context,
+                     const halide_filter_metadata_t* metadata,
+                     ArgvFunc argv_func, ArgumentPackager* packager);
+
+// As above, but using (and updating) state carried across calls; state
+// may be null, in which case nothing is cached.
+int MakePackagedCall(void* user_context,
+                     const halide_filter_metadata_t* metadata,
+                     ArgvFunc argv_func, ArgumentPackager* packager,
+                     PackagedCallState* state);
+
+// As above, but if the filter has layout variants, the call is dispatched
+// to the first one (if any) that can use the inputs as-is, rather than
+// copying them into another layout; the name of the variant that ran
+// ("default" for the filter itself) is returned as "variant".
+int MakePackagedCall(void* user_context, const HalideFilterInfo& info,
+                     ArgumentPackager* packager, PackagedCallState* state);
+
+// Run each entry in the batch contained in the packager's input message
+// (see ArgumentPackagerJson::BatchSize()) in turn, as if by
+// MakePackagedCall(), reusing the state (or, if state is null, state local
+// to the batch) between entries. Stops at the first entry that fails.
+int MakePackagedCallBatch(void* user_context, const HalideFilterInfo& info,
+                          ArgumentPackagerJson* packager,
+                          PackagedCallState* state);
+
+// Store each input buffer in the input message in state, converted to the
+// layout the filter requires of it (as determined by a bounds query, for
+// which the message must contain all of the filter's inputs, as for a
+// call), and return its handle in "handles", by name. Calls made with the
+// same state can then give the handle in place of the buffer (see
+// ArgumentPackagerJson::UnpackInputHandle()). Inputs that are themselves
+// given as handles are left as they are.
+int UploadInputs(void* user_context, const HalideFilterInfo& info,
+                 ArgumentPackagerJson* packager, PackagedCallState* state);
+
+// Release the resident inputs whose handles are listed in the input
+// message's "handles" array. Handles that are no longer valid (e.g. because
+// they've been evicted) are ignored.
+int ReleaseInputs(void* user_context, ArgumentPackagerJson* packager,
+                  PackagedCallState* state);
+
+// A halide_do_par_for() implementation, to be installed by the shells via
+// halide_set_custom_do_par_for(). The parallel loops of calls made with
+// the work_stealing option are run on a pool of threads (one per core),
+// each with its own deque of tasks: a worker takes tasks from the back of
+// its own deque, and when that's empty, steals them from the front of
+// another's. The thread that starts a loop helps to run it. The loops of
+// all other calls are passed on to halide_default_do_par_for().
+int WorkStealingDoParFor(void* user_context, halide_task_t f, int min,
+                         int size, uint8_t* closure);
+
+// Set the thread count of the Halide runtime, as halide_set_num_threads()
+// does (returning the previous count), but only once no scaling sweep (see
+// PackagedCallOptions::thread_counts) is running or waiting to, so as not
+// to disturb its timings. Shells should use this rather than calling
+// halide_set_num_threads() directly.
+int SetNumThreads(int threads);
+
+// Return the thread counts for a scaling sweep up to max_threads: powers of
+// two, followed by max_threads itself if it isn't one.
+std::vector<int32_t> ScalingSweepThreadCounts(int max_threads);
+
+// Return a 64-bit hash (XXH64, with seed 0) of the elements of buf, taken
+// in order of increasing coordinates (dimension 0 fastest). Only the
+// elements themselves are hashed, so the result is independent of the
+// layout of buf in memory.
+uint64_t HashBuffer(const buffer_t& buf, int dimensions);
+
+bool MetadataToJSON(const halide_filter_metadata_t* metadata,
+                    std::string* json);
+
 // BuildHalideFilterInfoMap is a simple utility that calls
 // halide_enumerate_registered_filters() in its ctor to build a map of
 // registered Halide filters. The map should be considered immutable after
-// construction. Returns false if an error occurs.
+// construction. Layout variants are listed with their filter, rather than
+// separately. Returns false if an error occurs.
 bool BuildHalideFilterInfoMap(HalideFilterInfoMap* m);
 
 }  // namespace packaged_call_runtime
@@ -13,6 +13,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #include "visualizers/packaged_call_runtime.h"
 #include "packaged_call_tester.h"
 #include "json/json.h"
@@ -101,6 +105,23 @@ class ArgumentPackagerJsoncpp
       }
       return false;
     }
+    size_t ArrayLength() const override {
+      return var_.isArray() ? var_.size() : 0;
+    }
+    unique_ptr<JsonValue> GetElement(size_t i) const override {
+      Json::Value var;
+      if (var_.isArray() && i < var_.size()) {
+        var = var_[static_cast<Json::ArrayIndex>(i)];
+      }
+      return unique_ptr<JsonValue>(new JsoncppValue(var));
+    }
+    bool AppendElement(const unique_ptr<JsonValue>& value) override {
+      if (var_.isArray()) {
+        var_.append(static_cast<const JsoncppValue*>(value.get())->var_);
+        return true;
+      }
+      return false;
+    }
 
     const Json::Value& GetVar() const { return var_; }
 
@@ -113,6 +134,11 @@ class ArgumentPackagerJsoncpp
         new JsoncppValue(Json::Value(Json::objectValue)));
   }
 
+  unique_ptr<JsonValue> NewArray() const override {
+    return unique_ptr<JsonValue>(
+        new JsoncppValue(Json::Value(Json::arrayValue)));
+  }
+
   unique_ptr<JsonValue> NewInt32Array(const int32_t* data,
                                       size_t len) const override {
     Json::Value array_buf(Json::arrayValue);
@@ -141,6 +167,10 @@ class ArgumentPackagerJsoncpp
     return unique_ptr<JsonValue>(new JsoncppValue(Json::Value(d)));
   }
 
+  unique_ptr<JsonValue> NewBool(bool b) const override {
+    return unique_ptr<JsonValue>(new JsoncppValue(Json::Value(b)));
+  }
+
   unique_ptr<JsonValue> NewString(const string& s) const override {
     return unique_ptr<JsonValue>(new JsoncppValue(Json::Value(s)));
   }
@@ -156,6 +186,244 @@ class ArgumentPackagerJsoncpp
   unique_ptr<JsonValue> output_message_;
 };
 
+// Borrows every input byte array from borrowed_, rather than copying it
+// from the message.
+class ArgumentPackagerBorrowing : public ArgumentPackagerJsoncpp {
+ public:
+  ArgumentPackagerBorrowing(const Json::Value& input_message,
+                            const vector<uint8_t>& borrowed)
+      : ArgumentPackagerJsoncpp(input_message), borrowed_(borrowed) {}
+
+  int borrow_count() const { return borrow_count_; }
+
+ protected:
+  bool BorrowByteArray(const JsonValue& value, const uint8_t** data,
+                       size_t* len) override {
+    ++borrow_count_;
+    *data = borrowed_.data();
+    *len = borrowed_.size();
+    return true;
+  }
+
+ private:
+  const vector<uint8_t> borrowed_;
+  int borrow_count_ = 0;
+};
+
+// Supplies the storage for every output, recording its contents
+// rather than packing them into the results.
+class ArgumentPackagerMapped : public ArgumentPackagerJsoncpp {
+ public:
+  explicit ArgumentPackagerMapped(const Json::Value& input_message)
+      : ArgumentPackagerJsoncpp(input_message) {}
+
+  const vector<unique_ptr<vector<uint8_t>>>& mapped() const {
+    return mapped_;
+  }
+
+ protected:
+  unique_ptr<JsonValue> NewMappedByteArray(size_t len,
+                                           uint8_t** data) override {
+    mapped_.emplace_back(new vector<uint8_t>(len));
+    *data = mapped_.back()->data();
+    return unique_ptr<JsonValue>(new JsoncppValue(Json::Value("mapped")));
+  }
+
+ private:
+  vector<unique_ptr<vector<uint8_t>>> mapped_;
+};
+
+static const char* kTesterInputsJson = R"z_delimiter_z({
+   "input1" : {
+     "host": [0],
+     "extent": [1, 1, 1, 0],
+     "stride": [1, 1, 1, 0],
+     "min": [0, 0, 0, 0],
+     "elem_size": 1
+   },
+   "input2" : {
+     "host": [1],
+     "extent": [1, 1, 1, 0],
+     "stride": [1, 1, 1, 0],
+     "min": [0, 0, 0, 0],
+     "elem_size": 1
+   },
+   "b" : true,
+   "d" : 1,
+   "f" : 1,
+   "i16" : 16,
+   "i32" : 32,
+   "i64" : 64,
+   "i8" : 8,
+   "u16" : 16,
+   "u32" : 32,
+   "u64" : 64,
+   "u8" : 8
+})z_delimiter_z";
+
+// Behaves like packaged_call_tester, except that (like a chunky
+// generator) it constrains stride[0] of its inputs, to 2.
+int StridedTesterArgv(void** args) {
+  buffer_t* input1 = reinterpret_cast<buffer_t*>(args[1]);
+  buffer_t* input2 = reinterpret_cast<buffer_t*>(args[2]);
+  const bool bounds_query = !input1->host || !input2->host;
+  int status = packaged_call_tester_argv(args);
+  if (status == 0 && bounds_query) {
+    input1->stride[0] = 2;
+    input2->stride[0] = 2;
+  }
+  return status;
+}
+
+// Behaves like packaged_call_tester, except that it constrains its outputs
+// to rows of 160 elements, whatever their width.
+int RowPitchTesterArgv(void** args) {
+  const bool bounds_query = !reinterpret_cast<buffer_t*>(args[1])->host;
+  int status = packaged_call_tester_argv(args);
+  if (status == 0 && bounds_query) {
+    for (int i = 14; i < 17; ++i) {
+      buffer_t* output = reinterpret_cast<buffer_t*>(args[i]);
+      output->stride[0] = 1;
+      output->stride[1] = 160;
+      output->stride[2] = 160 * output->extent[1];
+    }
+  }
+  return status;
+}
+
+// Behaves like StridedTesterArgv, except that it needs only the part of
+// input1 under its output, shifted right by i32 - 32 pixels; so the
+// region of input1 that must be copied depends on a scalar. Fails unless
+// input1 covers that region.
+int ShiftedTesterArgv(void** args) {
+  buffer_t* input1 = reinterpret_cast<buffer_t*>(args[1]);
+  const int32_t shift = *reinterpret_cast<int32_t*>(args[12]) - 32;
+  const buffer_t* output = reinterpret_cast<buffer_t*>(args[14]);
+  const int32_t min = output->min[0] + shift;
+  const int32_t extent = output->extent[0];
+  if (input1->host &&
+      (input1->min[0] > min ||
+       input1->min[0] + input1->extent[0] < min + extent)) {
+    return -1;
+  }
+  const bool bounds_query = !input1->host;
+  int status = StridedTesterArgv(args);
+  if (status == 0 && bounds_query) {
+    input1->min[0] = min;
+    input1->extent[0] = extent;
+  }
+  return status;
+}
+
+// ParallelTesterArgv runs a parallel loop of kParallelTasks tasks, each of
+// which runs a nested loop of kNestedTasks; every nested task counts its
+// runs in gNestedTaskRuns.
+const int kParallelTasks = 16;
+const int kNestedTasks = 8;
+std::atomic<int> gNestedTaskRuns[kParallelTasks * kNestedTasks];
+
+int NestedTask(void* user_context, int index, uint8_t* closure) {
+  ++gNestedTaskRuns[index];
+  return 0;
+}
+
+int ParallelTask(void* user_context, int index, uint8_t* closure) {
+  return halide_do_par_for(user_context, NestedTask, index * kNestedTasks,
+                           kNestedTasks, closure);
+}
+
+void ResetNestedTaskRuns() {
+  for (auto& runs : gNestedTaskRuns) runs = 0;
+}
+
+// Behaves like packaged_call_tester (which has no parallel loops of its
+// own), except that each run first runs the loops above.
+int ParallelTesterArgv(void** args) {
+  const buffer_t* input1 = reinterpret_cast<buffer_t*>(args[1]);
+  if (input1->host) {
+    void* user_context = *reinterpret_cast<void**>(args[0]);
+    const int status = halide_do_par_for(user_context, ParallelTask, 0,
+                                         kParallelTasks, nullptr);
+    if (status != 0) return status;
+  }
+  return packaged_call_tester_argv(args);
+}
+
+// Return a "call" message with valid inputs for packaged_call_tester.
+Json::Value MakeTesterCallMessage() {
+  Json::Reader reader;
+  Json::Value inputs;
+  EXPECT_TRUE(reader.parse(kTesterInputsJson, inputs));
+
+  Json::Value message;
+  message["verb"] = "call";
+  message["inputs"] = inputs;
+  return message;
+}
+
+// Return a binary call message (see ArgumentPackagerBinary) with the same
+// inputs as MakeTesterCallMessage(). The storage is made of uint64_t so
+// that it's suitably aligned.
+vector<uint64_t> MakeTesterBinaryCallMessage() {
+  const halide_filter_metadata_t& metadata = packaged_call_tester_metadata;
+  const size_t kInputOffset[2] = {
+      packaged_call_runtime::kBinaryAlignment * 64,
+      packaged_call_runtime::kBinaryAlignment * 65};
+  vector<uint64_t> storage(kInputOffset[1] / sizeof(uint64_t) + 1);
+  uint8_t* message = reinterpret_cast<uint8_t*>(storage.data());
+
+  packaged_call_runtime::BinaryHeader* header =
+      reinterpret_cast<packaged_call_runtime::BinaryHeader*>(message);
+  header->magic = packaged_call_runtime::kBinaryMagic;
+  header->version = packaged_call_runtime::kBinaryVersion;
+  header->num_arguments = metadata.num_arguments;
+  header->iterations = 1;
+  packaged_call_runtime::BinaryArgument* args =
+      reinterpret_cast<packaged_call_runtime::BinaryArgument*>(header + 1);
+  int inputs = 0;
+  for (int i = 0; i < metadata.num_arguments; ++i) {
+    const halide_filter_argument_t& a = metadata.arguments[i];
+    packaged_call_runtime::BinaryArgument& d = args[i];
+    d.kind = a.kind;
+    d.type_code = a.type_code;
+    d.type_bits = a.type_bits;
+    d.dimensions = a.dimensions;
+    if (a.kind == halide_argument_kind_input_buffer) {
+      d.elem_size = 1;
+      for (int j = 0; j < 3; ++j) {
+        d.extent[j] = d.stride[j] = 1;
+      }
+      d.host_offset = kInputOffset[inputs];
+      d.host_size = 1;
+      message[d.host_offset] = inputs++;
+    } else if (a.kind == halide_argument_kind_input_scalar &&
+               a.type_code != halide_type_handle) {
+      // As in kTesterInputsJson: the bit width, or 1 (or true) for float,
+      // double and bool.
+      switch (a.type_bits) {
+        case 1: d.scalar.u.b = true; break;
+        case 8: d.scalar.u.u8 = 8; break;
+        case 16: d.scalar.u.u16 = 16; break;
+        case 32:
+          if (a.type_code == halide_type_float) {
+            d.scalar.u.f32 = 1.0f;
+          } else {
+            d.scalar.u.u32 = 32;
+          }
+          break;
+        case 64:
+          if (a.type_code == halide_type_float) {
+            d.scalar.u.f64 = 1.0;
+          } else {
+            d.scalar.u.u64 = 64;
+          }
+          break;
+      }
+    }
+  }
+  return storage;
+}
+
 }  // namespace
 
 namespace {
@@ -334,41 +602,7 @@ TEST(PackagedCall, TestDescribe) {
 }
 
 TEST(PackagedCall, TestCall) {
-  static const char* kInputsJson = R"z_delimiter_z({
-   "input1" : {
-     "host": [0],
-     "extent": [1, 1, 1, 0],
-     "stride": [1, 1, 1, 0],
-     "min": [0, 0, 0, 0],
-     "elem_size": 1
-   },
-   "input2" : {
-     "host": [1],
-     "extent": [1, 1, 1, 0],
-     "stride": [1, 1, 1, 0],
-     "min": [0, 0, 0, 0],
-     "elem_size": 1
-   },
-   "b" : true,
-   "d" : 1,
-   "f" : 1,
-   "i16" : 16,
-   "i32" : 32,
-   "i64" : 64,
-   "i8" : 8,
-   "u16" : 16,
-   "u32" : 32,
-   "u64" : 64,
-   "u8" : 8
-})z_delimiter_z";
-
-  Json::Reader reader;
-  Json::Value inputs;
-  EXPECT_TRUE(reader.parse(kInputsJson, inputs));
-
-  Json::Value message;
-  message["verb"] = "call";
-  message["inputs"] = inputs;
+  Json::Value message = MakeTesterCallMessage();
 
   ArgumentPackagerJsoncpp packager(message);
   int status = packaged_call_runtime::MakePackagedCall(
@@ -384,6 +618,24 @@ TEST(PackagedCall, TestCall) {
   EXPECT_TRUE(results["time_usec"].isNumeric());
   results["time_usec"] = 0;
 
+  // Likewise, verify that each phase of the call was timed, then remove
+  // the breakdown.
+  EXPECT_TRUE(results.isMember("phase_usec"));
+  for (const char* phase : {"unpack", "bounds_query", "adapt_inputs",
+                            "prepare_outputs", "run", "pack"}) {
+    EXPECT_TRUE(results["phase_usec"][phase].isNumeric()) << phase;
+  }
+  results.removeMember("phase_usec");
+
+  // The filter's own allocations aren't tracked here (see
+  // TestMemoryStats), but they're always reported.
+  EXPECT_TRUE(results.isMember("memory"));
+  for (const char* stat : {"current_bytes", "peak_bytes", "allocs",
+                           "largest_alloc_bytes"}) {
+    EXPECT_TRUE(results["memory"][stat].isNumeric()) << stat;
+  }
+  results.removeMember("memory");
+
   static const char* kJsonExpected = R"z_delimiter_z({
    "outputs" : {
       "f.0" : {
@@ -423,6 +675,1299 @@ TEST(PackagedCall, TestCall) {
   EXPECT_EQ(kJsonExpected, json_actual);
 }
 
+TEST(PackagedCall, TestCallBenchmark) {
+  Json::Value message = MakeTesterCallMessage();
+  message["warmup_iterations"] = 2;
+  message["iterations"] = 5;
+
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  Json::Value results = packager.GetResults();
+  EXPECT_TRUE(results["time_usec"].isNumeric());
+
+  const Json::Value& stats = results["time_stats"];
+  EXPECT_TRUE(stats.isObject());
+  EXPECT_EQ(5, stats["iterations"].asInt());
+  EXPECT_LE(stats["min"].asDouble(), stats["median"].asDouble());
+  EXPECT_LE(stats["median"].asDouble(), stats["p90"].asDouble());
+  EXPECT_LE(stats["p90"].asDouble(), stats["max"].asDouble());
+  EXPECT_GE(stats["stddev"].asDouble(), 0.0);
+  EXPECT_EQ(stats["median"].asDouble(), results["time_usec"].asDouble());
+  EXPECT_TRUE(results["phase_usec"]["warmup"].isNumeric());
+
+  // Outputs are packed once, and match a single run.
+  EXPECT_EQ(1, results["outputs"]["f.0"]["host"][0].asInt());
+  EXPECT_EQ(64, results["outputs"]["f.1"]["host"][0].asInt());
+  EXPECT_EQ(128, results["outputs"]["f.2"]["host"][0].asInt());
+}
+
+TEST(PackagedCall, TestCallPlanCache) {
+  packaged_call_runtime::PackagedCallState state;
+  Json::Value message = MakeTesterCallMessage();
+  // Otherwise, repeated calls wouldn't run the filter at all (see
+  // TestCallResultCache).
+  message["cache"] = false;
+
+  // The first call must do a bounds query; the second, with identical
+  // inputs, should reuse the plan and produce identical outputs.
+  Json::Value first, second;
+  {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                     nullptr, &packaged_call_tester_metadata,
+                     packaged_call_tester_argv, &packager, &state));
+    first = packager.GetResults();
+  }
+  {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                     nullptr, &packaged_call_tester_metadata,
+                     packaged_call_tester_argv, &packager, &state));
+    second = packager.GetResults();
+  }
+  EXPECT_TRUE(first["phase_usec"].isMember("bounds_query"));
+  EXPECT_FALSE(second["phase_usec"].isMember("bounds_query"));
+  EXPECT_EQ(first["outputs"], second["outputs"]);
+
+  // Changing the geometry of an input invalidates the plan.
+  message["inputs"]["input2"]["stride"][2] = 2;
+  message["inputs"]["input2"]["host"].append(0);
+  {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                     nullptr, &packaged_call_tester_metadata,
+                     packaged_call_tester_argv, &packager, &state));
+    EXPECT_TRUE(packager.GetResults()["phase_usec"].isMember("bounds_query"));
+  }
+}
+
+TEST(PackagedCall, TestCallPlanCacheScalars) {
+  const packaged_call_runtime::HalideFilterInfo info = {
+      &packaged_call_tester_metadata, ShiftedTesterArgv, {}};
+  // An 8x1 image, of which only the 2x1 region at the origin is computed.
+  Json::Value message = MakeTesterCallMessage();
+  message["cache"] = false;
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = 8;
+    input["stride"][1] = 8;
+    input["stride"][2] = 8;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int x = 0; x < 8; ++x) input["host"].append(x);
+  }
+  message["output_crop"]["min"][0] = 0;
+  message["output_crop"]["extent"][0] = 2;
+
+  // Tiled calls crop each tile's inputs from those adapted to the plan, so
+  // they're just as sensitive to a stale plan.
+  for (bool tiled : {false, true}) {
+    if (tiled) {
+      message["tile_extent"][0] = 1;
+      message["tile_extent"][1] = 1;
+    }
+    packaged_call_runtime::PackagedCallState state;
+    const auto Call = [&state, &info](const Json::Value& message) {
+      ArgumentPackagerJsoncpp packager(message);
+      EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                       nullptr, info, &packager, &state));
+      return packager.GetResults();
+    };
+
+    // A scalar that moves the region of input1 the filter needs can't
+    // reuse the plan (which copies only the region the earlier call
+    // needed), but returning to an earlier value can.
+    message["inputs"]["i32"] = 32;
+    EXPECT_TRUE(Call(message)["phase_usec"].isMember("bounds_query"));
+    message["inputs"]["i32"] = 36;
+    EXPECT_TRUE(Call(message)["phase_usec"].isMember("bounds_query"));
+    message["inputs"]["i32"] = 32;
+    EXPECT_FALSE(Call(message)["phase_usec"].isMember("bounds_query"));
+  }
+}
+
+TEST(PackagedCall, TestCallResultCache) {
+  packaged_call_runtime::PackagedCallState state;
+  const auto Call = [&state](const Json::Value& message) {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                     nullptr, &packaged_call_tester_metadata,
+                     packaged_call_tester_argv, &packager, &state));
+    return packager.GetResults();
+  };
+
+  // The second of two identical calls returns the outputs of the first,
+  // without running the filter.
+  Json::Value message = MakeTesterCallMessage();
+  const Json::Value first = Call(message);
+  const Json::Value second = Call(message);
+  EXPECT_FALSE(first["cache_hit"].asBool());
+  EXPECT_TRUE(first["phase_usec"].isMember("run"));
+  EXPECT_TRUE(second["cache_hit"].asBool());
+  EXPECT_FALSE(second["phase_usec"].isMember("run"));
+  EXPECT_EQ(first["outputs"], second["outputs"]);
+  EXPECT_EQ(first["time_usec"], second["time_usec"]);
+  EXPECT_LT(0u, state.result_cache()->bytes());
+
+  // Any change to the inputs is a miss: a scalar, or the contents or
+  // geometry of a buffer (but not its layout).
+  message["inputs"]["u8"] = 9;
+  EXPECT_FALSE(Call(message)["cache_hit"].asBool());
+  message["inputs"]["input1"]["host"][0] = 7;
+  EXPECT_FALSE(Call(message)["cache_hit"].asBool());
+  message["inputs"]["input1"]["min"][0] = 1;
+  EXPECT_FALSE(Call(message)["cache_hit"].asBool());
+  EXPECT_TRUE(Call(message)["cache_hit"].asBool());
+  message["inputs"]["input2"]["stride"][2] = 2;
+  message["inputs"]["input2"]["host"].append(0);
+  EXPECT_TRUE(Call(message)["cache_hit"].asBool());
+
+  // Calls that benchmark the filter always run it, as do calls that opt
+  // out.
+  message["iterations"] = 2;
+  EXPECT_FALSE(Call(message).isMember("cache_hit"));
+  message["iterations"] = 1;
+  message["cache"] = false;
+  EXPECT_FALSE(Call(message).isMember("cache_hit"));
+}
+
+TEST(ResultCache, TestEviction) {
+  packaged_call_runtime::ResultCache cache(100);
+  const auto MakeEntry = [](size_t bytes) {
+    std::shared_ptr<packaged_call_runtime::ResultCache::Entry> entry(
+        new packaged_call_runtime::ResultCache::Entry);
+    entry->bytes = bytes;
+    return entry;
+  };
+  packaged_call_runtime::ResultCache::Key a, b, c;
+  a.metadata = b.metadata = c.metadata = &packaged_call_tester_metadata;
+  a.values.push_back(1);
+  b.values.push_back(2);
+  c.values.push_back(3);
+
+  cache.Add(a, MakeEntry(40));
+  cache.Add(b, MakeEntry(40));
+  EXPECT_EQ(80u, cache.bytes());
+  // Using a makes b the least recently used, so it's evicted first.
+  EXPECT_NE(nullptr, cache.Find(a));
+  cache.Add(c, MakeEntry(40));
+  EXPECT_EQ(80u, cache.bytes());
+  EXPECT_NE(nullptr, cache.Find(a));
+  EXPECT_EQ(nullptr, cache.Find(b));
+  EXPECT_NE(nullptr, cache.Find(c));
+  // Entries larger than the cache aren't kept.
+  cache.Add(b, MakeEntry(101));
+  EXPECT_EQ(nullptr, cache.Find(b));
+  EXPECT_EQ(80u, cache.bytes());
+}
+
+TEST(CoalescingSequencer, TestSupersede) {
+  packaged_call_runtime::CoalescingSequencer sequencer;
+  int responses = 0;
+  const auto respond = [&responses] { ++responses; };
+
+  const uint64_t a = sequencer.Receive("call:f");
+  const uint64_t b = sequencer.Receive("call:f");
+  const uint64_t c = sequencer.Receive("call:g");
+  EXPECT_TRUE(sequencer.IsSuperseded("call:f", a));
+  EXPECT_FALSE(sequencer.IsSuperseded("call:f", b));
+  // Other keys are independent.
+  EXPECT_FALSE(sequencer.IsSuperseded("call:g", c));
+  EXPECT_FALSE(sequencer.RespondUnlessSuperseded("call:f", a, respond));
+  EXPECT_TRUE(sequencer.RespondUnlessSuperseded("call:f", b, respond));
+  EXPECT_TRUE(sequencer.RespondUnlessSuperseded("call:g", c, respond));
+  EXPECT_EQ(2, responses);
+}
+
+TEST(CoalescingSequencer, TestNoStaleResponses) {
+  packaged_call_runtime::CoalescingSequencer sequencer;
+  // Requests are received one at a time (as on the main thread) while
+  // earlier ones are still running, and each responds as soon as it's
+  // done, which may be before or after later ones.
+  const int kRequests = 64;
+  vector<uint64_t> posted;
+  vector<std::thread> threads;
+  uint64_t latest = 0;
+  for (int i = 0; i < kRequests; ++i) {
+    latest = sequencer.Receive("call:f");
+    const uint64_t sequence = latest;
+    threads.emplace_back([&sequencer, &posted, sequence, i] {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds((i * 7919) % 1000));
+      // posted is only modified by respond(), which is serialized.
+      sequencer.RespondUnlessSuperseded(
+          "call:f", sequence, [&posted, sequence] {
+            posted.push_back(sequence);
+          });
+    });
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  for (auto& thread : threads) thread.join();
+
+  // An older response never follows a newer one, and the latest request
+  // always responds.
+  ASSERT_FALSE(posted.empty());
+  for (size_t i = 1; i < posted.size(); ++i) {
+    EXPECT_LT(posted[i - 1], posted[i]);
+  }
+  EXPECT_EQ(latest, posted.back());
+}
+
+TEST(PackagedCall, TestUploadInputs) {
+  packaged_call_runtime::PackagedCallState state;
+  const packaged_call_runtime::HalideFilterInfo info = {
+      &packaged_call_tester_metadata, StridedTesterArgv, {}};
+  Json::Value message = MakeTesterCallMessage();
+  message["cache"] = false;
+
+  // Uploaded inputs are stored in the layout the filter requires.
+  ArgumentPackagerJsoncpp upload_packager(message);
+  EXPECT_EQ(0, packaged_call_runtime::UploadInputs(nullptr, info,
+                                                   &upload_packager, &state));
+  const Json::Value handles = upload_packager.GetResults()["handles"];
+  ASSERT_TRUE(handles.isMember("input1"));
+  ASSERT_TRUE(handles.isMember("input2"));
+  const auto resident =
+      state.resident_inputs()->Find(handles["input1"].asInt());
+  ASSERT_NE(nullptr, resident);
+  EXPECT_EQ(2, resident->buffer.stride[0]);
+
+  // A call by handle has the same outputs as one by value, and needn't
+  // adapt its inputs.
+  ArgumentPackagerJsoncpp value_packager(message);
+  EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                   nullptr, info, &value_packager, &state));
+  Json::Value by_handle = message;
+  for (const char* name : {"input1", "input2"}) {
+    by_handle["inputs"][name] = Json::Value(Json::objectValue);
+    by_handle["inputs"][name]["handle"] = handles[name];
+  }
+  ArgumentPackagerJsoncpp handle_packager(by_handle);
+  EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(
+                   nullptr, info, &handle_packager, &state));
+  EXPECT_EQ(value_packager.GetResults()["outputs"],
+            handle_packager.GetResults()["outputs"]);
+
+  // Once released, the handles can't be used.
+  Json::Value release;
+  release["handles"].append(handles["input1"]);
+  release["handles"].append(handles["input2"]);
+  ArgumentPackagerJsoncpp release_packager(release);
+  EXPECT_EQ(0, packaged_call_runtime::ReleaseInputs(nullptr, &release_packager,
+                                                    &state));
+  EXPECT_EQ(0u, state.resident_inputs()->bytes());
+  ArgumentPackagerJsoncpp released_packager(by_handle);
+  EXPECT_NE(0, packaged_call_runtime::MakePackagedCall(
+                   nullptr, info, &released_packager, &state));
+}
+
+TEST(ResidentInputs, TestEviction) {
+  packaged_call_runtime::ResidentInputs inputs(100);
+  const auto MakeEntry = [](size_t bytes) {
+    std::shared_ptr<packaged_call_runtime::ResidentInputs::Entry> entry(
+        new packaged_call_runtime::ResidentInputs::Entry);
+    entry->bytes = bytes;
+    return entry;
+  };
+
+  const int32_t a = inputs.Add(MakeEntry(40));
+  const int32_t b = inputs.Add(MakeEntry(40));
+  EXPECT_NE(a, b);
+  EXPECT_EQ(80u, inputs.bytes());
+  // Using a makes b the least recently used, so it's evicted first.
+  EXPECT_NE(nullptr, inputs.Find(a));
+  const int32_t c = inputs.Add(MakeEntry(40));
+  EXPECT_EQ(80u, inputs.bytes());
+  EXPECT_NE(nullptr, inputs.Find(a));
+  EXPECT_EQ(nullptr, inputs.Find(b));
+  EXPECT_NE(nullptr, inputs.Find(c));
+  EXPECT_FALSE(inputs.Release(b));
+  EXPECT_TRUE(inputs.Release(c));
+  EXPECT_EQ(40u, inputs.bytes());
+  // Entries larger than the budget can't be held at all.
+  EXPECT_EQ(0, inputs.Add(MakeEntry(101)));
+}
+
+TEST(PackagedCall, TestCallBorrowedInputs) {
+  Json::Value message = MakeTesterCallMessage();
+
+  ArgumentPackagerBorrowing packager(message, vector<uint8_t>(1, 10));
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+  EXPECT_EQ(2, packager.borrow_count());
+
+  // Both inputs should have been read from the borrowed bytes, not the
+  // message.
+  Json::Value results = packager.GetResults();
+  EXPECT_EQ(20, results["outputs"]["f.0"]["host"][0].asInt());
+  EXPECT_EQ(83, results["outputs"]["f.1"]["host"][0].asInt());
+  EXPECT_EQ(147, results["outputs"]["f.2"]["host"][0].asInt());
+
+  // Borrowed bytes must cover the input's extents, just as copied ones do.
+  message["inputs"]["input1"]["extent"][0] = 2;
+  message["inputs"]["input1"]["host"].append(0);
+  ArgumentPackagerBorrowing short_packager(message, vector<uint8_t>(1, 10));
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &short_packager);
+  EXPECT_NE(0, status);
+}
+
+TEST(PackagedCall, TestCallMappedOutputs) {
+  Json::Value message = MakeTesterCallMessage();
+
+  ArgumentPackagerMapped packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  // The filter should have written directly into the mapped storage,
+  // which is packed as-is.
+  ASSERT_EQ(3u, packager.mapped().size());
+  const uint8_t kExpected[3] = {1, 64, 128};
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(1u, packager.mapped()[i]->size());
+    EXPECT_EQ(kExpected[i], (*packager.mapped()[i])[0]);
+  }
+  Json::Value results = packager.GetResults();
+  EXPECT_EQ("mapped", results["outputs"]["f.0"]["host"].asString());
+  EXPECT_EQ("mapped", results["outputs"]["f.1"]["host"].asString());
+  EXPECT_EQ("mapped", results["outputs"]["f.2"]["host"].asString());
+}
+
+TEST(PackagedCall, TestCallPaddedRows) {
+  // Two rows of 100 uint8 pixels, one channel.
+  Json::Value message = MakeTesterCallMessage();
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = 100;
+    input["extent"][1] = 2;
+    input["stride"][1] = 100;
+    input["stride"][2] = 200;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < 200; ++i) input["host"].append(i % 2);
+  }
+
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  // Each output row should be padded out to 128 bytes.
+  const Json::Value& f0 = packager.GetResults()["outputs"]["f.0"];
+  EXPECT_EQ(1, f0["stride"][0].asInt());
+  EXPECT_EQ(128, f0["stride"][1].asInt());
+  EXPECT_EQ(256, f0["stride"][2].asInt());
+  ASSERT_EQ(128u + 100u, f0["host"].size());
+  for (int y = 0; y < 2; ++y) {
+    for (int x = 0; x < 100; ++x) {
+      EXPECT_EQ(2 * (x % 2), f0["host"][y * 128 + x].asInt());
+    }
+  }
+}
+
+TEST(PackagedCall, TestCallLayoutVariants) {
+  // The strided filter would need its inputs copied; the (unconstrained)
+  // variant wouldn't, so it should be chosen.
+  packaged_call_runtime::HalideFilterInfo info = {
+      &packaged_call_tester_metadata, StridedTesterArgv, {}};
+  info.variants.push_back({"plain", &packaged_call_tester_metadata,
+                           packaged_call_tester_argv});
+  Json::Value message = MakeTesterCallMessage();
+  {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(nullptr, info,
+                                                         &packager, nullptr));
+    Json::Value results = packager.GetResults();
+    EXPECT_EQ("plain", results["variant"].asString());
+    EXPECT_EQ(64, results["outputs"]["f.1"]["host"][0].asInt());
+  }
+
+  // Cached results report the variant that computed them, just as the
+  // call that computed them did.
+  packaged_call_runtime::PackagedCallState state;
+  for (bool cache_hit : {false, true}) {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(nullptr, info,
+                                                         &packager, &state));
+    Json::Value results = packager.GetResults();
+    EXPECT_EQ(cache_hit, results["cache_hit"].asBool());
+    EXPECT_EQ("plain", results["variant"].asString());
+  }
+
+  // Inputs that already have the strided layout need no copy, so the
+  // filter itself should run.
+  for (const char* name : {"input1", "input2"}) {
+    message["inputs"][name]["stride"][0] = 2;
+  }
+  {
+    ArgumentPackagerJsoncpp packager(message);
+    EXPECT_EQ(0, packaged_call_runtime::MakePackagedCall(nullptr, info,
+                                                         &packager, nullptr));
+    Json::Value results = packager.GetResults();
+    EXPECT_EQ("default", results["variant"].asString());
+    EXPECT_EQ(64, results["outputs"]["f.1"]["host"][0].asInt());
+  }
+}
+
+TEST(PackagedCall, TestCallScalingSweep) {
+  Json::Value message = MakeTesterCallMessage();
+  message["iterations"] = 3;
+  halide_set_num_threads(3);
+
+  ResetNestedTaskRuns();
+  ArgumentPackagerJsoncpp packager(message);
+  packager.set_thread_counts({1, 2, 4});
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, ParallelTesterArgv, &packager);
+  EXPECT_EQ(0, status);
+  // Every task ran exactly once per run, at each thread count.
+  for (const auto& runs : gNestedTaskRuns) {
+    EXPECT_EQ(3 * 3, runs);
+  }
+  // The sweep doesn't change the thread count of later calls.
+  EXPECT_EQ(3, halide_set_num_threads(3));
+
+  Json::Value results = packager.GetResults();
+  const Json::Value& scaling = results["scaling"];
+  ASSERT_EQ(3u, scaling.size());
+  const int kThreads[3] = {1, 2, 4};
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(kThreads[i], scaling[i]["threads"].asInt());
+    EXPECT_TRUE(scaling[i]["time_usec"].isDouble());
+    EXPECT_TRUE(scaling[i]["speedup"].isDouble());
+    EXPECT_TRUE(scaling[i]["efficiency"].isDouble());
+  }
+  EXPECT_EQ(1.0, scaling[0]["speedup"].asDouble());
+  EXPECT_EQ(1.0, scaling[0]["efficiency"].asDouble());
+  EXPECT_EQ(64, results["outputs"]["f.1"]["host"][0].asInt());
+
+  // Nor does a sweep that fails part way through.
+  ArgumentPackagerJsoncpp failing_packager(message);
+  failing_packager.set_thread_counts({1, 2, 4});
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata,
+      [](void** args) {
+        const buffer_t* input1 = reinterpret_cast<buffer_t*>(args[1]);
+        return input1->host ? -1 : packaged_call_tester_argv(args);
+      },
+      &failing_packager);
+  EXPECT_NE(0, status);
+  EXPECT_EQ(3, halide_set_num_threads(3));
+
+  // Thread counts given in the message take precedence, and must be
+  // positive.
+  message["thread_counts"] = Json::Value(Json::arrayValue);
+  message["thread_counts"].append(0);
+  ArgumentPackagerJsoncpp bad_packager(message);
+  bad_packager.set_thread_counts({1, 2, 4});
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &bad_packager);
+  EXPECT_NE(0, status);
+}
+
+TEST(PackagedCall, TestCallWorkStealing) {
+  halide_do_par_for_t old_do_par_for =
+      halide_set_custom_do_par_for(packaged_call_runtime::WorkStealingDoParFor);
+
+  Json::Value message = MakeTesterCallMessage();
+  message["iterations"] = 3;
+  message["work_stealing"] = true;
+  ResetNestedTaskRuns();
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, ParallelTesterArgv, &packager);
+  EXPECT_EQ(0, status);
+
+  // Every task ran exactly once per run, even though nested loops were
+  // queued (and stolen) from the workers' own deques.
+  for (const auto& runs : gNestedTaskRuns) {
+    EXPECT_EQ(3, runs);
+  }
+
+  // One entry per worker, then one for the calling thread; between them,
+  // they ran every task of both loops.
+  Json::Value results = packager.GetResults();
+  const Json::Value& stats = results["work_stealing"];
+  ASSERT_LE(2u, stats.size());
+  int tasks = 0;
+  for (Json::ArrayIndex i = 0; i < stats.size(); ++i) {
+    const bool worker = i + 1 < stats.size();
+    EXPECT_EQ(worker ? static_cast<int>(i) : -1, stats[i]["worker"].asInt());
+    EXPECT_LE(0, stats[i]["tasks"].asInt());
+    EXPECT_LE(0, stats[i]["steals"].asInt());
+    EXPECT_EQ(worker, stats[i].isMember("idle_usec"));
+    tasks += stats[i]["tasks"].asInt();
+  }
+  EXPECT_EQ(3 * (kParallelTasks + kParallelTasks * kNestedTasks), tasks);
+  EXPECT_EQ(64, results["outputs"]["f.1"]["host"][0].asInt());
+
+  // Calls without the option aren't run on the pool at all.
+  message.removeMember("work_stealing");
+  ResetNestedTaskRuns();
+  ArgumentPackagerJsoncpp plain_packager(message);
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, ParallelTesterArgv,
+      &plain_packager);
+  EXPECT_EQ(0, status);
+  for (const auto& runs : gNestedTaskRuns) {
+    EXPECT_EQ(3, runs);
+  }
+  EXPECT_FALSE(plain_packager.GetResults().isMember("work_stealing"));
+
+  // The pool's size is fixed, so it can't be swept.
+  message["work_stealing"] = true;
+  message["thread_counts"] = Json::Value(Json::arrayValue);
+  message["thread_counts"].append(1);
+  ArgumentPackagerJsoncpp bad_packager(message);
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &bad_packager);
+  EXPECT_NE(0, status);
+
+  halide_set_custom_do_par_for(old_do_par_for);
+}
+
+TEST(PackagedCall, TestCallBinary) {
+  vector<uint64_t> message = MakeTesterBinaryCallMessage();
+  packaged_call_runtime::ArgumentPackagerBinary packager(
+      &packaged_call_tester_metadata,
+      reinterpret_cast<const uint8_t*>(message.data()),
+      message.size() * sizeof(uint64_t));
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  ASSERT_EQ(0, status);
+
+  vector<uint64_t> storage(packager.ResultsSize() / sizeof(uint64_t) + 1);
+  const uint8_t* results = reinterpret_cast<const uint8_t*>(storage.data());
+  packager.EncodeResults(reinterpret_cast<uint8_t*>(storage.data()));
+
+  const packaged_call_runtime::BinaryHeader* header =
+      reinterpret_cast<const packaged_call_runtime::BinaryHeader*>(results);
+  EXPECT_EQ(packaged_call_runtime::kBinaryMagic, header->magic);
+  EXPECT_EQ(packaged_call_runtime::kBinaryVersion, header->version);
+  ASSERT_EQ(3u, header->num_arguments);
+  const packaged_call_runtime::BinaryArgument* outputs =
+      reinterpret_cast<const packaged_call_runtime::BinaryArgument*>(header +
+                                                                     1);
+  // The same outputs as TestCall, in order.
+  const uint8_t kExpected[3] = {1, 64, 128};
+  for (int i = 0; i < 3; ++i) {
+    const packaged_call_runtime::BinaryArgument& d = outputs[i];
+    EXPECT_EQ(halide_argument_kind_output_buffer, d.kind);
+    EXPECT_EQ(halide_type_uint, d.type_code);
+    EXPECT_EQ(8, d.type_bits);
+    EXPECT_EQ(3, d.dimensions);
+    EXPECT_EQ(1, d.elem_size);
+    EXPECT_EQ(1, d.extent[0]);
+    EXPECT_EQ(1, d.extent[2]);
+    EXPECT_EQ(0u, d.host_offset % packaged_call_runtime::kBinaryAlignment);
+    ASSERT_EQ(1u, d.host_size);
+    EXPECT_EQ(kExpected[i], results[d.host_offset]);
+  }
+
+  // Everything else is in the results JSON, at the end.
+  EXPECT_EQ(packager.ResultsSize(),
+            header->results_offset + header->results_size);
+  Json::Value json;
+  ASSERT_TRUE(Json::Reader().parse(
+      string(reinterpret_cast<const char*>(results + header->results_offset),
+             header->results_size),
+      json));
+  EXPECT_TRUE(json["time_usec"].isNumeric());
+  EXPECT_TRUE(json["phase_usec"]["run"].isNumeric());
+  EXPECT_TRUE(json["memory"]["peak_bytes"].isNumeric());
+  EXPECT_FALSE(json.isMember("outputs"));
+}
+
+TEST(PackagedCall, TestCallBinaryMalformed) {
+  const size_t kSize =
+      MakeTesterBinaryCallMessage().size() * sizeof(uint64_t);
+  packaged_call_runtime::BinaryArgument* args;
+  const auto Call = [](const vector<uint64_t>& message, size_t size) {
+    packaged_call_runtime::ArgumentPackagerBinary packager(
+        &packaged_call_tester_metadata,
+        reinterpret_cast<const uint8_t*>(message.data()), size);
+    return packaged_call_runtime::MakePackagedCall(
+        nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+        &packager);
+  };
+
+  vector<uint64_t> message = MakeTesterBinaryCallMessage();
+  EXPECT_EQ(0, Call(message, kSize));
+  // Truncated, just before the contents of the last input.
+  EXPECT_NE(0, Call(message, packaged_call_runtime::kBinaryAlignment * 65));
+  EXPECT_NE(0, Call(message, sizeof(packaged_call_runtime::BinaryHeader)));
+
+  // Bad magic.
+  message = MakeTesterBinaryCallMessage();
+  reinterpret_cast<packaged_call_runtime::BinaryHeader*>(message.data())
+      ->magic = 0;
+  EXPECT_NE(0, Call(message, kSize));
+
+  // A scalar of the wrong type.
+  message = MakeTesterBinaryCallMessage();
+  args = reinterpret_cast<packaged_call_runtime::BinaryArgument*>(
+      reinterpret_cast<packaged_call_runtime::BinaryHeader*>(message.data()) +
+      1);
+  args[3].type_bits = 64;
+  EXPECT_NE(0, Call(message, kSize));
+
+  // An input whose contents lie outside the message.
+  message = MakeTesterBinaryCallMessage();
+  args = reinterpret_cast<packaged_call_runtime::BinaryArgument*>(
+      reinterpret_cast<packaged_call_runtime::BinaryHeader*>(message.data()) +
+      1);
+  args[1].host_offset = kSize;
+  EXPECT_NE(0, Call(message, kSize));
+
+  // An input too small for its extents.
+  message = MakeTesterBinaryCallMessage();
+  args = reinterpret_cast<packaged_call_runtime::BinaryArgument*>(
+      reinterpret_cast<packaged_call_runtime::BinaryHeader*>(message.data()) +
+      1);
+  args[2].extent[0] = 2;
+  EXPECT_NE(0, Call(message, kSize));
+
+  // An input whose extents and strides are so large that, in 32 bits,
+  // each (extent - 1) * stride would wrap around to 0, leaving it one
+  // element in size.
+  message = MakeTesterBinaryCallMessage();
+  args = reinterpret_cast<packaged_call_runtime::BinaryArgument*>(
+      reinterpret_cast<packaged_call_runtime::BinaryHeader*>(message.data()) +
+      1);
+  for (int j = 0; j < 3; ++j) {
+    args[1].extent[j] = 65537;
+    args[1].stride[j] = 65536;
+  }
+  EXPECT_NE(0, Call(message, kSize));
+  args[1].extent[1] = args[1].extent[2] = 1;
+  EXPECT_NE(0, Call(message, kSize));
+}
+
+TEST(PackagedCall, TestCallJsonMalformed) {
+  const auto Call = [](const Json::Value& message) {
+    ArgumentPackagerJsoncpp packager(message);
+    return packaged_call_runtime::MakePackagedCall(
+        nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+        &packager);
+  };
+
+  Json::Value message = MakeTesterCallMessage();
+  EXPECT_EQ(0, Call(message));
+
+  // An input too small for its extents.
+  message = MakeTesterCallMessage();
+  message["inputs"]["input1"]["extent"][0] = 2;
+  EXPECT_NE(0, Call(message));
+
+  // An input whose extents and strides are so large that, in 32 bits,
+  // they would wrap around to a single element.
+  message = MakeTesterCallMessage();
+  for (int j = 0; j < 3; ++j) {
+    message["inputs"]["input1"]["extent"][j] = 65537;
+    message["inputs"]["input1"]["stride"][j] = 65536;
+  }
+  EXPECT_NE(0, Call(message));
+
+  // Negative strides, and an elem_size that doesn't match the type.
+  message = MakeTesterCallMessage();
+  message["inputs"]["input1"]["extent"][0] = 2;
+  message["inputs"]["input1"]["stride"][0] = -1;
+  message["inputs"]["input1"]["host"].append(0);
+  EXPECT_NE(0, Call(message));
+  message = MakeTesterCallMessage();
+  message["inputs"]["input1"]["elem_size"] = 2;
+  message["inputs"]["input1"]["host"].append(0);
+  EXPECT_NE(0, Call(message));
+}
+
+TEST(PackagedCall, TestScalingSweepThreadCounts) {
+  EXPECT_EQ(vector<int32_t>({1}),
+            packaged_call_runtime::ScalingSweepThreadCounts(1));
+  EXPECT_EQ(vector<int32_t>({1, 2, 4, 8}),
+            packaged_call_runtime::ScalingSweepThreadCounts(8));
+  EXPECT_EQ(vector<int32_t>({1, 2, 4, 6}),
+            packaged_call_runtime::ScalingSweepThreadCounts(6));
+}
+
+TEST(PackagedCall, TestCallTiled) {
+  // A 5x3 image, run in 2x2 tiles.
+  Json::Value message = MakeTesterCallMessage();
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = 5;
+    input["extent"][1] = 3;
+    input["stride"][1] = 5;
+    input["stride"][2] = 15;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int y = 0; y < 3; ++y) {
+      for (int x = 0; x < 5; ++x) {
+        input["host"].append(name[5] == '1' ? x + 10 * y : 1);
+      }
+    }
+  }
+  message["tile_extent"][0] = 2;
+  message["tile_extent"][1] = 2;
+
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  Json::Value results = packager.GetResults();
+  EXPECT_FALSE(results.isMember("outputs"));
+  EXPECT_EQ(6, results["tiling"]["count"].asInt());
+  const Json::Value& tiles = results["tiles"];
+  ASSERT_EQ(6u, tiles.size());
+  int pixels = 0;
+  for (const Json::Value& tile : tiles) {
+    const Json::Value& f0 = tile["outputs"]["f.0"];
+    const int min_x = f0["min"][0].asInt(), min_y = f0["min"][1].asInt();
+    const int width = f0["extent"][0].asInt();
+    const int height = f0["extent"][1].asInt();
+    EXPECT_EQ(min_x % 2, 0);
+    EXPECT_EQ(min_y % 2, 0);
+    EXPECT_EQ(std::min(2, 5 - min_x), width);
+    EXPECT_EQ(std::min(2, 3 - min_y), height);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const int offset = x * f0["stride"][0].asInt() +
+                           y * f0["stride"][1].asInt();
+        EXPECT_EQ(min_x + x + 10 * (min_y + y) + 1,
+                  f0["host"][offset].asInt());
+        ++pixels;
+      }
+    }
+  }
+  EXPECT_EQ(15, pixels);
+
+  // Tiled calls can't also be benchmarked.
+  message["iterations"] = 2;
+  ArgumentPackagerJsoncpp benchmark_packager(message);
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &benchmark_packager);
+  EXPECT_NE(0, status);
+}
+
+TEST(PackagedCall, TestCallTiledLayout) {
+  // A 130x3 image, run in 100x2 tiles.
+  Json::Value message = MakeTesterCallMessage();
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = 130;
+    input["extent"][1] = 3;
+    input["stride"][1] = 130;
+    input["stride"][2] = 390;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < 390; ++i) input["host"].append(i % 7);
+  }
+  message["tile_extent"][0] = 100;
+  message["tile_extent"][1] = 2;
+
+  // Each tile is laid out as an untiled call of its size would be: rows
+  // wide enough to pad are padded, and those of a filter that constrains
+  // its output strides meet that constraint, at the edges too.
+  for (packaged_call_runtime::ArgvFunc argv_func :
+       {packaged_call_tester_argv, RowPitchTesterArgv}) {
+    ArgumentPackagerJsoncpp packager(message);
+    int status = packaged_call_runtime::MakePackagedCall(
+        nullptr, &packaged_call_tester_metadata, argv_func, &packager);
+    EXPECT_EQ(0, status);
+
+    const Json::Value& tiles = packager.GetResults()["tiles"];
+    ASSERT_EQ(4u, tiles.size());
+    for (const Json::Value& tile : tiles) {
+      const Json::Value& f0 = tile["outputs"]["f.0"];
+      const int min_x = f0["min"][0].asInt(), min_y = f0["min"][1].asInt();
+      const int width = f0["extent"][0].asInt();
+      const int height = f0["extent"][1].asInt();
+      EXPECT_EQ(1, f0["stride"][0].asInt());
+      if (argv_func == RowPitchTesterArgv) {
+        EXPECT_EQ(160, f0["stride"][1].asInt());
+      } else {
+        EXPECT_EQ(width == 100 ? 128 : width, f0["stride"][1].asInt());
+      }
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          const int i = min_x + x + 130 * (min_y + y);
+          EXPECT_EQ(2 * (i % 7),
+                    f0["host"][x + y * f0["stride"][1].asInt()].asInt());
+        }
+      }
+    }
+  }
+}
+
+TEST(PackagedCall, TestCallOutputCrop) {
+  // A 5x3 image, of which only the 3x2 region at (1, 1) is computed.
+  Json::Value message = MakeTesterCallMessage();
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = 5;
+    input["extent"][1] = 3;
+    input["stride"][1] = 5;
+    input["stride"][2] = 15;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int y = 0; y < 3; ++y) {
+      for (int x = 0; x < 5; ++x) {
+        input["host"].append(name[5] == '1' ? x + 10 * y : 1);
+      }
+    }
+  }
+  message["output_crop"]["min"][0] = 1;
+  message["output_crop"]["min"][1] = 1;
+  message["output_crop"]["extent"][0] = 3;
+  message["output_crop"]["extent"][1] = 2;
+
+  // The strided tester needs its inputs copied, which should copy only
+  // the region needed for the crop.
+  for (packaged_call_runtime::ArgvFunc argv_func :
+       {packaged_call_tester_argv, StridedTesterArgv}) {
+    ArgumentPackagerJsoncpp packager(message);
+    int status = packaged_call_runtime::MakePackagedCall(
+        nullptr, &packaged_call_tester_metadata, argv_func, &packager);
+    EXPECT_EQ(0, status);
+
+    const Json::Value& f0 = packager.GetResults()["outputs"]["f.0"];
+    EXPECT_EQ(1, f0["min"][0].asInt());
+    EXPECT_EQ(1, f0["min"][1].asInt());
+    ASSERT_EQ(3, f0["extent"][0].asInt());
+    ASSERT_EQ(2, f0["extent"][1].asInt());
+    for (int y = 0; y < 2; ++y) {
+      for (int x = 0; x < 3; ++x) {
+        const int offset = x * f0["stride"][0].asInt() +
+                           y * f0["stride"][1].asInt();
+        EXPECT_EQ(1 + x + 10 * (1 + y) + 1, f0["host"][offset].asInt());
+      }
+    }
+  }
+
+  // min and extent must agree.
+  message["output_crop"]["min"].resize(1);
+  ArgumentPackagerJsoncpp bad_packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &bad_packager);
+  EXPECT_NE(0, status);
+}
+
+TEST(PackagedCall, TestCallProgressive) {
+  // Small inputs aren't worth previewing.
+  Json::Value message = MakeTesterCallMessage();
+  message["progressive"] = true;
+  {
+    ArgumentPackagerJsoncpp packager(message);
+    int status = packaged_call_runtime::MakePackagedCall(
+        nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+        &packager);
+    EXPECT_EQ(0, status);
+    EXPECT_FALSE(packager.GetResults().isMember("preview"));
+  }
+
+  // A 260x256 image, just over kMaxPreviewPixels, is previewed at half
+  // size; input1 is uniform within each 2x2 block, so its average is exact.
+  const int kWidth = 260, kHeight = 256;
+  ASSERT_GT(kWidth * kHeight, packaged_call_runtime::kMaxPreviewPixels);
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = kWidth;
+    input["extent"][1] = kHeight;
+    input["stride"][1] = kWidth;
+    input["stride"][2] = kWidth * kHeight;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int y = 0; y < kHeight; ++y) {
+      for (int x = 0; x < kWidth; ++x) {
+        input["host"].append(name[5] == '1' ? (x / 2) % 50 : 1);
+      }
+    }
+  }
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  const Json::Value& results = packager.GetResults();
+  EXPECT_TRUE(results["phase_usec"]["preview"].isNumeric());
+  const Json::Value& preview = results["preview"];
+  EXPECT_EQ(2, preview["preview"]["factor"].asInt());
+  EXPECT_TRUE(preview["time_usec"].isNumeric());
+  const Json::Value& f0 = preview["outputs"]["f.0"];
+  ASSERT_EQ(kWidth / 2, f0["extent"][0].asInt());
+  ASSERT_EQ(kHeight / 2, f0["extent"][1].asInt());
+  for (int y = 0; y < kHeight / 2; y += 17) {
+    for (int x = 0; x < kWidth / 2; ++x) {
+      const int offset = x * f0["stride"][0].asInt() +
+                         y * f0["stride"][1].asInt();
+      EXPECT_EQ(x % 50 + 1, f0["host"][offset].asInt());
+    }
+  }
+  EXPECT_EQ(kWidth, results["outputs"]["f.0"]["extent"][0].asInt());
+  EXPECT_EQ(kHeight, results["outputs"]["f.0"]["extent"][1].asInt());
+
+  // Previews can't be tiled.
+  message["tile_extent"][0] = 64;
+  message["tile_extent"][1] = 64;
+  ArgumentPackagerJsoncpp tiled_packager(message);
+  status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &tiled_packager);
+  EXPECT_NE(0, status);
+}
+
+TEST(PackagedCall, TestCallProgressiveUnsupportedTypes) {
+  // There are no box filters for signed or 32-bit integer elements (one
+  // for uint8 or float32 would get the averages wrong), so calls with such
+  // inputs aren't previewed at all.
+  for (int type_code : {halide_type_int, halide_type_uint}) {
+    const int type_bits = type_code == halide_type_int ? 8 : 32;
+    buffer_t buf = {};
+    uint8_t host[4] = {};
+    buf.host = host;
+    buf.extent[0] = 1;
+    buf.stride[0] = 1;
+    buf.elem_size = type_bits / 8;
+    buffer_t dst = buf;
+    EXPECT_FALSE(
+        packaged_call_runtime::Downsample(type_code, type_bits, &buf, 2, &dst));
+  }
+
+  // The tester as if its inputs were int8.
+  vector<halide_filter_argument_t> arguments(
+      packaged_call_tester_metadata.arguments,
+      packaged_call_tester_metadata.arguments +
+          packaged_call_tester_metadata.num_arguments);
+  for (halide_filter_argument_t& a : arguments) {
+    if (a.kind == halide_argument_kind_input_buffer) {
+      a.type_code = halide_type_int;
+    }
+  }
+  halide_filter_metadata_t metadata = packaged_call_tester_metadata;
+  metadata.arguments = arguments.data();
+
+  const int kWidth = 260, kHeight = 256;
+  Json::Value message = MakeTesterCallMessage();
+  message["progressive"] = true;
+  for (const char* name : {"input1", "input2"}) {
+    Json::Value& input = message["inputs"][name];
+    input["extent"][0] = kWidth;
+    input["extent"][1] = kHeight;
+    input["stride"][1] = kWidth;
+    input["stride"][2] = kWidth * kHeight;
+    input["host"] = Json::Value(Json::arrayValue);
+    for (int i = 0; i < kWidth * kHeight; ++i) {
+      input["host"].append(i % 2 ? 1 : 255);
+    }
+  }
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &metadata, packaged_call_tester_argv, &packager);
+  EXPECT_EQ(0, status);
+  const Json::Value& results = packager.GetResults();
+  EXPECT_FALSE(results.isMember("preview"));
+  EXPECT_EQ(kWidth, results["outputs"]["f.0"]["extent"][0].asInt());
+}
+
+TEST(PackagedCall, TestCallBatch) {
+  // The first entry uses the shared inputs as-is; the second overrides
+  // input2.
+  Json::Value message = MakeTesterCallMessage();
+  message["verb"] = "call_batch";
+  message["batch"] = Json::Value(Json::arrayValue);
+  message["batch"].append(Json::Value(Json::objectValue));
+  Json::Value entry(Json::objectValue);
+  entry["inputs"]["input2"] = message["inputs"]["input2"];
+  entry["inputs"]["input2"]["host"][0] = 5;
+  message["batch"].append(entry);
+
+  ArgumentPackagerJsoncpp packager(message);
+  EXPECT_EQ(2, packager.BatchSize());
+  int status = packaged_call_runtime::MakePackagedCallBatch(
+      nullptr, {&packaged_call_tester_metadata, packaged_call_tester_argv, {}},
+      &packager, nullptr);
+  EXPECT_EQ(0, status);
+
+  Json::Value results = packager.GetResults();
+  EXPECT_TRUE(results["time_usec"].isDouble());
+  EXPECT_FALSE(results.isMember("outputs"));
+  const Json::Value& batch = results["batch"];
+  ASSERT_EQ(2u, batch.size());
+  EXPECT_TRUE(batch[0]["time_usec"].isDouble());
+  EXPECT_TRUE(batch[1]["time_usec"].isDouble());
+  EXPECT_EQ(1, batch[0]["outputs"]["f.0"]["host"][0].asInt());
+  EXPECT_EQ(5, batch[1]["outputs"]["f.0"]["host"][0].asInt());
+  EXPECT_EQ(68, batch[1]["outputs"]["f.1"]["host"][0].asInt());
+}
+
+TEST(PackagedCall, TestCallBatchFailure) {
+  // A batch entry whose inputs are invalid should fail the whole batch.
+  Json::Value message = MakeTesterCallMessage();
+  message["batch"] = Json::Value(Json::arrayValue);
+  Json::Value entry(Json::objectValue);
+  entry["inputs"]["input1"] = "bogus";
+  message["batch"].append(entry);
+
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCallBatch(
+      nullptr, {&packaged_call_tester_metadata, packaged_call_tester_argv, {}},
+      &packager, nullptr);
+  EXPECT_NE(0, status);
+
+  // Plain "call" messages aren't batches.
+  ArgumentPackagerJsoncpp plain_packager(MakeTesterCallMessage());
+  EXPECT_EQ(-1, plain_packager.BatchSize());
+}
+
+TEST(PackagedCall, TestCallDigestsOnly) {
+  Json::Value message = MakeTesterCallMessage();
+  message["digests_only"] = true;
+
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  // f.1 is a single byte, 64 (i.e., "@").
+  buffer_t expected = {0};
+  uint8_t byte = 64;
+  expected.host = &byte;
+  expected.elem_size = 1;
+  expected.extent[0] = 1;
+  expected.stride[0] = 1;
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx",
+           static_cast<unsigned long long>(
+               packaged_call_runtime::HashBuffer(expected, 1)));
+
+  const Json::Value& f1 = packager.GetResults()["outputs"]["f.1"];
+  EXPECT_FALSE(f1.isMember("host"));
+  EXPECT_EQ(hex, f1["digest"].asString());
+  EXPECT_EQ(1, f1["extent"][0].asInt());
+}
+
+TEST(PackagedCall, TestHashBuffer) {
+  // Known XXH64 values, with seed 0.
+  uint8_t abc[3] = {'a', 'b', 'c'};
+  buffer_t buf = {0};
+  buf.host = abc;
+  buf.elem_size = 1;
+  buf.extent[0] = 3;
+  buf.stride[0] = 1;
+  EXPECT_EQ(0x44BC2CF5AD770999ULL, packaged_call_runtime::HashBuffer(buf, 1));
+  buf.extent[0] = 0;
+  EXPECT_EQ(0xEF46DB3751D8E999ULL, packaged_call_runtime::HashBuffer(buf, 1));
+
+  const string kLong = "Nobody inspects the spammish repetition";
+  buf.host = reinterpret_cast<uint8_t*>(const_cast<char*>(kLong.data()));
+  buf.extent[0] = kLong.size();
+  EXPECT_EQ(0xFBCEA83C8A378BF1ULL, packaged_call_runtime::HashBuffer(buf, 1));
+
+  // Only the elements themselves are hashed, so padding and layout
+  // don't matter: a 3x2 buffer, with a row stride of 4, hashes the same as
+  // the same elements packed tightly.
+  uint8_t padded[8] = {'a', 'b', 'c', 0, 'd', 'e', 'f', 0};
+  uint8_t packed[6] = {'a', 'b', 'c', 'd', 'e', 'f'};
+  buffer_t padded_buf = {0}, packed_buf = {0};
+  padded_buf.host = padded;
+  packed_buf.host = packed;
+  padded_buf.elem_size = packed_buf.elem_size = 1;
+  padded_buf.extent[0] = packed_buf.extent[0] = 3;
+  padded_buf.extent[1] = packed_buf.extent[1] = 2;
+  padded_buf.stride[0] = packed_buf.stride[0] = 1;
+  padded_buf.stride[1] = 4;
+  packed_buf.stride[1] = 3;
+  EXPECT_EQ(packaged_call_runtime::HashBuffer(packed_buf, 2),
+            packaged_call_runtime::HashBuffer(padded_buf, 2));
+}
+
+TEST(PackagedCall, TestCallBadOptions) {
+  Json::Value message = MakeTesterCallMessage();
+  message["iterations"] = 0;
+
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_NE(0, status);
+}
+
+TEST(PackagedCall, TestMemoryStats) {
+  int context = 0;
+  packaged_call_runtime::MemoryStats stats;
+  void* a;
+  void* b;
+  {
+    packaged_call_runtime::ScopedMemoryStats scope(&context, &stats);
+    a = packaged_call_runtime::TrackedMalloc(&context, 100);
+    b = packaged_call_runtime::TrackedMalloc(&context, 300);
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(a) % 32);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(b) % 32);
+    packaged_call_runtime::TrackedFree(&context, a);
+    a = packaged_call_runtime::TrackedMalloc(&context, 200);
+    // Other user_contexts aren't accounted to stats.
+    packaged_call_runtime::TrackedFree(
+        nullptr, packaged_call_runtime::TrackedMalloc(nullptr, 1000));
+    packaged_call_runtime::TrackedFree(&context, b);
+  }
+  // Nor is anything after the scope ends.
+  packaged_call_runtime::TrackedFree(&context, a);
+
+  packaged_call_runtime::ResultStats expected;
+  expected["current_bytes"] = 200;
+  expected["peak_bytes"] = 500;
+  expected["allocs"] = 3;
+  expected["largest_alloc_bytes"] = 300;
+  EXPECT_EQ(expected, stats.GetStats());
+
+  // Overlapping scopes for the same user_context may end out of order;
+  // allocations go to the innermost live one, and none to a scope that
+  // has ended.
+  unique_ptr<packaged_call_runtime::MemoryStats> outer_stats(
+      new packaged_call_runtime::MemoryStats);
+  packaged_call_runtime::MemoryStats inner_stats;
+  unique_ptr<packaged_call_runtime::ScopedMemoryStats> outer(
+      new packaged_call_runtime::ScopedMemoryStats(&context,
+                                                   outer_stats.get()));
+  {
+    packaged_call_runtime::ScopedMemoryStats inner(&context, &inner_stats);
+    outer.reset();
+    outer_stats.reset();
+    packaged_call_runtime::TrackedFree(
+        &context, packaged_call_runtime::TrackedMalloc(&context, 10));
+  }
+  packaged_call_runtime::TrackedFree(
+      &context, packaged_call_runtime::TrackedMalloc(&context, 20));
+  EXPECT_EQ(1, inner_stats.GetStats()["allocs"]);
+}
+
+int TracedTask(void* user_context, int idx, uint8_t* closure) {
+  return idx == 3 ? -1 : 0;
+}
+
+TEST(PackagedCall, TestCallTrace) {
+  int context = 0;
+  packaged_call_runtime::CallTrace trace;
+  {
+    packaged_call_runtime::ScopedCallTrace scope(&context, &trace);
+    halide_trace_event event;
+    memset(&event, 0, sizeof(event));
+    event.func = "pipeline";
+    event.event = halide_trace_begin_pipeline;
+    const int32_t pipeline_id =
+        packaged_call_runtime::TracingTrace(&context, &event);
+    event.func = "f";
+    event.event = halide_trace_begin_realization;
+    event.parent_id = pipeline_id;
+    const int32_t f_id = packaged_call_runtime::TracingTrace(&context, &event);
+    EXPECT_NE(pipeline_id, f_id);
+    EXPECT_EQ(0, packaged_call_runtime::TracingDoTask(&context, TracedTask, 2,
+                                                      nullptr));
+    // Results of the task are passed through.
+    EXPECT_EQ(-1, packaged_call_runtime::TracingDoTask(&context, TracedTask,
+                                                       3, nullptr));
+    // Other user_contexts aren't traced.
+    EXPECT_EQ(0, packaged_call_runtime::TracingDoTask(nullptr, TracedTask, 4,
+                                                      nullptr));
+    event.event = halide_trace_end_realization;
+    event.parent_id = f_id;
+    packaged_call_runtime::TracingTrace(&context, &event);
+    // The pipeline never ends, so it's left out.
+  }
+  EXPECT_EQ(0, packaged_call_runtime::TracingDoTask(&context, TracedTask, 5,
+                                                    nullptr));
+
+  Json::Value json;
+  ASSERT_TRUE(Json::Reader().parse(trace.ToJson(), json));
+  const Json::Value& events = json["traceEvents"];
+  ASSERT_EQ(3u, events.size());
+  // Spans are listed in the order they began.
+  EXPECT_EQ("f", events[0]["name"].asString());
+  EXPECT_EQ("realization", events[0]["cat"].asString());
+  EXPECT_EQ("task", events[1]["name"].asString());
+  EXPECT_EQ(2, events[1]["args"]["index"].asInt());
+  EXPECT_EQ(3, events[2]["args"]["index"].asInt());
+  for (const Json::Value& e : events) {
+    EXPECT_EQ("X", e["ph"].asString());
+    EXPECT_EQ(0, e["tid"].asInt());
+    EXPECT_LE(0.0, e["ts"].asDouble());
+    EXPECT_LE(0.0, e["dur"].asDouble());
+  }
+  // The realization encloses the tasks.
+  EXPECT_GE(events[0]["ts"].asDouble() + events[0]["dur"].asDouble(),
+            events[2]["ts"].asDouble() + events[2]["dur"].asDouble());
+}
+
+TEST(PackagedCall, TestCallTraced) {
+  Json::Value message = MakeTesterCallMessage();
+  message["trace"] = true;
+  ArgumentPackagerJsoncpp packager(message);
+  int status = packaged_call_runtime::MakePackagedCall(
+      nullptr, &packaged_call_tester_metadata, packaged_call_tester_argv,
+      &packager);
+  EXPECT_EQ(0, status);
+
+  Json::Value results = packager.GetResults();
+  ASSERT_TRUE(results["trace"].isString());
+  Json::Value trace;
+  ASSERT_TRUE(Json::Reader().parse(results["trace"].asString(), trace));
+  EXPECT_TRUE(trace["traceEvents"].isArray());
+  EXPECT_EQ(64, results["outputs"]["f.1"]["host"][0].asInt());
+}
+
+TEST(BufferPool, TestReuse) {
+  packaged_call_runtime::BufferPool pool(1 << 20);
+  packaged_call_runtime::BufferPool::Block block;
+  EXPECT_TRUE(pool.Acquire(10000, &block));
+  EXPECT_GE(block.size, 10000u);
+  const uint8_t* data = block.data.get();
+  pool.Release(std::move(block));
+  EXPECT_GT(pool.idle_bytes(), 0u);
+
+  // A slightly different size should land in the same bucket.
+  packaged_call_runtime::BufferPool::Block reused;
+  EXPECT_TRUE(pool.Acquire(10100, &reused));
+  EXPECT_EQ(data, reused.data.get());
+  EXPECT_EQ(0u, pool.idle_bytes());
+}
+
+TEST(BufferPool, TestEviction) {
+  packaged_call_runtime::BufferPool pool(64 * 1024);
+  packaged_call_runtime::BufferPool::Block a, b, huge;
+  EXPECT_TRUE(pool.Acquire(40 * 1024, &a));
+  EXPECT_TRUE(pool.Acquire(40 * 1024, &b));
+  EXPECT_TRUE(pool.Acquire(1024 * 1024, &huge));
+  const uint8_t* b_data = b.data.get();
+
+  // Blocks larger than the cap are never kept.
+  pool.Release(std::move(huge));
+  EXPECT_EQ(0u, pool.idle_bytes());
+
+  // Releasing both blocks exceeds the cap, so the least recently
+  // released one is evicted.
+  pool.Release(std::move(a));
+  pool.Release(std::move(b));
+  EXPECT_LE(pool.idle_bytes(), 64u * 1024);
+  packaged_call_runtime::BufferPool::Block reused;
+  EXPECT_TRUE(pool.Acquire(40 * 1024, &reused));
+  EXPECT_EQ(b_data, reused.data.get());
+  EXPECT_EQ(0u, pool.idle_bytes());
+}
+
 }  // namespace
 }  // namespace photos_editing_halide
 
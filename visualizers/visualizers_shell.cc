@@ -47,6 +47,7 @@ class VisualizersInstance : public NexeVerbHandlerInstance {
  public:
   explicit VisualizersInstance(PP_Instance instance)
       : NexeVerbHandlerInstance(instance) {}
+  virtual ~VisualizersInstance() { StopWorkers(); }
 
  protected:
   virtual void HandleVerb(const std::string& verb,
@@ -191,8 +192,8 @@ namespace pp {
 Module* CreateModule() { return new VisualizersModule(); }
 }  // namespace pp
 
-extern "C" void halide_error(void* /* user_context */, const char* msg) {
-  NexeVerbHandlerInstance::AttemptFailure(msg);
+extern "C" void halide_error(void* user_context, const char* msg) {
+  NexeVerbHandlerInstance::AttemptFailure(user_context, msg);
 }
 #else
 // Provide a stub 'main' so that :all targets will build.